@@ -1,65 +1,2824 @@
+#define _GNU_SOURCE
 #include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <errno.h>
+#include <fnmatch.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+ssize_t tar_pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = pread(fd, (char *)buf + done, len - done, offset + done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        tar_stats_read(offset + done, r, 1);
+        if (r == 0) break;
+        done += r;
+    }
+    return done;
+}
+
+int tar_write_full(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        buf = (const char *)buf + w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*                          Header validation kernel                         */
+/* ------------------------------------------------------------------------- */
+
+#define CHKSUM_OFFSET 148
+#define CHKSUM_LEN 8
+#define CHECK_CHUNK (256 * 1024) // bytes read at once while walking the archive in check_archive()
+
+/* Sum of the 512 unsigned bytes of a header block, zero only for a null block. */
+static uint32_t block_sum_scalar(const uint8_t *block) {
+    uint32_t sum = 0;
+    for (int i = 0; i < 512; i++) sum += block[i];
+    return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t block_sum_sse2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (int i = 0; i < 512; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(block + i)), zero));
+    }
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+__attribute__((target("avx2")))
+static uint32_t block_sum_avx2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (int i = 0; i < 512; i += 32) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(block + i)), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+}
+#endif
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) crc = crc32c_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; len > 0; buf++, len--) crc = _mm_crc32_u8(crc, *buf);
+    return crc;
+}
+#endif
+
+static uint32_t (*block_sum_kernel)(const uint8_t *);
+static uint32_t (*crc32c_kernel)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* Picks the fastest kernels supported by the CPU. */
+static void kernels_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1)); // Castagnoli polynomial
+        crc32c_table[i] = crc;
+    }
+
+    block_sum_kernel = block_sum_scalar;
+    crc32c_kernel = crc32c_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) block_sum_kernel = block_sum_sse2;
+    if (__builtin_cpu_supports("avx2")) block_sum_kernel = block_sum_avx2;
+#endif
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crc32c_kernel = crc32c_sse42;
+#endif
+}
+
+static uint32_t block_sum(const uint8_t *block) {
+    return block_sum_kernel(block);
+}
+
+/**
+ * Checks the checksum of a header block.
+ * The checksum is the sum of the unsigned bytes of the header, the chksum field counting as spaces. Some old
+ * archivers summed signed bytes instead, both are accepted.
+ *
+ * @param block A header block.
+ * @param sum The value of block_sum() for that block.
+ */
+static int checksum_ok(const uint8_t *block, uint32_t sum) {
+    const tar_header_t *header = (const tar_header_t *)block;
+    long chksum = TAR_INT(header->chksum);
+    for (int i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_LEN; i++) sum -= block[i];
+    sum += CHKSUM_LEN * ' ';
+    if (chksum == sum) return 1;
+
+    long signed_sum = sum;
+    for (int i = 0; i < 512; i++) {
+        if ((i < CHKSUM_OFFSET || i >= CHKSUM_OFFSET + CHKSUM_LEN) && block[i] >= 0x80) signed_sum -= 256;
+    }
+    return chksum == signed_sum;
+}
+
+/**
+ * Validates a non-null header block.
+ *
+ * @param block A header block.
+ * @param sum The value of block_sum() for that block.
+ *
+ * @return zero if the header is valid, or the error code of check_archive().
+ */
+static int header_check(const uint8_t *block, uint32_t sum) {
+    const tar_header_t *header = (const tar_header_t *)block;
+
+    if (memcmp(header->magic, TMAGIC, TMAGLEN) != 0) return -1; // magic error
+    if (memcmp(header->version, TVERSION, TVERSLEN) != 0) return -2; // version error
+    return checksum_ok(block, sum) ? 0 : -3; // checksum error
+}
+
+#define GNU_MAGIC "ustar  " // magic and version fields of the archives written by GNU tar in its own format
+
+/**
+ * Whether a header can be indexed: a ustar header, or a header of GNU tar which holds long names in extended headers.
+ */
+static int header_known(const tar_header_t *header) {
+    return memcmp(header->magic, TMAGIC, TMAGLEN) == 0 || memcmp(header->magic, GNU_MAGIC, sizeof(GNU_MAGIC)) == 0;
+}
+
+#define WALK_READ_ERROR (-4) // a read error of walk_headers(), apart from the errors of the archive itself
+
+/**
+ * Walks the header chain of an archive, reading it by large chunks.
+ * The walk ends on two null blocks.
+ *
+ * @param visit Called on every non-null header with its offset in the archive, stops the walk if it returns a
+ *              non-zero value.
+ *
+ * @return the number of headers visited, WALK_READ_ERROR if the archive could not be read, -1 on a malformed end of
+ *         archive, or the non-zero value returned by visit.
+ */
+static int walk_headers(int tar_fd, uint64_t start,
+                        int (*visit)(void *ctx, const uint8_t *block, uint32_t sum, uint64_t offset), void *ctx) {
+    uint8_t *buffer = malloc(CHECK_CHUNK);
+    if (buffer == NULL) return WALK_READ_ERROR;
+
+    pthread_once(&kernels_once, kernels_init);
+
+    uint64_t buffer_offset = 0; // offset in the archive of the first byte of the buffer
+    size_t buffer_len = 0;
+    uint64_t offset = start;    // offset in the archive of the next header
+    int null_blocks = 0;
+    int counter = 0;
+    int ret;
+
+    while (1) {
+        // refill the buffer from the next header when it is not entirely in it
+        if (offset < buffer_offset || offset + TAR_BLOCK > buffer_offset + buffer_len) {
+            ssize_t r = tar_pread_full(tar_fd, buffer, CHECK_CHUNK, offset);
+            if (r < 0) { ret = WALK_READ_ERROR; break; }
+
+            buffer_offset = offset;
+            buffer_len = r;
+            if (buffer_len < TAR_BLOCK) { ret = null_blocks ? counter : -1; break; } // end of the file
+        }
+
+        const uint8_t *block = buffer + (offset - buffer_offset);
+        uint32_t sum = block_sum(block);
+
+        // the archive ends with two null blocks
+        if (sum == 0) {
+            offset += TAR_BLOCK;
+            if (++null_blocks == 2) { ret = counter; break; }
+            continue;
+        }
+        if (null_blocks) { ret = -1; break; } // a null block followed by a header
+
+        ret = visit(ctx, block, sum, offset);
+        if (ret != 0) break;
+
+        offset += TAR_BLOCK + (TAR_INT(((const tar_header_t *)block)->size) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        counter++;
+    }
+
+    free(buffer);
+    return ret;
+}
+
+static int check_visit(void *ctx, const uint8_t *block, uint32_t sum, uint64_t offset) {
+    return header_check(block, sum);
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd) {
+    int ret = walk_headers(tar_fd, 0, check_visit, NULL);
+    return ret == WALK_READ_ERROR ? -1 : ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/*                           Parallel validation                             */
+/* ------------------------------------------------------------------------- */
+
+#define CHECK_BATCH 64               // headers handed to a worker at once
+#define DIGEST_CHUNK (1024 * 1024)   // bytes read at once to compute a digest
+
+struct check_job {
+    int fd;
+    int flags;
+    uint64_t *offsets;          // offset of every header, in archive order
+    uint32_t no_headers;
+    uint32_t *digests;
+
+    uint32_t next;              // next header to hand out, shared by the workers
+    uint32_t first_error;       // index of the first invalid header found so far
+    int error;                  // error code of that header
+    pthread_mutex_t lock;
+};
+
+static int offsets_visit(void *ctx, const uint8_t *block, uint32_t sum, uint64_t offset) {
+    struct check_job *job = ctx;
+
+    if ((job->no_headers & (job->no_headers - 1)) == 0) {
+        uint64_t *offsets = realloc(job->offsets, (job->no_headers ? job->no_headers * 2 : 64) * sizeof(uint64_t));
+        if (offsets == NULL) return -1;
+        job->offsets = offsets;
+    }
+    job->offsets[job->no_headers++] = offset;
+
+    // past a header without magic the sizes are meaningless: the workers will report it
+    return memcmp(((const tar_header_t *)block)->magic, TMAGIC, TMAGLEN) != 0;
+}
+
+static uint32_t entry_digest(int fd, uint64_t offset, uint64_t size, uint8_t *buffer) {
+    uint32_t crc = ~0u;
+    while (size > 0) {
+        ssize_t r = pread(fd, buffer, size < DIGEST_CHUNK ? size : DIGEST_CHUNK, offset);
+        if (r <= 0) break;
+        crc = crc32c_kernel(crc, buffer, r);
+        offset += r;
+        size -= r;
+    }
+    return ~crc;
+}
+
+static void *check_worker(void *arg) {
+    struct check_job *job = arg;
+    uint8_t *buffer = (job->flags & TAR_CHECK_DIGEST) ? malloc(DIGEST_CHUNK) : NULL;
+    uint8_t block[TAR_BLOCK];
+
+    while (1) {
+        uint32_t start = __atomic_fetch_add(&job->next, CHECK_BATCH, __ATOMIC_RELAXED);
+        if (start >= job->no_headers) break;
+
+        uint32_t end = start + CHECK_BATCH < job->no_headers ? start + CHECK_BATCH : job->no_headers;
+        for (uint32_t i = start; i < end; i++) {
+            if (i > __atomic_load_n(&job->first_error, __ATOMIC_RELAXED)) break; // an earlier header is invalid
+
+            int ret = -1;
+            if (pread(job->fd, block, TAR_BLOCK, job->offsets[i]) == TAR_BLOCK) {
+                ret = header_check(block, block_sum(block));
+            }
+
+            if (ret < 0) {
+                pthread_mutex_lock(&job->lock);
+                if (i < job->first_error) {
+                    job->first_error = i;
+                    job->error = ret;
+                }
+                pthread_mutex_unlock(&job->lock);
+                break;
+            }
+
+            if (buffer != NULL) {
+                uint64_t size = TAR_INT(((tar_header_t *)block)->size);
+                job->digests[i] = entry_digest(job->fd, job->offsets[i] + TAR_BLOCK, size, buffer);
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+int check_archive_parallel(int tar_fd, int nthreads, int flags, uint32_t **digests) {
+    struct check_job job = {.fd = tar_fd, .flags = flags, .first_error = UINT32_MAX};
+    if (digests != NULL) *digests = NULL;
+    if (digests == NULL) job.flags &= ~TAR_CHECK_DIGEST;
+
+    // the offsets of the headers can only be found one after the other
+    // an error of the walk itself only wins if every header before it is valid
+    int walked = walk_headers(tar_fd, 0, offsets_visit, &job);
+    if (walked == WALK_READ_ERROR) walked = -1;
+
+    if (job.flags & TAR_CHECK_DIGEST) {
+        job.digests = calloc(job.no_headers ? job.no_headers : 1, sizeof(uint32_t));
+        if (job.digests == NULL) { free(job.offsets); return -1; }
+    }
+
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t no_batches = (job.no_headers + CHECK_BATCH - 1) / CHECK_BATCH;
+    if (nthreads > no_batches) nthreads = no_batches;
+    if (nthreads < 1) nthreads = 1;
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    if (threads == NULL) { free(job.offsets); free(job.digests); return -1; }
+    pthread_mutex_init(&job.lock, NULL);
+
+    int started = 1;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, check_worker, &job) != 0) break;
+    }
+    check_worker(&job); // the calling thread works too
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    free(job.offsets);
+
+    // the first invalid header wins, as in a sequential check
+    int ret = job.first_error != UINT32_MAX ? job.error : walked;
+    if (ret >= 0 && digests != NULL) *digests = job.digests;
+    else free(job.digests);
+    return ret;
+}
+
+/* ------------------------------------------------------------------------- */
+/*                            Streaming iterator                             */
+/* ------------------------------------------------------------------------- */
+
+#define ITER_BUFFER (1024 * 1024) // default read-ahead of an iterator
+
+struct tar_iter {
+    int fd;
+    int seekable;               // bodies can be skipped with lseek() instead of being read
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t pos;                 // next unconsumed byte of the buffer
+    size_t len;                 // bytes available in the buffer
+    uint64_t offset;            // offset in the stream of buffer[pos]
+
+    tar_header_t header;        // header of the current entry
+    uint64_t data_offset;       // offset in the stream of the data of the current entry
+    uint64_t body_left;         // bytes of the current entry not read yet
+    uint64_t padding;           // bytes padding the current entry to a full block
+    int done;
+};
+
+tar_iter_t *tar_iter_open(int fd, size_t buffer_size) {
+    tar_iter_t *it = calloc(1, sizeof(tar_iter_t));
+    if (it == NULL) return NULL;
+
+    it->buffer_size = buffer_size < 2 * TAR_BLOCK ? ITER_BUFFER : buffer_size;
+    it->buffer = malloc(it->buffer_size);
+    if (it->buffer == NULL) { free(it); return NULL; }
+
+    it->fd = fd;
+    it->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    pthread_once(&kernels_once, kernels_init);
+    return it;
+}
+
+void tar_iter_close(tar_iter_t *it) {
+    if (it == NULL) return;
+    free(it->buffer);
+    free(it);
+}
+
+/**
+ * Makes at least want bytes available in the buffer, fewer only at the end of the stream.
+ *
+ * @return zero on success, -1 on a read error.
+ */
+static int iter_fill(tar_iter_t *it, size_t want) {
+    if (it->len - it->pos >= want) return 0;
+
+    memmove(it->buffer, it->buffer + it->pos, it->len - it->pos);
+    it->len -= it->pos;
+    it->pos = 0;
+
+    while (it->len < want) {
+        ssize_t r = read(it->fd, it->buffer + it->len, it->buffer_size - it->len);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        it->len += r;
+    }
+    return 0;
+}
+
+/**
+ * Consumes n bytes of the stream, dropping them from the buffer then reading and discarding the rest, or seeking
+ * over it when the descriptor allows it.
+ */
+static int iter_skip(tar_iter_t *it, uint64_t n) {
+    size_t buffered = it->len - it->pos;
+    if (n <= buffered) {
+        it->pos += n;
+        it->offset += n;
+        return 0;
+    }
+
+    n -= buffered;
+    it->offset += buffered;
+    it->pos = it->len = 0;
+
+    if (it->seekable && n > it->buffer_size) {
+        if (lseek(it->fd, n, SEEK_CUR) < 0) return -1;
+        it->offset += n;
+        return 0;
+    }
+
+    while (n > 0) {
+        ssize_t r = read(it->fd, it->buffer, n < it->buffer_size ? n : it->buffer_size);
+        if (r <= 0) return -1; // read error or truncated archive
+        it->offset += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int tar_iter_next(tar_iter_t *it, const tar_header_t **header) {
+    if (it->done) return 0;
+
+    // whatever the caller did not read of the previous entry
+    if (iter_skip(it, it->body_left + it->padding) < 0) return -1;
+    it->body_left = it->padding = 0;
+
+    if (iter_fill(it, 2 * TAR_BLOCK) < 0) return -1;
+    if (it->len - it->pos < TAR_BLOCK) {
+        it->done = 1;
+        return it->len == it->pos ? 0 : -1; // end of the stream, without null blocks
+    }
+
+    const uint8_t *block = it->buffer + it->pos;
+    uint32_t sum = block_sum(block);
+    if (sum == 0) {
+        it->done = 1;
+        if (it->len - it->pos < 2 * TAR_BLOCK) return 0;
+        return block_sum(block + TAR_BLOCK) == 0 ? 0 : -1; // the archive ends with two null blocks
+    }
+    if (!header_known((const tar_header_t *)block) || !checksum_ok(block, sum)) return -1;
+
+    memcpy(&it->header, block, TAR_BLOCK);
+    it->pos += TAR_BLOCK;
+    it->offset += TAR_BLOCK;
+
+    it->data_offset = it->offset;
+    it->body_left = TAR_INT(it->header.size);
+    it->padding = (TAR_BLOCK - it->body_left % TAR_BLOCK) % TAR_BLOCK;
+
+    *header = &it->header;
+    return 1;
+}
+
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len) {
+    if (len > it->body_left) len = it->body_left;
+    size_t done = 0;
+
+    // what is already buffered first
+    size_t buffered = it->len - it->pos;
+    if (buffered > 0) {
+        done = len < buffered ? len : buffered;
+        memcpy(buf, it->buffer + it->pos, done);
+        it->pos += done;
+    }
+
+    while (done < len) {
+        ssize_t r;
+        if (len - done >= it->buffer_size) {
+            r = read(it->fd, (uint8_t *)buf + done, len - done); // large reads bypass the buffer
+        } else {
+            if (iter_fill(it, 1) < 0) return -1;
+            r = it->len < len - done ? it->len : len - done;
+            memcpy((uint8_t *)buf + done, it->buffer, r);
+            it->pos = r;
+        }
+        if (r < 0) return -1;
+        if (r == 0) break; // truncated archive
+        done += r;
+    }
+
+    it->offset += done;
+    it->body_left -= done;
+    return done;
+}
+
+uint64_t tar_iter_offset(const tar_iter_t *it) {
+    return it->data_offset;
+}
+
+/* ------------------------------------------------------------------------- */
+/*                              Archive index                                */
+/* ------------------------------------------------------------------------- */
+
+static uint32_t path_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* A block replaced by tar_refresh() while callers may still point into it. */
+struct tar_retired {
+    void *addr;
+    size_t size;                // size of a mapping, zero for an allocation
+    struct tar_retired *next;
+};
+
+/**
+ * Keeps a block replaced by tar_refresh() until tar_close().
+ */
+static int retire(tar_archive_t *ar, void *addr, size_t size) {
+    struct tar_retired *r = malloc(sizeof(struct tar_retired));
+    if (r == NULL) return -1;
+    r->addr = addr;
+    r->size = size;
+    r->next = ar->retired;
+    ar->retired = r;
+    return 0;
+}
+
+/**
+ * Appends a string of len bytes to the string pool.
+ *
+ * @return the offset of the string in the pool, or -1 if the pool could not grow.
+ */
+static ssize_t strings_add(tar_archive_t *ar, const char *str, size_t len) {
+    if (ar->strings_len + len + 1 > ar->strings_max) {
+        size_t max = ar->strings_max ? ar->strings_max : 4096;
+        while (ar->strings_len + len + 1 > max) max *= 2;
+        if (max > UINT32_MAX) return -1;
+
+        char *strings;
+        if (ar->refreshing) {
+            // the paths handed out before the refresh point into the old pool
+            strings = malloc(max);
+            if (strings == NULL) return -1;
+            if (retire(ar, ar->strings, 0) < 0) { free(strings); return -1; }
+            memcpy(strings, ar->strings, ar->strings_len);
+        } else {
+            strings = realloc(ar->strings, max);
+            if (strings == NULL) return -1;
+        }
+        ar->strings = strings;
+        ar->strings_max = max;
+    }
+
+    ssize_t off = ar->strings_len;
+    memcpy(ar->strings + off, str, len);
+    ar->strings[off + len] = '\0';
+    ar->strings_len += len + 1;
+    return off;
+}
+
+/**
+ * Looks an exact path up in the index.
+ *
+ * @return the index of the entry, or NO_ENTRY if there is none.
+ */
+static uint32_t lookup_len(const tar_archive_t *ar, const char *path, size_t len) {
+    if (ar->no_buckets == 0) return NO_ENTRY;
+
+    uint32_t hash = path_hash(path, len);
+    uint32_t mask = ar->no_buckets - 1;
+
+    for (uint32_t i = hash & mask; ar->buckets[i] != 0; i = (i + 1) & mask) {
+        uint32_t id = ar->buckets[i] - 1;
+        if (ar->hashes[id] != hash) continue;
+
+        const char *name = entry_path(ar, id);
+        if (strncmp(name, path, len) == 0 && name[len] == '\0') return id;
+    }
+    return NO_ENTRY;
+}
+
+static uint32_t lookup(const tar_archive_t *ar, const char *path) {
+    return lookup_len(ar, path, strlen(path));
+}
+
+static int buckets_grow(tar_archive_t *ar) {
+    uint32_t no_buckets = ar->no_buckets ? ar->no_buckets * 2 : 64;
+    uint32_t *buckets = calloc(no_buckets, sizeof(uint32_t));
+    if (buckets == NULL) return -1;
+
+    uint32_t mask = no_buckets - 1;
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        uint32_t i = ar->hashes[id] & mask;
+        while (buckets[i] != 0) i = (i + 1) & mask;
+        buckets[i] = id + 1;
+    }
+
+    free(ar->buckets);
+    ar->buckets = buckets;
+    ar->no_buckets = no_buckets;
+    return 0;
+}
+
+static int array_grow(void *array, size_t size) {
+    void *grown = realloc(*(void **)array, size);
+    if (grown == NULL) return -1;
+    *(void **)array = grown;
+    return 0;
+}
+
+/**
+ * Doubles the capacity of the entry table, of the directory tree and of the views.
+ */
+static int entries_grow(tar_archive_t *ar) {
+    uint32_t max = ar->max_entries ? ar->max_entries * 2 : 64;
+    if (array_grow(&ar->offsets, max * sizeof(uint64_t)) < 0) return -1;
+    if (array_grow(&ar->sizes, max * sizeof(uint64_t)) < 0) return -1;
+    if (array_grow(&ar->paths, max * sizeof(uint32_t)) < 0) return -1;
+    if (array_grow(&ar->links, max * sizeof(uint32_t)) < 0) return -1;
+    if (array_grow(&ar->hashes, max * sizeof(uint32_t)) < 0) return -1;
+    if (array_grow(&ar->types, max * sizeof(char)) < 0) return -1;
+    if (array_grow(&ar->flags, max * sizeof(uint8_t)) < 0) return -1;
+    if (array_grow(&ar->modes, max * sizeof(uint16_t)) < 0) return -1;
+    if (array_grow(&ar->first_child, max * sizeof(uint32_t)) < 0) return -1;
+    if (array_grow(&ar->next_sibling, max * sizeof(uint32_t)) < 0) return -1;
+    if (ar->views != NULL) {
+        if (array_grow(&ar->views, max * sizeof(uint8_t *)) < 0) return -1;
+        memset(ar->views + ar->max_entries, 0, (max - ar->max_entries) * sizeof(uint8_t *));
+    }
+    ar->max_entries = max;
+    return 0;
+}
+
+/**
+ * Finds the entry of a path in the index, adding an empty one if there is none.
+ * The path must not point into the string pool, which may move.
+ *
+ * @return the index of the entry, or NO_ENTRY if the index could not grow.
+ */
+static uint32_t entry_insert(tar_archive_t *ar, const char *path, size_t len) {
+    uint32_t id = lookup_len(ar, path, len);
+    if (id != NO_ENTRY) return id;
+
+    if (ar->no_entries == ar->max_entries && entries_grow(ar) < 0) return NO_ENTRY;
+    if ((ar->no_entries + 1) * 2 > ar->no_buckets && buckets_grow(ar) < 0) return NO_ENTRY;
+
+    ssize_t off = strings_add(ar, path, len);
+    if (off < 0) return NO_ENTRY;
+
+    id = ar->no_entries++;
+    ar->offsets[id] = 0;
+    ar->sizes[id] = 0;
+    ar->types[id] = 0;
+    ar->flags[id] = 0;
+    ar->modes[id] = 0;
+    ar->paths[id] = off;
+    ar->links[id] = off + len; // the empty string
+    ar->hashes[id] = path_hash(path, len);
+    ar->first_child[id] = NO_ENTRY;
+    ar->next_sibling[id] = NO_ENTRY;
+
+    uint32_t mask = ar->no_buckets - 1;
+    uint32_t i = ar->hashes[id] & mask;
+    while (ar->buckets[i] != 0) i = (i + 1) & mask;
+    ar->buckets[i] = id + 1;
+    return id;
+}
+
+#define EXTENDED_MAX (1 << 20) // larger extended headers are ignored
+#define PATH_JOINED_MAX (sizeof(((tar_header_t *)0)->prefix) + 1 + sizeof(((tar_header_t *)0)->name))
+
+static int is_extended(char typeflag) {
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+static void long_name_set(char **name, const uint8_t *value, size_t len) {
+    free(*name);
+    *name = strndup((const char *)value, len);
+}
+
+/**
+ * Reads the path and the link name an extended header gives to the next header, from its content. The records of
+ * a PAX header are "<length> <key>=<value>\n", a GNU header holds the name itself.
+ */
+static void extended_parse(const tar_header_t *header, const uint8_t *content, size_t size, char **long_path,
+                           char **long_link) {
+    if (header->typeflag == GNUTYPE_LONGNAME) long_name_set(long_path, content, strnlen((const char *)content, size));
+    if (header->typeflag == GNUTYPE_LONGLINK) long_name_set(long_link, content, strnlen((const char *)content, size));
+    if (header->typeflag != XHDTYPE) return; // global headers only hold defaults we do not use
+
+    for (size_t pos = 0; pos < size;) {
+        size_t len = 0, i = pos;
+        while (i < size && content[i] >= '0' && content[i] <= '9') len = len * 10 + (content[i++] - '0');
+        if (len == 0 || i >= size || content[i] != ' ' || len > size - pos) return; // malformed record
+
+        const uint8_t *key = content + i + 1;
+        const uint8_t *end = content + pos + len - 1; // the newline
+        const uint8_t *equal = memchr(key, '=', end - key);
+        if (equal != NULL) {
+            size_t value_len = end - equal - 1;
+            if (equal - key == 4 && memcmp(key, "path", 4) == 0) long_name_set(long_path, equal + 1, value_len);
+            if (equal - key == 8 && memcmp(key, "linkpath", 8) == 0) long_name_set(long_link, equal + 1, value_len);
+        }
+        pos += len;
+    }
+}
+
+/**
+ * Gives the path of a header: the long path from an extended header if there is one, otherwise the ustar prefix
+ * and name fields joined with a slash.
+ *
+ * @param joined A buffer of PATH_JOINED_MAX bytes for the joined path.
+ *
+ * @return the path, not null-terminated, its length being set in len.
+ */
+static const char *header_path(const tar_header_t *header, const char *long_path, char *joined, size_t *len) {
+    if (long_path != NULL) {
+        *len = strlen(long_path);
+        return long_path;
+    }
+
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    if (prefix_len == 0 || memcmp(header->magic, TMAGIC, TMAGLEN) != 0) {
+        *len = name_len;
+        return header->name;
+    }
+
+    memcpy(joined, header->prefix, prefix_len);
+    joined[prefix_len] = '/';
+    memcpy(joined + prefix_len + 1, header->name, name_len);
+    *len = prefix_len + 1 + name_len;
+    return joined;
+}
+
+/**
+ * Adds the entry described by a header to the index.
+ * A path appearing several times in the archive is shadowed by its last occurrence.
+ * An extended header is not an entry: it gives its long path or link name to the next header.
+ *
+ * @param content The content of the entry if it is at hand, NULL to read it from the archive when needed.
+ *
+ * @return zero on success, -1 if the index could not grow.
+ */
+static int index_add(tar_archive_t *ar, const tar_header_t *header, uint64_t offset, const uint8_t *content) {
+    tar_stats_header();
+    if (is_extended(header->typeflag)) {
+        size_t size = TAR_INT(header->size);
+        if (size > EXTENDED_MAX) return 0;
+
+        uint8_t *read = NULL;
+        if (content == NULL) {
+            content = read = malloc(size ? size : 1);
+            if (read == NULL) return -1;
+            if (tar_pread_full(ar->fd, read, size, offset) != size) size = 0;
+        }
+        extended_parse(header, content, size, &ar->long_path, &ar->long_link);
+        free(read);
+        return 0;
+    }
+
+    char joined[PATH_JOINED_MAX + 1];
+    size_t path_len;
+    const char *path = header_path(header, ar->long_path, joined, &path_len);
+
+    // a directory always ends with a slash, which PAX paths may lack
+    if (header->typeflag == DIRTYPE && path_len > 0 && path[path_len - 1] != '/') {
+        char *slashed = malloc(path_len + 2);
+        if (slashed == NULL) return -1;
+        memcpy(slashed, path, path_len);
+        slashed[path_len++] = '/';
+        slashed[path_len] = '\0';
+        free(ar->long_path);
+        path = ar->long_path = slashed;
+    }
+
+    uint32_t id = entry_insert(ar, path, path_len);
+    if (id == NO_ENTRY) return -1;
+
+    // a link added or replaced may change where the links lead
+    char old_type = ar->types[id];
+    if (old_type == SYMTYPE || old_type == LNKTYPE || header->typeflag == SYMTYPE || header->typeflag == LNKTYPE) {
+        ar->relink = 1;
+    }
+    // a file replaced by tar_refresh() drops the copy tar_view_file() made of it, which callers may still hold
+    if (ar->views != NULL && ar->views[id] != NULL) {
+        if (retire(ar, ar->views[id], 0) < 0) return -1;
+        ar->views[id] = NULL;
+    }
+
+    ssize_t link;
+    if (ar->long_link != NULL) link = strings_add(ar, ar->long_link, strlen(ar->long_link));
+    else link = strings_add(ar, header->linkname, strnlen(header->linkname, sizeof(header->linkname)));
+    if (link < 0) return -1;
+
+    ar->links[id] = link;
+    ar->offsets[id] = offset;
+    ar->sizes[id] = TAR_INT(header->size);
+    ar->types[id] = header->typeflag;
+    ar->flags[id] = 0;
+    ar->modes[id] = TAR_INT(header->mode) & 07777;
+
+    free(ar->long_path);
+    free(ar->long_link);
+    ar->long_path = ar->long_link = NULL;
+    return 0;
+}
+
+/**
+ * Length of the path of the parent directory of a path, trailing slash included: "a/b/" for "a/b/c" or "a/b/c/",
+ * zero for an entry at the root.
+ */
+static size_t parent_len(const char *path, size_t len) {
+    if (len > 0 && path[len - 1] == '/') len--;
+    while (len > 0 && path[len - 1] != '/') len--;
+    return len;
+}
+
+/**
+ * Links an entry under its parent directory in the directory tree, adding the implied parent directories missing
+ * from the archive. The root directory is the implied entry with an empty path.
+ *
+ * @return zero on success, -1 if the index could not grow.
+ */
+static int tree_link(tar_archive_t *ar, uint32_t id) {
+    const char *path = entry_path(ar, id);
+    size_t len = strlen(path);
+    if (len == 0) return 0; // the root
+
+    size_t dir_len = parent_len(path, len);
+    uint32_t parent = lookup_len(ar, path, dir_len);
+    if (parent == NO_ENTRY) {
+        char *dir = malloc(dir_len + 1);
+        if (dir == NULL) return -1;
+        memcpy(dir, path, dir_len);
+        parent = entry_insert(ar, dir, dir_len);
+        free(dir);
+        if (parent == NO_ENTRY) return -1;
+
+        ar->types[parent] = DIRTYPE;
+        ar->flags[parent] = ENTRY_IMPLIED;
+        ar->modes[parent] = 0755;
+        if (tree_link(ar, parent) < 0) return -1;
+    }
+
+    ar->next_sibling[id] = ar->first_child[parent];
+    ar->first_child[parent] = id;
+    return 0;
+}
+
+/**
+ * Builds the directory tree of the index.
+ * The entries are linked from the last one so that every directory lists its children in archive order.
+ */
+static int index_tree(tar_archive_t *ar) {
+    if (lookup(ar, "") == NO_ENTRY) {
+        uint32_t root = entry_insert(ar, "", 0);
+        if (root == NO_ENTRY) return -1;
+        ar->types[root] = DIRTYPE;
+        ar->flags[root] = ENTRY_IMPLIED;
+        ar->modes[root] = 0755;
+    }
+
+    for (uint32_t id = ar->no_entries; id-- > 0;) {
+        if (tree_link(ar, id) < 0) return -1;
+    }
+    return 0;
+}
+
+ssize_t tar_archive_read(const tar_archive_t *ar, void *buf, size_t len, uint64_t offset) {
+    if (ar->map != NULL) {
+        if (offset >= ar->map_size) return 0;
+        if (len > ar->map_size - offset) len = ar->map_size - offset;
+        memcpy(buf, ar->map + offset, len);
+        tar_stats_read(offset, len, 0);
+        return len;
+    }
+    if (ar->gz != NULL) return tar_gz_read(ar->gz, ar->fd, buf, len, offset);
+
+    return tar_pread_full(ar->fd, buf, len, offset);
+}
+
+/* A walk indexing the headers of an archive. */
+struct index_walk {
+    tar_archive_t *ar;
+    int verify;                 // stop at a header with a wrong checksum, which may be still being appended
+    uint64_t end;               // when verifying, size of the archive: a header whose data goes past it is not complete
+    uint32_t indexed;           // entries indexed, extended headers aside
+};
+
+/**
+ * Indexes a header and moves the tail of the index past its content.
+ */
+static int index_header(struct index_walk *walk, const tar_header_t *header, uint64_t offset, const uint8_t *content) {
+    if (index_add(walk->ar, header, offset + TAR_BLOCK, content) < 0) return -1;
+    if (!is_extended(header->typeflag)) walk->indexed++;
+    walk->ar->tail = offset + TAR_BLOCK + (TAR_INT(header->size) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    return 0;
+}
+
+/**
+ * Whether the data of a header is entirely in the archive, and not still being appended.
+ */
+static int entry_complete(const struct index_walk *walk, const tar_header_t *header, uint64_t offset) {
+    uint64_t size = (TAR_INT(header->size) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    return offset + TAR_BLOCK <= walk->end && size <= walk->end - offset - TAR_BLOCK;
+}
+
+static int index_visit(void *ctx, const uint8_t *block, uint32_t sum, uint64_t offset) {
+    struct index_walk *walk = ctx;
+    const tar_header_t *header = (const tar_header_t *)block;
+
+    if (!header_known(header)) return 1; // end of the valid part of the archive
+    if (walk->verify && (!checksum_ok(block, sum) || !entry_complete(walk, header, offset))) return 1;
+    if (index_header(walk, header, offset, NULL) < 0) return -2;
+    return 0;
+}
+
+/**
+ * Walks the header chain from a given header and indexes every entry.
+ * The walk stops at the first null or invalid header, or at the end of the file, leaving the tail of the index at
+ * the header following the last one indexed.
+ */
+static int index_build(struct index_walk *walk, uint64_t start) {
+    tar_archive_t *ar = walk->ar;
+    if (ar->map == NULL) {
+        // the index ends at the first invalid header, but not at a read error
+        int walked = walk_headers(ar->fd, start, index_visit, walk);
+        return walked == -2 || walked == WALK_READ_ERROR ? -1 : 0;
+    }
+
+    pthread_once(&kernels_once, kernels_init);
+    uint64_t offset = start;
+    while (offset + TAR_BLOCK <= ar->map_size) {
+        const tar_header_t *header = (const tar_header_t *)(ar->map + offset);
+
+        if (header->name[0] == '\0') break; // end of archive
+        if (!header_known(header)) break;
+        if (walk->verify && !checksum_ok(ar->map + offset, block_sum(ar->map + offset))) break;
+        if (walk->verify && !entry_complete(walk, header, offset)) break;
+
+        uint64_t size = TAR_INT(header->size);
+        const uint8_t *content = size <= ar->map_size - offset - TAR_BLOCK ? ar->map + offset + TAR_BLOCK : NULL;
+        if (index_header(walk, header, offset, content) < 0) return -1;
+        offset = ar->tail;
+    }
+    return 0;
+}
+
+/**
+ * Maps the whole archive read-only, leaving ar->map to NULL if the descriptor cannot be mapped.
+ */
+static void archive_map(tar_archive_t *ar, int flags) {
+    struct stat st;
+    if (fstat(ar->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ar->fd, 0);
+    if (map == MAP_FAILED) return;
+
+    if (flags & TAR_ADVISE_SEQUENTIAL) madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (flags & TAR_ADVISE_RANDOM) madvise(map, st.st_size, MADV_RANDOM);
+
+    ar->map = map;
+    ar->map_size = st.st_size;
+}
+
+static int is_link(const tar_archive_t *ar, uint32_t id) {
+    return ar->types[id] == SYMTYPE || ar->types[id] == LNKTYPE;
+}
+
+/**
+ * Normalizes the path a link names: the components of base then of link, without the empty and "." components and
+ * with every ".." removing the component before it. A ".." at the root stays at the root. A trailing slash is kept.
+ *
+ * @param out A buffer of at least base_len + strlen(link) + 1 bytes.
+ */
+static void link_normalize(char *out, const char *base, size_t base_len, const char *link) {
+    size_t len = 0;
+    for (int part = 0; part < 2; part++) {
+        const char *p = part == 0 ? base : link;
+        const char *end = part == 0 ? base + base_len : link + strlen(link);
+
+        while (p < end) {
+            const char *slash = memchr(p, '/', end - p);
+            size_t comp = (slash ? slash : end) - p;
+
+            if (comp == 2 && p[0] == '.' && p[1] == '.') {
+                // drop the last component and its slash
+                if (len > 0) len--;
+                while (len > 0 && out[len - 1] != '/') len--;
+            } else if (comp > 0 && !(comp == 1 && p[0] == '.')) {
+                memcpy(out + len, p, comp);
+                len += comp;
+                out[len++] = '/';
+            }
+            p += comp + (slash != NULL);
+        }
+    }
+
+    // a trailing slash only if the link has one
+    size_t link_len = strlen(link);
+    if (len > 0 && (link_len == 0 || link[link_len - 1] != '/')) len--;
+    out[len] = '\0';
+}
+
+/**
+ * Looks up the entry named by a normalized link target, as a file or as a directory, whose linkname usually has no
+ * trailing slash. Sets *unstable when the target is found as a directory, which a file appended later would shadow.
+ */
+static uint32_t link_lookup(const tar_archive_t *ar, char *target, int *unstable) {
+    uint32_t id = lookup(ar, target);
+    size_t len = strlen(target);
+    if (id == NO_ENTRY && len > 0 && target[len - 1] != '/') {
+        target[len] = '/';
+        target[len + 1] = '\0';
+        id = lookup(ar, target);
+        target[len] = '\0';
+        *unstable = 1;
+    }
+    return id;
+}
+
+/**
+ * Finds the entry a link names directly, without following it further.
+ * A symlink is relative to its own directory, falling back to the root of the archive as older versions did, and a
+ * hard link always to the root. An absolute linkname is taken from the root of the archive. Sets *unstable when
+ * an entry added later could change the answer.
+ *
+ * @return the index of the entry, or NO_ENTRY if there is none.
+ */
+static uint32_t link_step(const tar_archive_t *ar, uint32_t id, char *buffer, int *unstable) {
+    const char *path = entry_path(ar, id);
+    const char *link = entry_link(ar, id);
+    uint32_t target = NO_ENTRY;
+
+    if (ar->types[id] == SYMTYPE && link[0] != '/') {
+        link_normalize(buffer, path, parent_len(path, strlen(path)), link);
+        target = link_lookup(ar, buffer, unstable);
+        if (target == NO_ENTRY) *unstable = 1; // the fallback below
+    }
+    if (target == NO_ENTRY) {
+        link_normalize(buffer, "", 0, link);
+        target = link_lookup(ar, buffer, unstable);
+    }
+    return target;
+}
+
+#define TARGET_PENDING (NO_ENTRY - 1)   // link not resolved yet
+#define TARGET_WALKING (NO_ENTRY - 2)   // link on the chain being resolved
+
+/**
+ * Resolves every symlink and hard link of the index once, collapsing the chains of links to the entry they end at.
+ * A link which is dangling, or which leads into a cycle of links, gets NO_ENTRY, flagged ENTRY_CYCLE for a cycle.
+ * Following a link then costs a single table lookup. The links which an entry added later could resolve differently
+ * are flagged ENTRY_UNSTABLE, so that tar_refresh() only resolves the links again when one of them exists.
+ *
+ * @return zero on success, -1 if memory ran out.
+ */
+static int index_links(tar_archive_t *ar) {
+    size_t n = ar->no_entries ? ar->no_entries : 1, max_len = 0;
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        if (!is_link(ar, id)) continue;
+        size_t len = strlen(entry_path(ar, id)) + strlen(entry_link(ar, id));
+        if (len > max_len) max_len = len;
+    }
+
+    uint32_t *targets = malloc(n * sizeof(uint32_t));
+    uint32_t *chain = malloc(n * sizeof(uint32_t));
+    char *buffer = malloc(max_len + 3); // a path joined with a linkname, a slash and a null byte
+    if (targets == NULL || chain == NULL || buffer == NULL) {
+        free(targets);
+        free(chain);
+        free(buffer);
+        return -1;
+    }
+
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        targets[id] = is_link(ar, id) ? TARGET_PENDING : id;
+        ar->flags[id] &= ~(ENTRY_CYCLE | ENTRY_UNSTABLE);
+    }
+    free(ar->targets);
+    ar->targets = targets;
+    ar->no_unstable = 0;
+    ar->relink = 0;
+
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        if (targets[id] != TARGET_PENDING) continue;
+
+        // walk the chain until an entry which is not a link, a resolved link, a dangling link or a cycle
+        uint32_t depth = 0, cur = id;
+        int unstable = 0;
+        while (cur != NO_ENTRY && targets[cur] == TARGET_PENDING) {
+            targets[cur] = TARGET_WALKING;
+            chain[depth++] = cur;
+            cur = link_step(ar, cur, buffer, &unstable);
+        }
+
+        uint32_t result = NO_ENTRY;
+        int cycle = 0;
+        if (cur != NO_ENTRY) {
+            if (targets[cur] == TARGET_WALKING) cycle = 1;
+            else result = targets[cur];
+            if (ar->flags[cur] & ENTRY_CYCLE) cycle = 1;
+            if (ar->flags[cur] & ENTRY_UNSTABLE) unstable = 1;
+        }
+        if (result == NO_ENTRY) unstable = 1;
+        while (depth > 0) {
+            uint32_t link = chain[--depth];
+            targets[link] = result;
+            if (cycle) ar->flags[link] |= ENTRY_CYCLE;
+            if (unstable) ar->flags[link] |= ENTRY_UNSTABLE;
+            ar->no_unstable += unstable;
+        }
+    }
+
+    free(chain);
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Gives the entry reached from a given entry once its links are followed.
+ */
+static uint32_t follow_links(const tar_archive_t *ar, uint32_t id) {
+    return id == NO_ENTRY ? NO_ENTRY : ar->targets[id];
+}
+
+/* ------------------------------------------------------------------------- */
+/*                              Sidecar index                                */
+/* ------------------------------------------------------------------------- */
+
+#define INDEX_MAGIC "LTARIDX"
+#define INDEX_VERSION 8
+#define INDEX_SAMPLES 64 // number of headers hashed into the header-chain checksum
+
+/* Sections of an index file, one per array of the index. */
+enum {
+    SECTION_OFFSETS,
+    SECTION_SIZES,
+    SECTION_PATHS,
+    SECTION_LINKS,
+    SECTION_HASHES,
+    SECTION_TYPES,
+    SECTION_FLAGS,
+    SECTION_MODES,
+    SECTION_SORTED,
+    SECTION_BUCKETS,
+    SECTION_FIRST_CHILD,
+    SECTION_NEXT_SIBLING,
+    SECTION_TARGETS,
+    SECTION_STRINGS,
+    NO_SECTIONS
+};
+
+/*
+ * Layout of an index file: this header, then the sections, each starting on an 8 bytes boundary. Every section only
+ * holds offsets and entry indexes, so the file can be used in place once mapped.
+ */
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t no_entries;
+    uint32_t no_buckets;
+    uint32_t reserved;
+    uint64_t archive_size;
+    int64_t archive_mtime;      // in nanoseconds
+    uint64_t chain_hash;
+    uint64_t archive_dev;       // identity of the archive file: while it stays the same, with the same ctime, the
+    uint64_t archive_ino;       // archive was not modified and the header chain does not have to be checked
+    int64_t archive_ctime;      // in nanoseconds
+    uint64_t strings_len;
+    uint64_t sections[NO_SECTIONS]; // offset of every section
+};
+
+/* An array of the index, its size in the index file and the alignment of its elements. */
+struct index_section {
+    void *array;                // address of the field of the handle pointing to the array
+    size_t len;
+    size_t align;
+};
+
+static void index_sections(tar_archive_t *ar, const struct index_header *header, struct index_section *sections) {
+    size_t n = header->no_entries;
+    sections[SECTION_OFFSETS] = (struct index_section){&ar->offsets, n * sizeof(uint64_t), sizeof(uint64_t)};
+    sections[SECTION_SIZES] = (struct index_section){&ar->sizes, n * sizeof(uint64_t), sizeof(uint64_t)};
+    sections[SECTION_PATHS] = (struct index_section){&ar->paths, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_LINKS] = (struct index_section){&ar->links, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_HASHES] = (struct index_section){&ar->hashes, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_TYPES] = (struct index_section){&ar->types, n * sizeof(char), sizeof(char)};
+    sections[SECTION_FLAGS] = (struct index_section){&ar->flags, n * sizeof(uint8_t), sizeof(uint8_t)};
+    sections[SECTION_MODES] = (struct index_section){&ar->modes, n * sizeof(uint16_t), sizeof(uint16_t)};
+    sections[SECTION_SORTED] = (struct index_section){&ar->sorted, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_BUCKETS] = (struct index_section){&ar->buckets, header->no_buckets * sizeof(uint32_t),
+                                                       sizeof(uint32_t)};
+    sections[SECTION_FIRST_CHILD] = (struct index_section){&ar->first_child, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_NEXT_SIBLING] = (struct index_section){&ar->next_sibling, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_TARGETS] = (struct index_section){&ar->targets, n * sizeof(uint32_t), sizeof(uint32_t)};
+    sections[SECTION_STRINGS] = (struct index_section){&ar->strings, header->strings_len, 1};
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+static int compare_paths(const void *a, const void *b, void *arg) {
+    const tar_archive_t *ar = arg;
+    return strcmp(entry_path(ar, *(const uint32_t *)a), entry_path(ar, *(const uint32_t *)b));
+}
+
+/**
+ * Builds the permutation of the entries sorted by path.
+ */
+static int index_sort(tar_archive_t *ar) {
+    uint32_t *sorted = malloc((ar->no_entries ? ar->no_entries : 1) * sizeof(uint32_t));
+    if (sorted == NULL) return -1;
+
+    for (uint32_t i = 0; i < ar->no_entries; i++) sorted[i] = i;
+    qsort_r(sorted, ar->no_entries, sizeof(uint32_t), compare_paths, ar);
+
+    free(ar->sorted);
+    ar->sorted = sorted;
+    return 0;
+}
+
+/**
+ * Hashes a sample of the headers of the archive: the first one, the last one and evenly spaced ones in between.
+ * This detects an archive rewritten with the same size and mtime without reading every header.
+ * The implied directories have no header, a sample falling on one takes the next entry which has a header instead.
+ */
+static int chain_hash(const tar_archive_t *ar, uint64_t *hash) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    tar_header_t header;
+
+    // the implied root always comes last, the last sample is the last entry which has a header
+    uint32_t end = ar->no_entries;
+    while (end > 0 && (ar->flags[end - 1] & ENTRY_IMPLIED)) end--;
+    uint32_t step = end / INDEX_SAMPLES + 1;
+
+    for (uint32_t i = 0; i < end; i += step) {
+        uint32_t id = (i + step >= end) ? end - 1 : i;
+        while (ar->flags[id] & ENTRY_IMPLIED) id++;
+        if (tar_archive_read(ar, &header, TAR_BLOCK, ar->offsets[id] - TAR_BLOCK) != TAR_BLOCK) return -1;
+        tar_stats_header();
+
+        for (size_t j = 0; j < TAR_BLOCK; j++) {
+            h ^= ((uint8_t *)&header)[j];
+            h *= 1099511628211ull;
+        }
+    }
+    *hash = h;
+    return 0;
+}
+
+static int write_section(int fd, const void *buf, size_t len, uint64_t *pos) {
+    static const char zeros[8];
+    if (tar_write_full(fd, buf, len) < 0) return -1;
+    if (tar_write_full(fd, zeros, ALIGN8(len) - len) < 0) return -1;
+    *pos += ALIGN8(len);
+    return 0;
+}
+
+/**
+ * Writes the index of an archive handle to a file descriptor, in the index file layout.
+ */
+static int index_save(tar_archive_t *ar, const struct stat *st, int out_fd) {
+    struct index_header header = {0};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.no_entries = ar->no_entries;
+    header.no_buckets = ar->no_buckets;
+    header.archive_size = st->st_size;
+    header.archive_mtime = st->st_mtim.tv_sec * 1000000000ll + st->st_mtim.tv_nsec;
+    header.archive_dev = st->st_dev;
+    header.archive_ino = st->st_ino;
+    header.archive_ctime = st->st_ctim.tv_sec * 1000000000ll + st->st_ctim.tv_nsec;
+    header.strings_len = ar->strings_len;
+    if (chain_hash(ar, &header.chain_hash) < 0) return -1;
+
+    struct index_section sections[NO_SECTIONS];
+    index_sections(ar, &header, sections);
+    uint64_t pos = ALIGN8(sizeof(header));
+    for (int i = 0; i < NO_SECTIONS; i++) {
+        header.sections[i] = pos;
+        pos += ALIGN8(sections[i].len);
+    }
+
+    pos = 0;
+    if (write_section(out_fd, &header, sizeof(header), &pos) < 0) return -1;
+    for (int i = 0; i < NO_SECTIONS; i++) {
+        if (write_section(out_fd, *(void **)sections[i].array, sections[i].len, &pos) < 0) return -1;
+    }
+    return 0;
+}
+
+static int index_entry_ok(uint32_t id, uint32_t no_entries) {
+    return id < no_entries || id == NO_ENTRY;
+}
+
+/**
+ * Checks that the first_child and next_sibling links form a forest: every entry is linked from at most one other,
+ * and is reached from an entry linked from none, so that no listing can loop.
+ */
+static int index_check_tree(const tar_archive_t *ar) {
+    uint32_t n = ar->no_entries;
+    uint8_t *linked = calloc(n ? n : 1, sizeof(uint8_t));
+    uint32_t *stack = malloc((n ? n : 1) * sizeof(uint32_t));
+    int ret = -1;
+    if (linked == NULL || stack == NULL) goto out;
+
+    for (uint32_t id = 0; id < n; id++) {
+        uint32_t next[2] = {ar->first_child[id], ar->next_sibling[id]};
+        for (int j = 0; j < 2; j++) {
+            if (next[j] != NO_ENTRY && linked[next[j]]++) goto out;
+        }
+    }
+
+    // walking from the roots reaches every entry once, unless some of them form a cycle
+    uint32_t depth = 0, reached = 0;
+    for (uint32_t id = 0; id < n; id++) {
+        if (!linked[id]) stack[depth++] = id;
+    }
+    while (depth > 0) {
+        uint32_t id = stack[--depth];
+        reached++;
+        if (ar->first_child[id] != NO_ENTRY) stack[depth++] = ar->first_child[id];
+        if (ar->next_sibling[id] != NO_ENTRY) stack[depth++] = ar->next_sibling[id];
+    }
+    ret = reached == n ? 0 : -1;
+
+out:
+    free(linked);
+    free(stack);
+    return ret;
+}
+
+/**
+ * Checks once that every offset and entry index of a loaded index stays within its array, that the lookups and
+ * listings end, the lookups trusting the index afterwards. The offsets of the entries are only checked against the
+ * size of an uncompressed archive.
+ *
+ * @return zero if the index is consistent, -1 otherwise.
+ */
+static int index_check(const tar_archive_t *ar, uint64_t archive_size) {
+    uint32_t n = ar->no_entries;
+    if (n > 0 && (ar->strings_len == 0 || ar->strings[ar->strings_len - 1] != '\0')) return -1;
+    if (ar->no_buckets <= n) return -1; // the probes of a lookup stop on an empty bucket
+
+    for (uint32_t id = 0; id < n; id++) {
+        if (ar->paths[id] >= ar->strings_len || ar->links[id] >= ar->strings_len) return -1;
+        if (ar->sorted[id] >= n || !index_entry_ok(ar->targets[id], n)) return -1;
+        if (!index_entry_ok(ar->first_child[id], n) || !index_entry_ok(ar->next_sibling[id], n)) return -1;
+        if (ar->gz != NULL || (ar->flags[id] & ENTRY_IMPLIED)) continue;
+        if (ar->offsets[id] < TAR_BLOCK || ar->sizes[id] > archive_size) return -1; // the header precedes the data
+        if (ar->offsets[id] > archive_size - ar->sizes[id]) return -1;
+    }
+    uint32_t empty = 0;
+    for (uint32_t i = 0; i < ar->no_buckets; i++) {
+        if (ar->buckets[i] > n) return -1; // an entry index plus one, zero for an empty bucket
+        empty += ar->buckets[i] == 0;
+    }
+    if (empty == 0) return -1;
+    return index_check_tree(ar);
+}
+
+/**
+ * Points the index of an archive handle into a mapped index file, after checking that it describes the archive.
+ *
+ * @return zero on success, -1 if the index is malformed or stale.
+ */
+static int index_load(tar_archive_t *ar, const uint8_t *map, size_t size) {
+    const struct index_header *header = (const struct index_header *)map;
+    struct stat st;
+
+    if (size < sizeof(*header) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0) return -1;
+    if (header->version != INDEX_VERSION) return -1;
+    if (header->no_buckets == 0 || (header->no_buckets & (header->no_buckets - 1)) != 0) return -1;
+
+    struct index_section sections[NO_SECTIONS];
+    index_sections(ar, header, sections);
+    for (int i = 0; i < NO_SECTIONS; i++) {
+        if (header->sections[i] > size || sections[i].len > size - header->sections[i]) return -1;
+        if ((uintptr_t)(map + header->sections[i]) % sections[i].align != 0) return -1;
+    }
+
+    if (fstat(ar->fd, &st) < 0) return -1;
+    if (header->archive_size != st.st_size) return -1;
+    if (header->archive_mtime != st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec) return -1;
+
+    for (int i = 0; i < NO_SECTIONS; i++) *(const void **)sections[i].array = map + header->sections[i];
+    ar->no_entries = header->no_entries;
+    ar->no_buckets = header->no_buckets;
+    ar->strings_len = header->strings_len;
+    if (index_check(ar, st.st_size) < 0) return -1;
+
+    // the same file, unchanged since it was indexed: nothing to read
+    int64_t ctime = st.st_ctim.tv_sec * 1000000000ll + st.st_ctim.tv_nsec;
+    if (header->archive_dev == st.st_dev && header->archive_ino == st.st_ino && header->archive_ctime == ctime) {
+        return 0;
+    }
+
+    uint64_t hash;
+    if (chain_hash(ar, &hash) < 0 || hash != header->chain_hash) return -1;
+    return 0;
+}
+
+/**
+ * Saves an index file with a given save function. The file is written next to the index then renamed, so that
+ * readers never map a partial index.
+ */
+static int index_write(tar_archive_t *ar, const char *index_path,
+                       int (*save)(tar_archive_t *ar, const struct stat *st, int out_fd)) {
+    struct stat st;
+    if (fstat(ar->fd, &st) < 0) return -1;
+
+    size_t len = strlen(index_path);
+    char *tmp_path = malloc(len + 5);
+    if (tmp_path == NULL) return -1;
+    memcpy(tmp_path, index_path, len);
+    strcpy(tmp_path + len, ".tmp");
+
+    int ret = -1;
+    int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd >= 0) {
+        ret = save(ar, &st, out_fd);
+        if (close(out_fd) < 0) ret = -1;
+        if (ret == 0) ret = rename(tmp_path, index_path);
+        if (ret < 0) unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    return ret;
+}
+
+int tar_index_build(int tar_fd, const char *index_path) {
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return -1;
+
+    int ret = index_write(ar, index_path, index_save);
+    tar_close(ar);
+    return ret;
+}
+
+/**
+ * Opens an archive from an index in the index file layout, read from a file descriptor which may be closed once
+ * this returns.
+ *
+ * @return the archive handle, or NULL if the index is malformed or stale.
+ */
+static tar_archive_t *index_open_fd(int tar_fd, int idx_fd, int flags) {
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(idx_fd, &st) == 0 && st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, idx_fd, 0);
+    if (map == MAP_FAILED) return NULL;
+
+    tar_archive_t *ar = calloc(1, sizeof(tar_archive_t));
+    if (ar == NULL) { munmap(map, st.st_size); return NULL; }
+
+    ar->fd = tar_fd;
+    ar->index_map = map;
+    ar->index_size = st.st_size;
+
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_OPEN, NULL);
+    if (flags & TAR_OPEN_MMAP) archive_map(ar, flags);
+    int loaded = index_load(ar, map, st.st_size);
+    if (loaded == 0) tar_stats_hit(); // the index did not have to be built
+    tar_stats_end(&scope);
+
+    if (loaded < 0) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+/**
+ * Opens an archive from an existing index file.
+ *
+ * @return the archive handle, or NULL if the index file is missing, malformed or stale.
+ */
+static tar_archive_t *index_open(int tar_fd, const char *index_path, int flags) {
+    int idx_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (idx_fd < 0) return NULL;
+
+    tar_archive_t *ar = index_open_fd(tar_fd, idx_fd, flags);
+    close(idx_fd);
+    return ar;
+}
+
+tar_archive_t *tar_index_open(int tar_fd, const char *index_path, int flags) {
+    tar_archive_t *ar = index_open(tar_fd, index_path, flags);
+    if (ar != NULL) return ar;
+
+    // missing or stale index: rebuild it, or at least index the archive in memory
+    if (tar_index_build(tar_fd, index_path) == 0) ar = index_open(tar_fd, index_path, flags);
+    if (ar == NULL) ar = tar_open_flags(tar_fd, flags);
+    return ar;
+}
+
+int tar_index_publish(tar_archive_t *ar) {
+    if (ar->gz != NULL) return -1; // the index alone cannot read a compressed archive
+
+    struct stat st;
+    if (fstat(ar->fd, &st) < 0) return -1;
+    int fd = memfd_create("lib_tar index", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+
+    // sealed, so that the attached processes can trust it never changes under their mappings
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    if (index_save(ar, &st, fd) < 0 || fcntl(fd, F_ADD_SEALS, seals) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+tar_archive_t *tar_index_attach(int tar_fd, int index_fd, int flags) {
+    // only a sealed index cannot change under the mapping once checked
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    int sealed = fcntl(index_fd, F_GET_SEALS);
+    if (sealed < 0 || (sealed & seals) != seals) return NULL;
+    return index_open_fd(tar_fd, index_fd, flags);
+}
+
+tar_archive_t *tar_open(int tar_fd) {
+    return tar_open_flags(tar_fd, 0);
+}
+
+tar_archive_t *tar_open_flags(int tar_fd, int flags) {
+    tar_archive_t *ar = calloc(1, sizeof(tar_archive_t));
+    if (ar == NULL) return NULL;
+
+    ar->fd = tar_fd;
+
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_OPEN, NULL);
+    if (flags & TAR_OPEN_MMAP) archive_map(ar, flags);
+    struct index_walk walk = {ar};
+    int built = index_build(&walk, 0) < 0 || index_tree(ar) < 0 || index_sort(ar) < 0 || index_links(ar) < 0 ? -1 : 0;
+    tar_stats_end(&scope);
+
+    if (built < 0) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+void tar_close(tar_archive_t *ar) {
+    if (ar == NULL) return;
+    tar_async_free(ar);
+    tar_gz_free(ar->gz);
+    if (ar->map != NULL) munmap((void *)ar->map, ar->map_size);
+    if (ar->views != NULL) {
+        for (uint32_t i = 0; i < ar->no_entries; i++) free(ar->views[i]);
+        free(ar->views);
+    }
+    if (ar->index_map != NULL) {
+        munmap((void *)ar->index_map, ar->index_size);
+    } else {
+        free(ar->offsets);
+        free(ar->sizes);
+        free(ar->paths);
+        free(ar->links);
+        free(ar->hashes);
+        free(ar->types);
+        free(ar->flags);
+        free(ar->modes);
+        free(ar->strings);
+        free(ar->buckets);
+        free(ar->sorted);
+        free(ar->first_child);
+        free(ar->next_sibling);
+        free(ar->targets);
+    }
+    while (ar->retired != NULL) {
+        struct tar_retired *r = ar->retired;
+        ar->retired = r->next;
+        if (r->size) munmap(r->addr, r->size);
+        else free(r->addr);
+        free(r);
+    }
+    free(ar->long_path);
+    free(ar->long_link);
+    free(ar->stats);
+    free(ar);
+}
+
+/**
+ * Looks up an entry actually present in the archive, unlike the implied directories of the directory tree.
+ */
+static uint32_t lookup_entry(const tar_archive_t *ar, const char *path) {
+    uint32_t id = lookup(ar, path);
+    return (id != NO_ENTRY && (ar->flags[id] & ENTRY_IMPLIED)) ? NO_ENTRY : id;
+}
+
+uint32_t tar_find_file(const tar_archive_t *ar, const char *path) {
+    uint32_t id = follow_links(ar, lookup_entry(ar, path));
+    return (id != NO_ENTRY && entry_is_file(ar, id)) ? id : NO_ENTRY;
+}
+
+/**
+ * Looks up an entry actually present in the archive for a query, counting the call in the statistics.
+ */
+static uint32_t query_entry(tar_archive_t *ar, int op, const char *path) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, op, path);
+    uint32_t id = lookup_entry(ar, path);
+    tar_stats_end(&scope);
+    return id;
+}
+
+int tar_exists(tar_archive_t *ar, char *path) {
+    return query_entry(ar, TAR_OP_EXISTS, path) != NO_ENTRY;
+}
+
+int tar_is_dir(tar_archive_t *ar, char *path) {
+    uint32_t id = query_entry(ar, TAR_OP_IS_DIR, path);
+    return id != NO_ENTRY && ar->types[id] == DIRTYPE;
+}
+
+int tar_is_file(tar_archive_t *ar, char *path) {
+    uint32_t id = query_entry(ar, TAR_OP_IS_FILE, path);
+    if (id != NO_ENTRY && ar->types[id] == LNKTYPE) id = ar->targets[id]; // a hard link is the file it names
+    return id != NO_ENTRY && entry_is_file(ar, id);
+}
+
+int tar_is_symlink(tar_archive_t *ar, char *path) {
+    uint32_t id = query_entry(ar, TAR_OP_IS_SYMLINK, path);
+    return id != NO_ENTRY && ar->types[id] == SYMTYPE;
+}
+
+int tar_resolve(tar_archive_t *ar, char *path, const char **target) {
+    uint32_t id = lookup_entry(ar, path);
+    if (id == NO_ENTRY) return -1;
+
+    uint32_t final = ar->targets[id];
+    if (final == NO_ENTRY) return (ar->flags[id] & ENTRY_CYCLE) ? -2 : -1;
+    *target = entry_path(ar, final);
+    return 0;
+}
+
+int tar_stat(tar_archive_t *ar, char *path, tar_lookup_t *st) {
+    uint32_t id = query_entry(ar, TAR_OP_STAT, path);
+    if (id != NO_ENTRY) id = ar->targets[id];
+
+    memset(st, 0, sizeof(*st));
+    if (id == NO_ENTRY) return 0;
+    st->found = 1;
+    st->typeflag = ar->types[id];
+    st->size = ar->sizes[id];
+    st->offset = ar->offsets[id];
+    return 1;
+}
+
+/**
+ * Finds the directory at a given path, following symlinks. "dir" and "dir/" both name the directory "dir/", and
+ * the empty path names the root of the archive.
+ *
+ * @return the index of the directory, or NO_ENTRY if there is no directory at that path.
+ */
+static uint32_t find_dir(const tar_archive_t *ar, const char *path) {
+    size_t len = strlen(path);
+    uint32_t id = lookup(ar, path);
+
+    if (id == NO_ENTRY && len > 0 && path[len - 1] != '/') {
+        char *dir = malloc(len + 2);
+        if (dir == NULL) return NO_ENTRY;
+        memcpy(dir, path, len);
+        strcpy(dir + len, "/");
+        id = lookup(ar, dir);
+        free(dir);
+    }
+
+    id = follow_links(ar, id);
+    if (id == NO_ENTRY || ar->types[id] != DIRTYPE) return NO_ENTRY;
+    return id;
+}
+
+int tar_list_begin(tar_archive_t *ar, char *path, tar_cursor_t *cursor) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_LIST, path);
+    uint32_t id = find_dir(ar, path);
+    tar_stats_end(&scope);
+
+    cursor->ar = ar;
+    cursor->next = id == NO_ENTRY ? NO_ENTRY : ar->first_child[id];
+    return id != NO_ENTRY;
+}
+
+const char *tar_list_next(tar_cursor_t *cursor) {
+    if (cursor->next == NO_ENTRY) return NULL;
+
+    uint32_t id = cursor->next;
+    cursor->next = cursor->ar->next_sibling[id];
+    return entry_path(cursor->ar, id);
+}
+
+/**
+ * Finds the first position of the sorted permutation whose path is not less than a prefix: the paths starting with
+ * the prefix are the ones from there on, up to the first which does not.
+ */
+static uint32_t sorted_lower_bound(const tar_archive_t *ar, const char *prefix) {
+    uint32_t lo = 0, hi = ar->no_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(entry_path(ar, ar->sorted[mid]), prefix) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int tar_list_recursive(tar_archive_t *ar, const char *prefix, const char *glob, tar_list_cb callback, void *ctx) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_LIST, prefix);
+
+    size_t len = strlen(prefix);
+    int matched = 0;
+    for (uint32_t i = sorted_lower_bound(ar, prefix); i < ar->no_entries; i++) {
+        const char *path = entry_path(ar, ar->sorted[i]);
+        if (strncmp(path, prefix, len) != 0) break;
+        if (path[0] == '\0') continue; // the root
+        if (glob != NULL && fnmatch(glob, path, 0) != 0) continue;
+
+        matched++;
+        if (callback(ctx, path) != 0) break;
+    }
+
+    tar_stats_end(&scope);
+    return matched;
+}
+
+int tar_list(tar_archive_t *ar, char *path, char **entries, size_t *no_entries) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_LIST, path);
+
+    tar_cursor_t cursor;
+    size_t c = 0;
+    int found = tar_list_begin(ar, path, &cursor);
+    const char *name;
+    while (found && c < *no_entries && (name = tar_list_next(&cursor)) != NULL) entry_copy(entries[c++], name);
+    *no_entries = c;
+
+    tar_stats_end(&scope);
+    return found;
+}
+
+/**
+ * Reads from a given offset of a file whose content is at start in an archive.
+ *
+ * @return the same values as tar_read_file().
+ */
+static ssize_t content_read(const tar_archive_t *ar, uint64_t start, size_t size, size_t offset, uint8_t *dest,
+                            size_t *len) {
+    if (offset > size) return -2;
+
+    if (size - offset < *len) *len = size - offset;
+
+    ssize_t r = tar_archive_read(ar, dest, *len, start + offset);
+    if (r < 0) return -1; // read error
+    *len = r;
+
+    return (size - offset) - *len;
+}
+
+static ssize_t file_read(tar_archive_t *ar, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    uint32_t id = tar_find_file(ar, path);
+    if (id == NO_ENTRY) return -1;
+    return content_read(ar, ar->offsets[id], ar->sizes[id], offset, dest, len);
+}
+
+ssize_t tar_read_file(tar_archive_t *ar, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_READ_FILE, path);
+    ssize_t ret = file_read(ar, path, offset, dest, len);
+    tar_stats_end(&scope);
+    return ret;
+}
+
+static int file_view(tar_archive_t *ar, char *path, const uint8_t **ptr, size_t *len) {
+    uint32_t id = tar_find_file(ar, path);
+    if (id == NO_ENTRY) return -1;
+
+    uint64_t offset = ar->offsets[id];
+    size_t size = ar->sizes[id];
+
+    if (ar->map != NULL) {
+        if (offset + size > ar->map_size) return -1; // truncated archive
+        *ptr = ar->map + offset;
+        *len = size;
+        tar_stats_hit();
+        return 0;
+    }
+
+    // no mapping: read the file once and keep the copy for the lifetime of the handle,
+    // publishing it with a compare-and-swap so that concurrent callers never lock
+    uint8_t **views = __atomic_load_n(&ar->views, __ATOMIC_ACQUIRE);
+    if (views == NULL) {
+        uint32_t n = ar->max_entries > ar->no_entries ? ar->max_entries : ar->no_entries; // entries_grow() grows them
+        uint8_t **fresh = calloc(n, sizeof(uint8_t *));
+        if (fresh == NULL) return -1;
+        if (__atomic_compare_exchange_n(&ar->views, &views, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            views = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+
+    uint8_t *view = __atomic_load_n(&views[id], __ATOMIC_ACQUIRE);
+    if (view != NULL) {
+        tar_stats_hit();
+    } else {
+        uint8_t *fresh = malloc(size ? size : 1);
+        if (fresh == NULL) return -1;
+        if (tar_archive_read(ar, fresh, size, offset) != size) { free(fresh); return -1; }
+        if (__atomic_compare_exchange_n(&views[id], &view, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) view = fresh;
+        else free(fresh);
+    }
+
+    *ptr = view;
+    *len = size;
+    return 0;
+}
+
+int tar_view_file(tar_archive_t *ar, char *path, const uint8_t **ptr, size_t *len) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_VIEW_FILE, path);
+    int ret = file_view(ar, path, ptr, len);
+    tar_stats_end(&scope);
+    return ret;
+}
+
+#define BATCH_GAP (256 * 1024)          // largest hole between two ranges still read with a single preadv()
+#define BATCH_MAX (16 * 1024 * 1024)    // largest single preadv()
+
+struct batch_range {
+    uint64_t start;             // offset in the archive of the first byte to read
+    size_t req;                 // index of the request
+};
+
+static int compare_ranges(const void *a, const void *b) {
+    const struct batch_range *ra = a, *rb = b;
+    return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+/**
+ * Reads the ranges of a group with a single preadv(), the holes between them going to a scratch buffer.
+ *
+ * @return zero on success, -1 if the group could not be read entirely.
+ */
+static int batch_read_group(tar_archive_t *ar, tar_read_req_t *reqs, const struct batch_range *ranges, size_t n,
+                            struct iovec *iov, uint8_t *scratch) {
+    int iovcnt = 0;
+    uint64_t pos = ranges[0].start;
+    size_t total = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        tar_read_req_t *req = &reqs[ranges[i].req];
+        for (uint64_t gap = ranges[i].start - pos; gap > 0;) {
+            size_t chunk = gap < BATCH_GAP ? gap : BATCH_GAP;
+            iov[iovcnt++] = (struct iovec){scratch, chunk};
+            gap -= chunk;
+            total += chunk;
+        }
+        iov[iovcnt++] = (struct iovec){req->dest, req->len};
+        pos = ranges[i].start + req->len;
+        total += req->len;
+    }
+
+    ssize_t r = preadv(ar->fd, iov, iovcnt, ranges[0].start);
+    tar_stats_read(ranges[0].start, r < 0 ? 0 : r, 1);
+    return r == total ? 0 : -1;
+}
+
+/**
+ * Reads a single resolved request, setting its error as read_file() would on a read error.
+ *
+ * @return zero on success, -1 on a read error.
+ */
+static int batch_read_one(tar_archive_t *ar, tar_read_req_t *req, uint64_t start) {
+    ssize_t r = tar_archive_read(ar, req->dest, req->len, start);
+    if (r < 0) { req->len = 0; req->ret = -1; return -1; }
+    req->ret += req->len - r; // a truncated archive reads as a shorter file
+    req->len = r;
+    return 0;
+}
+
+static int batch_read(tar_archive_t *ar, tar_read_req_t *reqs, size_t n) {
+    struct batch_range *ranges = malloc((n ? n : 1) * sizeof(struct batch_range));
+    if (ranges == NULL) return -1;
+
+    // resolve every request, as tar_read_file() would
+    size_t no_ranges = 0;
+    for (size_t i = 0; i < n; i++) {
+        tar_read_req_t *req = &reqs[i];
+        uint32_t id = tar_find_file(ar, req->path);
+        if (id == NO_ENTRY) { req->len = 0; req->ret = -1; continue; }
+
+        size_t size = ar->sizes[id];
+        if (req->offset > size) { req->len = 0; req->ret = -2; continue; }
+
+        if (size - req->offset < req->len) req->len = size - req->offset;
+        req->ret = (size - req->offset) - req->len;
+        if (req->len == 0) continue;
+
+        ranges[no_ranges].start = ar->offsets[id] + req->offset;
+        ranges[no_ranges].req = i;
+        no_ranges++;
+    }
+
+    // a mapped archive needs no system call at all, a compressed one cannot be read with preadv()
+    if (ar->map != NULL || ar->gz != NULL) {
+        int ret = 0;
+        for (size_t i = 0; i < no_ranges; i++) {
+            if (batch_read_one(ar, &reqs[ranges[i].req], ranges[i].start) < 0) ret = -1;
+        }
+        free(ranges);
+        return ret;
+    }
+
+    qsort(ranges, no_ranges, sizeof(struct batch_range), compare_ranges);
+
+    long iov_max = sysconf(_SC_IOV_MAX);
+    if (iov_max <= 0) iov_max = 1024;
+    struct iovec *iov = malloc(iov_max * sizeof(struct iovec));
+    uint8_t *scratch = malloc(BATCH_GAP);
+    int ret = (iov == NULL || scratch == NULL) ? -1 : 0;
+
+    // merge the ranges close to each other into groups read at once
+    // a failed read only fails its own requests, the other groups are still read
+    for (size_t first = 0; iov != NULL && scratch != NULL && first < no_ranges;) {
+        uint64_t end = ranges[first].start + reqs[ranges[first].req].len;
+        size_t last = first + 1;
+        long iovcnt = 1;
+
+        while (last < no_ranges) {
+            uint64_t start = ranges[last].start;
+            size_t len = reqs[ranges[last].req].len;
+            long holes = (start - end + BATCH_GAP - 1) / BATCH_GAP;
+
+            // overlapping ranges cannot be scattered by a single read
+            if (start < end || start - end > BATCH_GAP) break;
+            if (iovcnt + holes + 1 > iov_max || start + len - ranges[first].start > BATCH_MAX) break;
+
+            iovcnt += holes + 1;
+            end = start + len;
+            last++;
+        }
+
+        if (batch_read_group(ar, reqs, ranges + first, last - first, iov, scratch) < 0) {
+            // short read: fall back to one read per request of the group
+            for (size_t i = first; i < last; i++) {
+                if (batch_read_one(ar, &reqs[ranges[i].req], ranges[i].start) < 0) ret = -1;
+            }
+        }
+        first = last;
+    }
+
+    free(iov);
+    free(scratch);
+    free(ranges);
+    return ret;
+}
+
+int tar_read_files_batch(tar_archive_t *ar, tar_read_req_t *reqs, size_t n) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_READ_BATCH, NULL);
+    int ret = batch_read(ar, reqs, n);
+    tar_stats_end(&scope);
+    return ret;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/*                           Incremental refresh                             */
+/* ------------------------------------------------------------------------- */
+
+/**
+ * Copies an index living in a mapped index file into memory, where it can grow.
+ * The index file stays mapped until tar_close(), for the paths handed out point into it.
+ */
+static int index_detach(tar_archive_t *ar) {
+    struct index_header header = {.no_entries = ar->no_entries, .no_buckets = ar->no_buckets,
+                                  .strings_len = ar->strings_len};
+    struct index_section sections[NO_SECTIONS];
+    void *copies[NO_SECTIONS];
+    index_sections(ar, &header, sections);
+
+    for (int i = 0; i < NO_SECTIONS; i++) {
+        copies[i] = malloc(sections[i].len ? sections[i].len : 1);
+        if (copies[i] == NULL) {
+            while (i-- > 0) free(copies[i]);
+            return -1;
+        }
+        memcpy(copies[i], *(void **)sections[i].array, sections[i].len);
+    }
+    if (retire(ar, (void *)ar->index_map, ar->index_size) < 0) {
+        for (int i = 0; i < NO_SECTIONS; i++) free(copies[i]);
+        return -1;
+    }
+
+    for (int i = 0; i < NO_SECTIONS; i++) *(void **)sections[i].array = copies[i];
+    ar->index_map = NULL;
+    ar->max_entries = ar->no_entries; // the views too, tar_view_file() sized them to no_entries
+    ar->strings_max = ar->strings_len;
+
+    // the index file does not keep where the last header ends, nor the links to resolve again
+    ar->tail = 0;
+    ar->no_unstable = 0;
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        if (ar->flags[id] & ENTRY_UNSTABLE) ar->no_unstable++;
+        if (ar->flags[id] & ENTRY_IMPLIED) continue;
+        uint64_t end = ar->offsets[id] + (ar->sizes[id] + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (end > ar->tail) ar->tail = end;
+    }
+    return 0;
+}
+
+/**
+ * Merges the entries from first on into the sorted permutation of the older ones.
+ */
+static int index_sort_tail(tar_archive_t *ar, uint32_t first) {
+    uint32_t *sorted = realloc(ar->sorted, (ar->no_entries ? ar->no_entries : 1) * sizeof(uint32_t));
+    if (sorted == NULL) return -1;
+    ar->sorted = sorted;
+
+    uint32_t added = ar->no_entries - first;
+    for (uint32_t i = 0; i < added; i++) sorted[first + i] = first + i;
+    qsort_r(sorted + first, added, sizeof(uint32_t), compare_paths, ar);
+
+    // merge from the back: an older entry is never overwritten before it moved
+    uint32_t *tail = malloc((added ? added : 1) * sizeof(uint32_t));
+    if (tail == NULL) return -1;
+    memcpy(tail, sorted + first, added * sizeof(uint32_t));
+    uint32_t i = first, j = added, k = ar->no_entries;
+    while (j > 0) {
+        if (i > 0 && compare_paths(&sorted[i - 1], &tail[j - 1], ar) > 0) sorted[--k] = sorted[--i];
+        else sorted[--k] = tail[--j];
+    }
+    free(tail);
+    return 0;
+}
+
+/**
+ * Indexes the headers appended since the last one indexed.
+ */
+static int refresh(tar_archive_t *ar) {
+    if (ar->gz != NULL) return -1;
+    if (ar->index_map != NULL && index_detach(ar) < 0) return -1;
+
+    struct stat st;
+    if (fstat(ar->fd, &st) < 0) return -1;
+    if ((uint64_t)st.st_size < ar->tail) return -1; // truncated or rewritten
+    if (ar->map != NULL && (size_t)st.st_size > ar->map_size) {
+        // views handed out point into the old mapping
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ar->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        if (retire(ar, (void *)ar->map, ar->map_size) < 0) {
+            munmap(map, st.st_size);
+            return -1;
+        }
+        ar->map = map;
+        ar->map_size = st.st_size;
+    }
+
+    uint32_t first = ar->no_entries;
+    struct index_walk walk = {ar, 1, st.st_size};
+    ar->refreshing = 1;
+    int ret = index_build(&walk, ar->tail);
+    uint32_t added = ar->no_entries;
+
+    // the new entries are linked after their older siblings, so they come first in the listings
+    for (uint32_t id = added; ret == 0 && id-- > first;) {
+        if (tree_link(ar, id) < 0) ret = -1;
+    }
+    if (ret == 0 && index_sort_tail(ar, first) < 0) ret = -1;
+
+    // a new entry only changes where links lead if it is a link, or if a link could not be resolved for sure
+    if (ret == 0 && (ar->relink || ar->no_unstable)) {
+        if (index_links(ar) < 0) ret = -1;
+    } else if (ret == 0 && ar->no_entries > first) {
+        uint32_t *targets = realloc(ar->targets, ar->no_entries * sizeof(uint32_t));
+        if (targets == NULL) ret = -1;
+        else {
+            ar->targets = targets;
+            for (uint32_t id = first; id < ar->no_entries; id++) targets[id] = id;
+        }
+    }
+    ar->refreshing = 0;
+    return ret < 0 ? -1 : (int)walk.indexed;
+}
+
+int tar_refresh(tar_archive_t *ar) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_REFRESH, NULL);
+    int ret = refresh(ar);
+    tar_stats_end(&scope);
+    return ret;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/*                               Open entries                                */
+/* ------------------------------------------------------------------------- */
+
+struct tar_entry {
+    tar_archive_t *ar;
+    uint64_t offset;            // offset of the content in the archive
+    uint64_t size;
+    uint64_t pos;               // position of the next tar_entry_read()
+
+    size_t readahead;           // read-ahead window, zero for none
+    uint64_t advised;           // end of the content already announced to the kernel
+
+    uint8_t *buffer;            // decompressed read-ahead of a gzip-compressed archive, NULL otherwise
+    uint64_t buffer_start;      // position in the content of buffer[0]
+    size_t buffer_len;
+};
+
+tar_entry_t *tar_entry_open(tar_archive_t *ar, const char *path) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_ENTRY_OPEN, path);
+    uint32_t id = tar_find_file(ar, path);
+    tar_stats_end(&scope);
+    if (id == NO_ENTRY) return NULL;
+
+    tar_entry_t *e = calloc(1, sizeof(tar_entry_t));
+    if (e == NULL) return NULL;
+    e->ar = ar;
+    e->offset = ar->offsets[id];
+    e->size = ar->sizes[id];
+    return e;
+}
+
+int tar_entry_readahead(tar_entry_t *e, size_t window) {
+    free(e->buffer);
+    e->buffer = NULL;
+    e->buffer_len = 0;
+    e->readahead = window;
+    e->advised = 0;
+
+    // a compressed archive cannot be read ahead by the kernel, keep the decompressed window instead
+    if (window > 0 && e->ar->gz != NULL && (e->buffer = malloc(window)) == NULL) {
+        e->readahead = 0;
+        return -1;
+    }
+    return 0;
+}
 
 /**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * Asks the kernel to read ahead the window following the end of a read, once the read gets within half a window
+ * of what was already announced, so that the sequential reads of an entry never wait for the disk.
+ */
+static void entry_advise(tar_entry_t *e, uint64_t end) {
+    if (e->readahead == 0) return;
+    if (end + e->readahead < e->advised) e->advised = 0; // moved back, announce again from there
+    if (end + e->readahead / 2 < e->advised) return;
+
+    uint64_t start = end > e->advised ? end : e->advised;
+    uint64_t stop = end + e->readahead < e->size ? end + e->readahead : e->size;
+    if (start >= stop) return;
+    e->advised = stop;
+
+    tar_archive_t *ar = e->ar;
+    if (ar->map != NULL) {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t first = (e->offset + start) / page * page;
+        madvise((void *)(ar->map + first), e->offset + stop - first, MADV_WILLNEED);
+    } else {
+        posix_fadvise(ar->fd, e->offset + start, stop - start, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * Reads a part of the content of a compressed entry through its read-ahead window, decompressing a whole window
+ * whenever the part is not in it.
+ */
+static ssize_t entry_buffered(tar_entry_t *e, uint8_t *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        if (pos < e->buffer_start || pos >= e->buffer_start + e->buffer_len) {
+            // larger than the window: straight to the caller buffer
+            if (len - done >= e->readahead) {
+                ssize_t r = tar_archive_read(e->ar, buf + done, len - done, e->offset + pos);
+                return r < 0 ? -1 : done + r;
+            }
+
+            size_t want = e->size - pos < e->readahead ? e->size - pos : e->readahead;
+            ssize_t r = tar_archive_read(e->ar, e->buffer, want, e->offset + pos);
+            if (r <= 0) {
+                e->buffer_len = 0;
+                return r < 0 ? -1 : done;
+            }
+            e->buffer_start = pos;
+            e->buffer_len = r;
+        } else {
+            tar_stats_hit();
+        }
+
+        size_t from = pos - e->buffer_start;
+        size_t take = e->buffer_len - from < len - done ? e->buffer_len - from : len - done;
+        memcpy(buf + done, e->buffer + from, take);
+        done += take;
+    }
+    return done;
+}
+
+ssize_t tar_entry_pread(tar_entry_t *e, void *buf, size_t len, uint64_t offset) {
+    if (offset >= e->size) return 0;
+    if (len > e->size - offset) len = e->size - offset;
+
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, e->ar, TAR_OP_ENTRY_READ, NULL);
+    ssize_t r;
+    if (e->buffer != NULL) {
+        r = entry_buffered(e, buf, len, offset);
+    } else {
+        entry_advise(e, offset + len);
+        r = tar_archive_read(e->ar, buf, len, e->offset + offset);
+    }
+    tar_stats_end(&scope);
+    return r;
+}
+
+ssize_t tar_entry_read(tar_entry_t *e, void *buf, size_t len) {
+    ssize_t r = tar_entry_pread(e, buf, len, e->pos);
+    if (r > 0) e->pos += r;
+    return r;
+}
+
+int64_t tar_entry_seek(tar_entry_t *e, int64_t offset, int whence) {
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = e->pos; break;
+        case SEEK_END: base = e->size; break;
+        default: return -1;
+    }
+    if (offset < -base) return -1;
+
+    e->pos = base + offset;
+    return e->pos;
+}
+
+uint64_t tar_entry_size(const tar_entry_t *e) {
+    return e->size;
+}
+
+void tar_entry_close(tar_entry_t *e) {
+    if (e == NULL) return;
+    free(e->buffer);
+    free(e);
+}
+
+/* ------------------------------------------------------------------------- */
+/*                         Gzip-compressed archives                          */
+/* ------------------------------------------------------------------------- */
+
+#define GZ_INDEX_MAGIC "LTARGZI"
+
+/*
+ * Layout of a gzip index file: this header, the checkpoints saved by tar_gz_save(), then, at the next multiple of
+ * 8 bytes, a sidecar index of the decompressed archive.
+ */
+struct gz_index_header {
+    char magic[8];
+    uint64_t points_len;        // size of the checkpoints
+};
+
+/* Header walk over the decompressed stream, whose chunks cut headers anywhere. */
+struct gz_walk {
+    tar_archive_t *ar;
+    uint64_t next;              // offset of the next header
+    size_t have;                // bytes of it gathered so far
+    uint8_t block[TAR_BLOCK];
+    uint8_t *content;           // content of the extended header in block being gathered, NULL otherwise
+    size_t content_len;
+    size_t content_have;
+    int error;
+};
+
+static int gz_visit(void *ctx, const uint8_t *buf, size_t len, uint64_t offset) {
+    struct gz_walk *walk = ctx;
+    const tar_header_t *header = (const tar_header_t *)walk->block;
+
+    while (len > 0) {
+        // the content of an extended header, right after it
+        if (walk->content != NULL) {
+            size_t take = walk->content_len - walk->content_have < len ? walk->content_len - walk->content_have : len;
+            memcpy(walk->content + walk->content_have, buf, take);
+            walk->content_have += take;
+            buf += take;
+            len -= take;
+            offset += take;
+            if (walk->content_have < walk->content_len) return 0;
+
+            int ret = index_add(walk->ar, header, offset - walk->content_len, walk->content);
+            free(walk->content);
+            walk->content = NULL;
+            if (ret < 0) {
+                walk->error = 1;
+                return 1;
+            }
+            continue;
+        }
+
+        // skip file data up to the next header
+        if (offset + len <= walk->next) return 0;
+        if (offset < walk->next) {
+            size_t skip = walk->next - offset;
+            buf += skip;
+            len -= skip;
+            offset += skip;
+        }
+
+        size_t take = TAR_BLOCK - walk->have < len ? TAR_BLOCK - walk->have : len;
+        memcpy(walk->block + walk->have, buf, take);
+        walk->have += take;
+        buf += take;
+        len -= take;
+        offset += take;
+        if (walk->have < TAR_BLOCK) return 0;
+
+        if (header->name[0] == '\0') return 1; // end of archive
+        if (!header_known(header)) return 1;
+
+        size_t size = TAR_INT(header->size);
+        walk->next += TAR_BLOCK + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        walk->have = 0;
+
+        // the stream cannot be read back here, so gather the content of an extended header as it goes by
+        if (is_extended(header->typeflag) && size > 0 && size <= EXTENDED_MAX) {
+            walk->content = malloc(size);
+            walk->content_len = size;
+            walk->content_have = 0;
+            if (walk->content == NULL) {
+                walk->error = 1;
+                return 1;
+            }
+            continue;
+        }
+
+        if (index_add(walk->ar, header, offset, NULL) < 0) {
+            walk->error = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+tar_archive_t *tar_open_gz(int gz_fd, size_t span) {
+    tar_archive_t *ar = calloc(1, sizeof(tar_archive_t));
+    if (ar == NULL) return NULL;
+
+    // the checkpoints and the index are built in the same decompression pass
+    struct gz_walk walk = {.ar = ar};
+    struct tar_stats_scope scope;
+    ar->fd = gz_fd;
+    tar_stats_begin(&scope, ar, TAR_OP_OPEN, NULL);
+    ar->gz = tar_gz_build(gz_fd, span ? span : TAR_GZ_SPAN, gz_visit, &walk);
+    free(walk.content);
+    int built = ar->gz == NULL || walk.error ? -1 : 0;
+    if (built == 0 && (index_tree(ar) < 0 || index_sort(ar) < 0 || index_links(ar) < 0)) built = -1;
+    tar_stats_end(&scope);
+
+    if (built < 0) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+static int gz_index_save(tar_archive_t *ar, const struct stat *st, int out_fd) {
+    static const char zeros[8];
+    struct gz_index_header header = {GZ_INDEX_MAGIC};
+
+    if (tar_write_full(out_fd, &header, sizeof(header)) < 0 || tar_gz_save(ar->gz, out_fd) < 0) return -1;
+    off_t pos = lseek(out_fd, 0, SEEK_CUR);
+    if (pos < 0 || tar_write_full(out_fd, zeros, ALIGN8(pos) - pos) < 0) return -1;
+
+    header.points_len = pos - sizeof(header);
+    if (pwrite(out_fd, &header, sizeof(header), 0) != sizeof(header)) return -1;
+    return index_save(ar, st, out_fd);
+}
+
+int tar_gz_index_build(int gz_fd, const char *index_path, size_t span) {
+    tar_archive_t *ar = tar_open_gz(gz_fd, span);
+    if (ar == NULL) return -1;
+
+    int ret = index_write(ar, index_path, gz_index_save);
+    tar_close(ar);
+    return ret;
+}
+
+/**
+ * Opens a gzip-compressed archive from an existing gzip index file.
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @return the archive handle, or NULL if the index file is missing, malformed or stale.
+ */
+static tar_archive_t *gz_index_open(int gz_fd, const char *index_path) {
+    int idx_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (idx_fd < 0) return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(idx_fd, &st) == 0 && st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, idx_fd, 0);
+    close(idx_fd);
+    if (map == MAP_FAILED) return NULL;
+
+    tar_archive_t *ar = calloc(1, sizeof(tar_archive_t));
+    if (ar == NULL) { munmap(map, st.st_size); return NULL; }
+
+    ar->fd = gz_fd;
+    ar->index_map = map;
+    ar->index_size = st.st_size;
+
+    const struct gz_index_header *header = map;
+    size_t used;
+    if (st.st_size < sizeof(*header) || memcmp(header->magic, GZ_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->points_len > st.st_size - sizeof(*header)) {
+        tar_close(ar);
+        return NULL;
+    }
+
+    // the checkpoints first, index_load() reads the archive to check it
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_OPEN, NULL);
+    ar->gz = tar_gz_load(ar->index_map + sizeof(*header), header->points_len, &used);
+    uint64_t index_off = ALIGN8(sizeof(*header) + header->points_len);
+    int loaded = ar->gz == NULL || used != header->points_len || index_off > st.st_size ? -1 :
+                 index_load(ar, ar->index_map + index_off, st.st_size - index_off);
+    if (loaded == 0) tar_stats_hit();
+    tar_stats_end(&scope);
+
+    if (loaded < 0) {
+        tar_close(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+tar_archive_t *tar_gz_index_open(int gz_fd, const char *index_path, size_t span) {
+    tar_archive_t *ar = gz_index_open(gz_fd, index_path);
+    if (ar != NULL) return ar;
+
+    if (tar_gz_index_build(gz_fd, index_path, span) == 0) ar = gz_index_open(gz_fd, index_path);
+    if (ar == NULL) ar = tar_open_gz(gz_fd, span);
+    return ar;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/*                             Layered archives                              */
+/* ------------------------------------------------------------------------- */
+
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+struct tar_overlay {
+    tar_archive_t **layers;     // borrowed handles, the lowest layer first
+    size_t no_layers;
+
+    // merged index: the entries visible through the layers, with the offsets and sizes of their own layer, and
+    // their directory tree and links built over the merged paths
+    tar_archive_t *view;
+    uint32_t *layer_of;         // layer of every entry of the merged index
+    uint32_t max_layer_of;
+};
+
+/**
+ * Gives the name of the path a whiteout hides, NULL if the path is not a whiteout.
+ */
+static const char *whiteout_name(const char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || path[len - 1] == '/') return NULL;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    return strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0 ? name : NULL;
+}
+
+/**
+ * Whether a path of a layer is hidden by the layers above it: by a whiteout of the path or of a parent directory,
+ * by an opaque parent directory, or by an entry of another type at the path or at a parent directory.
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * @param masks The whiteouts of the layers above, by path, and their opaque directories, by path with a slash.
+ * @param dirs The directories of the layers above, by path with a slash, including the ones only implied by a path.
+ * @param buffer A buffer of at least strlen(path) + 2 bytes.
  */
-int check_archive(int tar_fd) {
-    lseek(tar_fd, 0, SEEK_SET);
-    char buffer[sizeof(tar_header_t)];
-    int counter = 0;
-    
-    while (1) {
-        if(read(tar_fd, buffer, sizeof(tar_header_t)) != sizeof(tar_header_t)) return -1; // read error 
+static int overlay_hidden(const tar_archive_t *view, const tar_archive_t *masks, const tar_archive_t *dirs,
+                          const char *path, char *buffer) {
+    size_t len = strlen(path);
+    size_t name_len = len > 0 && path[len - 1] == '/' ? len - 1 : len;
+
+    if (lookup_len(masks, path, name_len) != NO_ENTRY) return 1;
+    if (name_len < len) {
+        if (lookup_len(view, path, name_len) != NO_ENTRY) return 1; // a file over a directory
+    } else {
+        memcpy(buffer, path, len);
+        strcpy(buffer + len, "/");
+        if (lookup_len(dirs, buffer, len + 1) != NO_ENTRY) return 1; // a directory over a file
+    }
+
+    for (size_t i = 0; i < name_len; i++) {
+        if (path[i] != '/') continue;
+        if (lookup_len(masks, path, i) != NO_ENTRY) return 1;     // whiteout of the directory
+        if (lookup_len(masks, path, i + 1) != NO_ENTRY) return 1; // opaque directory
+        if (lookup_len(view, path, i) != NO_ENTRY) return 1;      // a file or a link over the directory
+    }
+    return 0;
+}
+
+/**
+ * Adds an entry of a layer to the merged index.
+ */
+static int overlay_add(tar_overlay_t *ov, const tar_archive_t *ar, uint32_t id, uint32_t layer) {
+    tar_archive_t *view = ov->view;
+    const char *path = entry_path(ar, id);
+    uint32_t dst = entry_insert(view, path, strlen(path));
+    if (dst == NO_ENTRY) return -1;
+
+    const char *link = entry_link(ar, id);
+    ssize_t off = strings_add(view, link, strlen(link));
+    if (off < 0) return -1;
+
+    if (ov->max_layer_of < view->max_entries) {
+        if (array_grow(&ov->layer_of, view->max_entries * sizeof(uint32_t)) < 0) return -1;
+        ov->max_layer_of = view->max_entries;
+    }
+    view->offsets[dst] = ar->offsets[id];
+    view->sizes[dst] = ar->sizes[id];
+    view->types[dst] = ar->types[id];
+    view->modes[dst] = ar->modes[id];
+    view->links[dst] = off;
+    ov->layer_of[dst] = layer;
+    return 0;
+}
 
-        tar_header_t* tar_header = (tar_header_t*)buffer;
+/**
+ * Adds the parent directories of the entries merged from a layer to the directories of the layers above.
+ */
+static int overlay_dirs(const tar_archive_t *view, uint32_t first, tar_archive_t *dirs) {
+    for (uint32_t id = first; id < view->no_entries; id++) {
+        const char *path = entry_path(view, id);
+        size_t len = strlen(path);
+        if (len > 0 && path[len - 1] == '/' && entry_insert(dirs, path, len) == NO_ENTRY) return -1;
+        for (size_t i = 0; i + 1 < len; i++) {
+            if (path[i] == '/' && entry_insert(dirs, path, i + 1) == NO_ENTRY) return -1;
+        }
+    }
+    return 0;
+}
 
-        if(strncmp(tar_header->magic, TMAGIC, TMAGLEN) != 0) return -1; // magic error
-        if(strncmp(tar_header->version, TVERSION, TVERSLEN) != 0) return -2; // version error
+/**
+ * Builds the merged index from the top layer down: an entry is only added if no upper layer has the same path or
+ * hides it. The whiteouts and the directories of a layer only hide the layers below it, so they are taken once the
+ * layer is merged.
+ */
+static int overlay_build(tar_overlay_t *ov, tar_archive_t *masks, tar_archive_t *dirs) {
+    size_t max_len = 0;
+    for (size_t layer = 0; layer < ov->no_layers; layer++) {
+        const tar_archive_t *ar = ov->layers[layer];
+        for (uint32_t id = 0; id < ar->no_entries; id++) {
+            size_t len = strlen(entry_path(ar, id));
+            if (len > max_len) max_len = len;
+        }
+    }
+    char *buffer = malloc(max_len + 2);
+    if (buffer == NULL) return -1;
 
-        int sum = 0;
-        for (int i = 0; i < sizeof(tar_header_t); i++) {
-            sum += (i >= 148 && i < 156) ? ' ' : buffer[i];
+    int opaque_root = 0;
+    for (size_t layer = ov->no_layers; layer-- > 0 && !opaque_root;) {
+        const tar_archive_t *ar = ov->layers[layer];
+        uint32_t first = ov->view->no_entries;
+        for (uint32_t id = 0; id < ar->no_entries; id++) {
+            const char *path = entry_path(ar, id);
+            if (ar->flags[id] & ENTRY_IMPLIED) continue; // the merged tree adds its own
+            if (whiteout_name(path) != NULL) continue;
+            if (lookup(ov->view, path) != NO_ENTRY || overlay_hidden(ov->view, masks, dirs, path, buffer)) continue;
+            if (overlay_add(ov, ar, id, layer) < 0) goto fail;
         }
+        if (overlay_dirs(ov->view, first, dirs) < 0) goto fail;
 
-        if(TAR_INT(tar_header->chksum) != sum) return -3; // checksum error
+        for (uint32_t id = 0; id < ar->no_entries; id++) {
+            const char *path = entry_path(ar, id);
+            const char *name = whiteout_name(path);
+            if (name == NULL) continue;
 
-        int skip = (TAR_INT(tar_header->size) + sizeof(tar_header_t) - 1) / sizeof(tar_header_t);
-        lseek(tar_fd,skip*sizeof(tar_header_t),SEEK_CUR);
+            size_t dir_len = name - path;
+            uint32_t mask;
+            if (strcmp(name, WHITEOUT_OPAQUE) == 0) {
+                if (dir_len == 0) opaque_root = 1;
+                mask = entry_insert(masks, path, dir_len);
+            } else {
+                size_t len = strlen(path) - strlen(WHITEOUT_PREFIX);
+                memcpy(buffer, path, dir_len);
+                strcpy(buffer + dir_len, name + strlen(WHITEOUT_PREFIX));
+                mask = entry_insert(masks, buffer, len);
+            }
+            if (mask == NO_ENTRY) goto fail;
+        }
+    }
 
-        counter++;
+    free(buffer);
+    return index_tree(ov->view) < 0 || index_sort(ov->view) < 0 || index_links(ov->view) < 0 ? -1 : 0;
+
+fail:
+    free(buffer);
+    return -1;
+}
+
+tar_overlay_t *tar_overlay_open(tar_archive_t **layers, size_t no_layers) {
+    tar_overlay_t *ov = calloc(1, sizeof(tar_overlay_t));
+    if (ov == NULL) return NULL;
+
+    tar_archive_t *masks = calloc(1, sizeof(tar_archive_t));
+    tar_archive_t *dirs = calloc(1, sizeof(tar_archive_t));
+    ov->layers = malloc((no_layers ? no_layers : 1) * sizeof(tar_archive_t *));
+    ov->view = calloc(1, sizeof(tar_archive_t));
+    if (masks == NULL || dirs == NULL || ov->layers == NULL || ov->view == NULL) {
+        free(masks);
+        free(dirs);
+        tar_overlay_close(ov);
+        return NULL;
+    }
+    memcpy(ov->layers, layers, no_layers * sizeof(tar_archive_t *));
+    ov->no_layers = no_layers;
+    ov->view->fd = -1; // the data is read from the layers
+
+    int built = overlay_build(ov, masks, dirs);
+    tar_close(masks);
+    tar_close(dirs);
+    if (built < 0) {
+        tar_overlay_close(ov);
+        return NULL;
+    }
+    return ov;
+}
+
+void tar_overlay_close(tar_overlay_t *ov) {
+    if (ov == NULL) return;
+    tar_close(ov->view);
+    free(ov->layer_of);
+    free(ov->layers);
+    free(ov);
+}
+
+int tar_overlay_exists(tar_overlay_t *ov, char *path) {
+    return tar_exists(ov->view, path);
+}
+
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path) {
+    return tar_is_dir(ov->view, path);
+}
+
+int tar_overlay_is_file(tar_overlay_t *ov, char *path) {
+    return tar_is_file(ov->view, path);
+}
+
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path) {
+    return tar_is_symlink(ov->view, path);
+}
+
+int tar_overlay_list(tar_overlay_t *ov, char *path, char **entries, size_t *no_entries) {
+    return tar_list(ov->view, path, entries, no_entries);
+}
+
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ov->view, TAR_OP_READ_FILE, path);
+    uint32_t id = tar_find_file(ov->view, path);
+    ssize_t ret = -1;
+    if (id != NO_ENTRY) {
+        const tar_archive_t *layer = ov->layers[ov->layer_of[id]];
+        ret = content_read(layer, ov->view->offsets[id], ov->view->sizes[id], offset, dest, len);
+    }
+    tar_stats_end(&scope);
+    return ret;
+}
+
+
+/* ------------------------------------------------------------------------- */
+/*                              Batched lookup                               */
+/* ------------------------------------------------------------------------- */
+
+#define LOOKUP_MAX ((size_t)1 << 30) // most paths of a batch, whose buckets hold the query index + 1 in 32 bits
+
+int tar_lookup_many(int tar_fd, char **paths, size_t n, tar_lookup_t *results) {
+    if (n > LOOKUP_MAX) { errno = EINVAL; return -1; }
+    uint32_t no_buckets = 64;
+    while (no_buckets < 2 * n) no_buckets *= 2;
+    uint32_t mask = no_buckets - 1;
+
+    uint32_t *buckets = calloc(no_buckets, sizeof(uint32_t)); // query index + 1, zero for an empty bucket
+    uint32_t *hashes = malloc((n ? n : 1) * sizeof(uint32_t));
+    size_t *first = malloc((n ? n : 1) * sizeof(size_t));     // first query asking for the same path
+    tar_iter_t *it = tar_iter_open(tar_fd, 0);
+    int ret = -1;
+    if (buckets == NULL || hashes == NULL || first == NULL || it == NULL) goto out;
+
+    for (size_t q = 0; q < n; q++) {
+        memset(&results[q], 0, sizeof(tar_lookup_t));
+        hashes[q] = path_hash(paths[q], strlen(paths[q]));
+        first[q] = q;
 
-        // Check end
-        char check_end[2*sizeof(tar_header_t)];
-        if(read(tar_fd, check_end, 2*sizeof(tar_header_t)) != 2*sizeof(tar_header_t)) return -1; // read error
+        uint32_t i = hashes[q] & mask;
+        for (; buckets[i] != 0; i = (i + 1) & mask) {
+            size_t other = buckets[i] - 1;
+            if (hashes[other] == hashes[q] && strcmp(paths[other], paths[q]) == 0) break;
+        }
+        if (buckets[i] != 0) first[q] = buckets[i] - 1;
+        else buckets[i] = q + 1;
+    }
+
+    // one pass over the archive, a later entry shadowing an earlier one with the same path
+    const tar_header_t *header;
+    char *long_path = NULL, *long_link = NULL;
+    char joined[PATH_JOINED_MAX];
+    int r;
+    while ((r = tar_iter_next(it, &header)) == 1) {
+        if (is_extended(header->typeflag)) {
+            size_t size = TAR_INT(header->size);
+            uint8_t *content = size <= EXTENDED_MAX ? malloc(size ? size : 1) : NULL;
+            if (content != NULL && tar_iter_read(it, content, size) == size) {
+                extended_parse(header, content, size, &long_path, &long_link);
+            }
+            free(content);
+            continue;
+        }
+
+        size_t len;
+        const char *path = header_path(header, long_path, joined, &len);
+        uint32_t hash = path_hash(path, len);
+
+        for (uint32_t i = hash & mask; buckets[i] != 0; i = (i + 1) & mask) {
+            size_t q = buckets[i] - 1;
+            if (hashes[q] != hash || strncmp(paths[q], path, len) != 0 || paths[q][len] != '\0') continue;
 
-        int stop = 0;
-        for (int i = 0; i < 2*sizeof(tar_header_t); ++i) {
-            stop += check_end[i];
+            results[q].found = 1;
+            results[q].typeflag = header->typeflag;
+            results[q].size = TAR_INT(header->size);
+            results[q].offset = tar_iter_offset(it);
+            break;
         }
 
-        lseek(tar_fd, -2*sizeof(tar_header_t), SEEK_CUR);
-        if(stop == 0) break;
+        free(long_path);
+        free(long_link);
+        long_path = long_link = NULL;
     }
+    free(long_path);
+    free(long_link);
+    if (r < 0) goto out;
 
-    return counter;
+    ret = 0;
+    for (size_t q = 0; q < n; q++) {
+        if (first[q] != q) results[q] = results[first[q]];
+        if (results[q].found) ret++;
+    }
+
+out:
+    tar_iter_close(it);
+    free(buckets);
+    free(hashes);
+    free(first);
+    return ret;
 }
 
 /**
@@ -72,15 +2831,12 @@ int check_archive(int tar_fd) {
  *         any other value otherwise.
  */
 int exists(int tar_fd, char *path) {
-    tar_header_t* buffer = malloc(sizeof(tar_header_t));
-    lseek(tar_fd, 0, SEEK_SET); 
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return 0;
 
-    while (read(tar_fd, buffer, sizeof(tar_header_t)) > 0) {
-        if(strcmp(path, buffer->name) == 0) { free(buffer); return 1; } // File exists
-    }
-     
-    free(buffer);
-    return 0;
+    int ret = tar_exists(ar, path);
+    tar_close(ar);
+    return ret;
 }
 
 /**
@@ -93,18 +2849,14 @@ int exists(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_dir(int tar_fd, char *path) {
-    tar_header_t* buffer = malloc(sizeof(tar_header_t));
-    lseek(tar_fd, 0, SEEK_SET); 
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return 0;
 
-    while (read(tar_fd, buffer, sizeof(tar_header_t)) > 0) {
-        if(strcmp(path, buffer->name) == 0 && buffer->typeflag == DIRTYPE) { free(buffer); return 1; } 
-    }
-     
-    free(buffer);
-    return 0;
+    int ret = tar_is_dir(ar, path);
+    tar_close(ar);
+    return ret;
 }
 
-
 /**
  * Checks whether an entry exists in the archive and is a file.
  *
@@ -115,15 +2867,12 @@ int is_dir(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_file(int tar_fd, char *path) {
-    tar_header_t* buffer = malloc(sizeof(tar_header_t));
-    lseek(tar_fd, 0, SEEK_SET); 
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return 0;
 
-    while (read(tar_fd, buffer, sizeof(tar_header_t)) > 0) {
-        if(strcmp(path, buffer->name) == 0 && buffer->typeflag == REGTYPE) { free(buffer); return 1; } 
-    }
-     
-    free(buffer);
-    return 0;
+    int ret = tar_is_file(ar, path);
+    tar_close(ar);
+    return ret;
 }
 
 /**
@@ -135,18 +2884,14 @@ int is_file(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int is_symlink(int tar_fd, char *path) {
-    tar_header_t* buffer = malloc(sizeof(tar_header_t));
-    lseek(tar_fd, 0, SEEK_SET); 
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return 0;
 
-    while (read(tar_fd, buffer, sizeof(tar_header_t)) > 0) {
-        if(strcmp(path, buffer->name) == 0 && buffer->typeflag == SYMTYPE) { free(buffer); return 1; } 
-    }
-     
-    free(buffer);
-    return 0;
+    int ret = tar_is_symlink(ar, path);
+    tar_close(ar);
+    return ret;
 }
 
-
 /**
  * Lists the entries at a given path in the archive.
  * list() does not recurse into the directories listed at the given path.
@@ -170,135 +2915,12 @@ int is_symlink(int tar_fd, char *path) {
  *         any other value otherwise.
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    lseek(tar_fd, 0, SEEK_SET);
-    char buffer[sizeof(tar_header_t)];
-    long skip = 0;
-    int initBack = 0;
-    int c = -1;
-    
-    while (1) {
-        if(read(tar_fd, buffer, sizeof(tar_header_t)) < 0) return -1; // read error
-        
-        tar_header_t* tar_header = (tar_header_t*)buffer;
-
-        char* name = tar_header->name;
-        if(tar_header->typeflag == SYMTYPE) strcat(name, "/"); 
-
-        if(strncmp(name, path, strlen(path)) == 0) {
-            if(tar_header->typeflag == SYMTYPE && c == -1) return list(tar_fd, tar_header->linkname, entries, no_entries);
-
-            int lastBack = 0;
-            for (int i = 0; i < strlen(tar_header->name); ++i) {
-                if(tar_header->name[i] == '/') lastBack = i;
-            }
-
-            if (c == -1) {
-                initBack = lastBack;
-                c++;
-            } else {
-                if (c < *no_entries && (lastBack <= initBack || tar_header->name[lastBack + 1] == '\0')) {
-                    memcpy(entries[c], name, strlen(name));
-                    c++;
-                }
-            }
-        }
-
-        skip += (TAR_INT(tar_header->size) + sizeof(tar_header_t) - 1) / sizeof(tar_header_t) + 1;
-        lseek(tar_fd, skip * sizeof(tar_header_t), SEEK_SET);
-
-        // Check for the end of the file
-        char check_end[2 * sizeof(tar_header_t)];
-        if (read(tar_fd, check_end, 2 * sizeof(tar_header_t)) != 2 * sizeof(tar_header_t)) return -1; // read error
-
-        int stop = 0;
-        for (int i = 0; i < 2 * sizeof(tar_header_t); ++i) {
-            stop += check_end[i];
-        }
-
-        lseek(tar_fd, -2 * sizeof(tar_header_t), SEEK_CUR);
-        if(stop == 0) break;
-    }
-    *no_entries = (c == -1) ? 0 : c;
-    
-    return *no_entries;
-}
-
-void resolve_symlink(int tar_fd, tar_header_t* buffer, char* resolved_path, char **entries, size_t *no_entries, size_t max_no_entries) {
-    tar_header_t* linked_entry = malloc(sizeof(tar_header_t));
-    int counter = 0;
-    
-    lseek(tar_fd, 0, SEEK_SET);
-
-    ssize_t len = readlink(buffer->name, resolved_path, sizeof(resolved_path) - 1);
-    resolved_path[len] = '\0';
-    strcat(resolved_path, "/");
-
-    while (read(tar_fd, linked_entry, sizeof(tar_header_t)) > 0) {
-        if (strncmp(resolved_path, linked_entry->name, strlen(resolved_path)) == 0) {
-            if (strcmp(resolved_path, linked_entry->name) != 0){
-                if(counter < max_no_entries) { //max 10 entréés => counter va de 0 à 9 
-                    entries[counter] = malloc(strlen(linked_entry->name) + 1);
-                    strcpy(entries[counter], linked_entry->name);
-                    counter++;
-                }
-		        *no_entries += 1;
-	        } else if(linked_entry->typeflag != DIRTYPE){
-                //vérifier, si l'entrée est la directory elle-même, que c'est bien une directory
-                free(linked_entry);
-                printf("not a directory.\n");
-                return;
-            }
-            continue;
-            
-        }
-
-        lseek(tar_fd, ((TAR_INT(linked_entry->size) / sizeof(tar_header_t)) + 1) * sizeof(tar_header_t), SEEK_CUR);
-   }
-   free(linked_entry);
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) { *no_entries = 0; return 0; }
 
-}
-
-int liste(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    tar_header_t* buffer= malloc(sizeof(tar_header_t));
-    int counter = 0;
-    size_t max_no_entries = *no_entries;
-    *no_entries = 0;
-    lseek(tar_fd, 0, SEEK_SET);
-
-
-    while(read(tar_fd, buffer, sizeof(tar_header_t)) > 0){
-        tar_header_t* tar_header = (tar_header_t*) buffer;
-        size_t length = strlen(path);
-
-        if(buffer->typeflag == SYMTYPE) {
-            char resolved_path[30];
-            resolve_symlink(tar_fd, buffer, resolved_path, entries, no_entries, max_no_entries);
-            return (*no_entries > 0) ? 1 : 0;
-        } else if(strncmp(path, buffer->name, length) == 0) {
-            // vérifier que l'entrée n'est pas la directory elle même
-            if (strcmp(path, buffer->name) != 0){
-                if(counter < max_no_entries) { //max 10 entréés => counter va de 0 à 9 
-                    entries[counter] = malloc(strlen(buffer->name) + 1);
-                    strcpy(entries[counter], buffer->name);
-                    counter++;
-                }
-		        *no_entries += 1;
-	        }
-            else if(buffer->typeflag != DIRTYPE){
-                //vérifier, si l'entrée est la directory elle-même, que c'est bien une directory
-                    free(buffer);
-                    printf("not a directory.\n");
-                	return 0;
-            }
-            continue;
-            
-        }
-
-        lseek(tar_fd, ((TAR_INT(tar_header->size) / sizeof(tar_header_t)) + 1) * sizeof(tar_header_t), SEEK_CUR); // Skip to the next header block
-    }
-    
-    free(buffer);
-    return (*no_entries > 0) ? 1 : 0;
+    int ret = tar_list(ar, path, entries, no_entries);
+    tar_close(ar);
+    return ret;
 }
 
 /**
@@ -320,49 +2942,28 @@ int liste(int tar_fd, char *path, char **entries, size_t *no_entries) {
  *
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
-    lseek(tar_fd,0,SEEK_SET);
-    char buffer[sizeof(tar_header_t)];
-
-    while(1){
-        if(read(tar_fd,buffer,sizeof(tar_header_t)) < 0) return -1; // read error
-
-        tar_header_t* tar_header = (tar_header_t*) buffer;
-
-        if(strncmp(tar_header->name,path, strlen(path)) == 0){
-            if(tar_header->typeflag == DIRTYPE) return -1;
-            
-            if(tar_header->typeflag == SYMTYPE){
-                return read_file(tar_fd,tar_header->linkname,offset,dest,len); // recurrsif call for the symlink
-            } else {
-
-                if(!(tar_header->typeflag == REGTYPE || tar_header->typeflag == AREGTYPE)) return -1;
-
-                ssize_t size = TAR_INT(tar_header->size);
-                if(offset > size) return -2;
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return -1;
 
-                lseek(tar_fd, offset, SEEK_CUR);
-
-                if((size - offset) < *len) *len = size - offset;
-
-                if(read(tar_fd, dest, *len) < 0) return -1; // read error
-
-                return (size - offset) - *len;
-            }
-        }
-
-        lseek(tar_fd,(TAR_INT(tar_header->size) + sizeof(tar_header_t) - 1) / sizeof(tar_header_t)*sizeof(tar_header_t),SEEK_CUR);
-
-        // Check for the end of the file
-        char check_end[2 * sizeof(tar_header_t)];
-        if (read(tar_fd, check_end, 2 * sizeof(tar_header_t)) != 2 * sizeof(tar_header_t)) return -1; // read error
+    ssize_t ret = tar_read_file(ar, path, offset, dest, len);
+    tar_close(ar);
+    return ret;
+}
 
-        int stop = 0;
-        for (int i = 0; i < 2 * sizeof(tar_header_t); ++i) {
-            stop += check_end[i];
-        }
+/**
+ * Reads many files, or parts of files, of the archive at once.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param reqs The reads to do, see tar_read_files_batch().
+ * @param n The number of reads.
+ *
+ * @return zero if every request was answered, -1 on a read error.
+ */
+int read_files_batch(int tar_fd, tar_read_req_t *reqs, size_t n) {
+    tar_archive_t *ar = tar_open(tar_fd);
+    if (ar == NULL) return -1;
 
-        lseek(tar_fd, -2 * sizeof(tar_header_t), SEEK_CUR);
-        if(stop == 0) break;
-    }
-    return -1;
+    int ret = tar_read_files_batch(ar, reqs, n);
+    tar_close(ar);
+    return ret;
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 typedef struct posix_header
@@ -38,6 +39,13 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* PAX extended header of the next entry */
+#define XGLTYPE  'g'            /* PAX global extended header */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long path of the next entry */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long linkname of the next entry */
+
+/* Size of each buffer given to list(), the terminating null included. Longer paths are truncated to fit. */
+#define TAR_ENTRY_MAX 4096
 
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
@@ -59,6 +67,25 @@ typedef struct posix_header
  */
 int check_archive(int tar_fd);
 
+/* Values used in the flags of check_archive_parallel().  */
+#define TAR_CHECK_DIGEST 0x1    /* also compute a CRC32C digest of the content of every entry */
+
+/**
+ * Checks whether the archive is valid, like check_archive(), using several threads.
+ *
+ * The offsets of the headers are found first, then the headers are validated by a pool of threads reading them with
+ * pread(). With TAR_CHECK_DIGEST, the threads also compute the CRC32C of the content of every entry.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nthreads The number of threads to use, zero or less to use one per online CPU.
+ * @param flags A combination of the TAR_CHECK_* values.
+ * @param digests If not NULL and TAR_CHECK_DIGEST is set, set to an array holding the digest of every header, in
+ *                archive order, when the archive is valid. The caller frees it. Set to NULL otherwise.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nthreads, int flags, uint32_t **digests);
+
 /**
  * Checks whether an entry exists in the archive.
  *
@@ -118,7 +145,7 @@ int is_symlink(int tar_fd, char *path);
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param entries An array of char arrays of TAR_ENTRY_MAX bytes each, a longer path being truncated.
  * @param no_entries An in-out argument.
  *                   The caller set it to the number of entries in `entries`.
  *                   The callee set it to the number of entries listed.
@@ -148,4 +175,808 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * One read of read_files_batch().
+ */
+typedef struct tar_read_req {
+    char *path;                 /* the path of the file to read, resolved as for read_file() */
+    size_t offset;              /* the offset in the file from which to start reading */
+    uint8_t *dest;              /* the destination buffer */
+    size_t len;                 /* in-out: the size of dest, then the number of bytes written to it */
+    ssize_t ret;                /* out: the value read_file() would have returned */
+} tar_read_req_t;
+
+/**
+ * Reads many files, or parts of files, of the archive at once.
+ * Same as tar_read_files_batch() on a temporary handle.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param reqs The reads to do.
+ * @param n The number of reads.
+ *
+ * @return zero if every request was answered, -1 on a read error.
+ */
+int read_files_batch(int tar_fd, tar_read_req_t *reqs, size_t n);
+
+/**
+ * A single pass over an archive, see tar_iter_open().
+ */
+typedef struct tar_iter tar_iter_t;
+
+/**
+ * Starts a single pass over the entries of an archive.
+ *
+ * The archive is read sequentially from the current position of the descriptor through a large read-ahead buffer,
+ * so it can come from a pipe, a socket or stdin. The bodies the caller does not read are read and discarded, or
+ * skipped with lseek() when the descriptor is seekable.
+ *
+ * @param fd A file descriptor positioned at the start of a tar archive. It is not closed by tar_iter_close().
+ * @param buffer_size The size of the read-ahead buffer, zero for the default of 1 MiB.
+ *
+ * @return the iterator, or NULL if it could not be allocated.
+ */
+tar_iter_t *tar_iter_open(int fd, size_t buffer_size);
+
+/**
+ * Moves to the next entry of the archive.
+ *
+ * @param it An iterator.
+ * @param header Set to the header of the entry, valid until the next call.
+ *
+ * @return 1 if there is a next entry,
+ *         zero at the end of the archive,
+ *         -1 on a read error or an invalid header, neither a ustar nor a GNU tar header or with a bad checksum.
+ */
+int tar_iter_next(tar_iter_t *it, const tar_header_t **header);
+
+/**
+ * Reads the content of the current entry.
+ *
+ * @param it An iterator.
+ * @param buf A destination buffer.
+ * @param len The size of buf.
+ *
+ * @return the number of bytes read, zero once the whole content was read, or -1 on a read error.
+ */
+ssize_t tar_iter_read(tar_iter_t *it, void *buf, size_t len);
+
+/**
+ * Gives the offset in the stream of the content of the current entry.
+ */
+uint64_t tar_iter_offset(const tar_iter_t *it);
+
+/**
+ * Releases an iterator.
+ *
+ * @param it An iterator returned by tar_iter_open(), or NULL.
+ */
+void tar_iter_close(tar_iter_t *it);
+
+/**
+ * The answer of tar_lookup_many() for one path.
+ */
+typedef struct tar_lookup {
+    int found;                  /* non-zero if an entry exists at the path */
+    char typeflag;              /* the typeflag of the entry */
+    size_t size;                /* the size of the content of the entry */
+    uint64_t offset;            /* the offset of the content of the entry from the start of the archive */
+} tar_lookup_t;
+
+/**
+ * Looks many paths up in a single pass over an archive, without building an index.
+ *
+ * The paths are put in a hash table, then the archive is read once with a tar_iter_t, so it may come from a pipe.
+ * When a path appears several times in the archive, its last occurrence is reported.
+ *
+ * @param tar_fd A file descriptor positioned at the start of a valid tar archive.
+ * @param paths The paths to look up.
+ * @param n The number of paths, at most 2^30.
+ * @param results An array of n results, the answer for paths[i] being set in results[i].
+ *
+ * @return the number of paths found in the archive, or -1 on a read error, an invalid header or if there are too many
+ *         paths.
+ */
+int tar_lookup_many(int tar_fd, char **paths, size_t n, tar_lookup_t *results);
+
+/**
+ * An opened archive.
+ * The headers are walked once by tar_open() and every entry is kept in an in-memory index,
+ * so the tar_* queries below never rescan the archive.
+ * The archive is only read with pread(), never moving the file offset of the descriptor: once opened, a handle can
+ * be queried by several threads at the same time without any locking.
+ */
+typedef struct tar_archive tar_archive_t;
+
+/**
+ * A position in the listing of a directory, see tar_list_begin().
+ * Its fields are private to the library.
+ */
+typedef struct tar_cursor {
+    const tar_archive_t *ar;
+    uint32_t next;
+} tar_cursor_t;
+
+/**
+ * Opens an archive and indexes all of its entries.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ *               The descriptor is borrowed: it must stay open until tar_close() and is not closed by it.
+ *
+ * @return the archive handle, or NULL if the index could not be built.
+ */
+tar_archive_t *tar_open(int tar_fd);
+
+/* Values used in the flags of tar_open_flags().  */
+#define TAR_OPEN_MMAP         0x1   /* map the archive in memory instead of reading it with read() */
+#define TAR_ADVISE_SEQUENTIAL 0x2   /* the mapping will mostly be read sequentially */
+#define TAR_ADVISE_RANDOM     0x4   /* the mapping will mostly be read at random places */
+
+/**
+ * Opens an archive like tar_open(), with some options.
+ *
+ * With TAR_OPEN_MMAP, the whole archive is mapped read-only, the index is built from the mapping and the files are
+ * read from it without any system call. If the descriptor cannot be mapped (a pipe, an empty file, ...), the handle
+ * silently falls back to read().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, borrowed as for tar_open().
+ * @param flags A combination of the TAR_OPEN_* and TAR_ADVISE_* values.
+ *
+ * @return the archive handle, or NULL if the index could not be built.
+ */
+tar_archive_t *tar_open_flags(int tar_fd, int flags);
+
+/**
+ * Builds the index of an archive and saves it to a sidecar index file (e.g. "archive.tar.idx").
+ *
+ * The index file holds the entries sorted by path with their offsets, sizes and types, and records the size, the
+ * modification time and a checksum of the header chain of the archive it describes.
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file.
+ * @param index_path The path of the index file, replaced atomically if it already exists.
+ *
+ * @return zero on success, -1 if the archive could not be indexed or the index file could not be written.
+ */
+int tar_index_build(int tar_fd, const char *index_path);
+
+/**
+ * Opens an archive from its sidecar index file.
+ *
+ * The index file is mapped and used in place, so opening costs a few page faults instead of a scan of the archive.
+ * If the index file is missing or no longer matches the archive, it is rebuilt with tar_index_build(); if that
+ * fails too, the archive is indexed in memory as with tar_open_flags().
+ *
+ * @param tar_fd A file descriptor pointing to a valid tar archive file, borrowed as for tar_open().
+ * @param index_path The path of the index file.
+ * @param flags The same flags as for tar_open_flags().
+ *
+ * @return the archive handle, or NULL if the archive could not be indexed.
+ */
+tar_archive_t *tar_index_open(int tar_fd, const char *index_path, int flags);
+
+/**
+ * Publishes the index of an archive handle in a shared memory segment, for other processes of the host to attach
+ * to it with tar_index_attach() instead of indexing the archive again.
+ *
+ * The segment is a sealed memfd holding the index in the index file layout, which only holds offsets and is used in
+ * place once mapped: every process attached shares the same pages, so an extra process costs next to no memory. The
+ * descriptor is inherited by the children forked afterwards, or can be passed to other processes over a Unix domain
+ * socket. It is close-on-exec.
+ *
+ * @param ar An archive handle, not of a gzip-compressed archive.
+ *
+ * @return the file descriptor of the segment, to be closed by the caller, or -1 if it could not be created.
+ */
+int tar_index_publish(tar_archive_t *ar);
+
+/**
+ * Opens an archive from an index published by tar_index_publish(), mapping it read-only without any rebuild.
+ *
+ * @param tar_fd A file descriptor pointing to the archive the index was published for, borrowed as for tar_open().
+ * @param index_fd The file descriptor of the segment, which may be closed once this returns.
+ * @param flags The same flags as for tar_open_flags().
+ *
+ * @return the archive handle, or NULL if the segment is not sealed against writes and resizes, is not a consistent
+ *         index or does not match the archive, which was modified since for instance.
+ */
+tar_archive_t *tar_index_attach(int tar_fd, int index_fd, int flags);
+
+#define TAR_GZ_SPAN (1 << 20)   /* default distance between two checkpoints of a gzip-compressed archive */
+
+/**
+ * Opens a gzip-compressed archive (e.g. "archive.tar.gz") for random access.
+ *
+ * The archive is decompressed once to index it. Along the way, a checkpoint holding the last 32 KiB of output is
+ * taken about every span bytes, so that any read afterwards only decompresses from the checkpoint before it instead
+ * of from the start of the archive: a larger span saves memory, a smaller one makes reads faster. The checkpoint
+ * windows are kept compressed, a few KiB each. The handle then works like any other, the offsets being those of
+ * the decompressed archive. Only the first gzip member is read.
+ *
+ * @param gz_fd A file descriptor pointing to a gzip-compressed tar archive, borrowed as for tar_open().
+ * @param span The distance between two checkpoints in decompressed bytes, zero for TAR_GZ_SPAN.
+ *
+ * @return the archive handle, or NULL if the file is not a valid gzip stream or the index could not be built.
+ */
+tar_archive_t *tar_open_gz(int gz_fd, size_t span);
+
+/**
+ * Builds the checkpoints and the index of a gzip-compressed archive and saves them to an index file
+ * (e.g. "archive.tar.gz.idx"), replaced atomically if it already exists.
+ *
+ * @param gz_fd A file descriptor pointing to a gzip-compressed tar archive.
+ * @param index_path The path of the index file.
+ * @param span The distance between two checkpoints, as for tar_open_gz().
+ *
+ * @return zero on success, -1 if the archive could not be indexed or the index file could not be written.
+ */
+int tar_gz_index_build(int gz_fd, const char *index_path, size_t span);
+
+/**
+ * Opens a gzip-compressed archive from its index file, without decompressing the whole archive.
+ * If the index file is missing or no longer matches the archive, it is rebuilt as with tar_index_open().
+ *
+ * @param gz_fd A file descriptor pointing to a gzip-compressed tar archive, borrowed as for tar_open().
+ * @param index_path The path of the index file.
+ * @param span The distance between two checkpoints if the index has to be rebuilt.
+ *
+ * @return the archive handle, or NULL if the archive could not be indexed.
+ */
+tar_archive_t *tar_gz_index_open(int gz_fd, const char *index_path, size_t span);
+
+/**
+ * Releases an archive handle and its index.
+ *
+ * @param ar An archive handle returned by tar_open(), or NULL.
+ */
+void tar_close(tar_archive_t *ar);
+
+/**
+ * Indexes the entries appended to the archive since it was indexed, scanning only the headers after the last one
+ * indexed, so that the cost depends on what was appended and not on the size of the archive.
+ *
+ * A new entry shadows an older one with the same path, as when the archive is indexed from the start, and is listed
+ * before its older siblings. The links are only resolved again when a link was appended or replaced, or when one
+ * could not be resolved for sure. The scan stops at a header with a wrong checksum or whose data is not entirely
+ * written yet, which the next refresh picks up. The paths, targets and views handed out before stay valid until
+ * tar_close(). An index file the handle was opened from is not rewritten.
+ *
+ * Must not be called while another thread uses the handle.
+ *
+ * @param ar An archive handle, not of a gzip-compressed archive.
+ *
+ * @return the number of entries indexed, zero if nothing was appended,
+ *         -1 if the archive is gzip-compressed, was truncated, or the index could not grow.
+ */
+int tar_refresh(tar_archive_t *ar);
+
+/**
+ * Same as exists(), answered from the index of the archive handle.
+ */
+int tar_exists(tar_archive_t *ar, char *path);
+
+/**
+ * Same as is_dir(), answered from the index of the archive handle.
+ */
+int tar_is_dir(tar_archive_t *ar, char *path);
+
+/**
+ * Same as is_file(), answered from the index of the archive handle. A hard link to a file is a file too.
+ */
+int tar_is_file(tar_archive_t *ar, char *path);
+
+/**
+ * Same as is_symlink(), answered from the index of the archive handle.
+ */
+int tar_is_symlink(tar_archive_t *ar, char *path);
+
+/**
+ * Follows the symlinks and hard links at a given path, as the reads and the listings do.
+ *
+ * The links are resolved once when the archive is indexed: a symlink is relative to its directory, "." and ".."
+ * components are normalized and a chain of links is collapsed to the entry it ends at, so that this is a single
+ * lookup.
+ *
+ * @param ar An archive handle.
+ * @param path A path to an entry in the archive.
+ * @param target Set to the path of the entry the links lead to, the path of the entry itself if it is not a link.
+ *               Valid until tar_close().
+ *
+ * @return zero on success,
+ *         -1 if no entry exists at the given path or a link is dangling,
+ *         -2 if the links loop.
+ */
+int tar_resolve(tar_archive_t *ar, char *path, const char **target);
+
+/**
+ * Describes the entry at a given path, following the symlinks and hard links like stat(2).
+ *
+ * @param ar An archive handle.
+ * @param path A path to an entry in the archive.
+ * @param st Set to the entry the links lead to, st->found being zero if there is none. For a gzip-compressed
+ *           archive, st->offset is an offset in the decompressed archive.
+ *
+ * @return st->found.
+ */
+int tar_stat(tar_archive_t *ar, char *path, tar_lookup_t *st);
+
+/**
+ * Same as list(), answered from the index of the archive handle.
+ */
+int tar_list(tar_archive_t *ar, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Starts listing the entries of a directory, one page at a time.
+ *
+ * The entries are taken from the directory tree of the index, which also holds the parent directories implied by
+ * the paths of the archive but missing from it, so each entry costs constant time however big the archive is.
+ *
+ * @param ar An archive handle.
+ * @param path A path to a directory in the archive, or the empty path for its root. If the entry is a symlink, it is
+ *             resolved to its linked-to entry.
+ * @param cursor Set to the position of the first entry of the directory.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list_begin(tar_archive_t *ar, char *path, tar_cursor_t *cursor);
+
+/**
+ * Gives the next entry of a directory listing and moves the cursor past it.
+ *
+ * @param cursor A cursor set by tar_list_begin().
+ *
+ * @return the path of the entry, valid until tar_close(), or NULL once every entry was listed.
+ */
+const char *tar_list_next(tar_cursor_t *cursor);
+
+/**
+ * Called by tar_list_recursive() for every entry matched.
+ *
+ * @return zero to go on, any other value to stop the listing.
+ */
+typedef int (*tar_list_cb)(void *ctx, const char *path);
+
+/**
+ * Lists every entry whose path starts with a given prefix, at any depth, in path order.
+ *
+ * The entries are found by a binary search in the paths of the index sorted, so a listing only visits the entries
+ * under the prefix, however big the archive is. Like tar_list(), it includes the parent directories implied by the
+ * paths of the archive. The prefix is taken as is: "usr/lib/" matches "usr/lib/" itself and everything below it,
+ * "usr/lib" also matches "usr/libexec/", and symlinks are not followed.
+ *
+ * @param ar An archive handle.
+ * @param prefix The prefix of the paths listed, the empty string for the whole archive.
+ * @param glob A pattern the paths must also match, or NULL for all of them. It is matched against the whole path
+ *             with fnmatch(3), a '*' matching '/' too: "*.so" matches every path ending in ".so".
+ * @param callback Called with the path of every entry matched, valid until tar_close().
+ * @param ctx Passed to the callback.
+ *
+ * @return the number of entries handed to the callback.
+ */
+int tar_list_recursive(tar_archive_t *ar, const char *prefix, const char *glob, tar_list_cb callback, void *ctx);
+
+/**
+ * Same as read_file(), the entry being located through the index of the archive handle.
+ */
+ssize_t tar_read_file(tar_archive_t *ar, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Reads many files, or parts of files, of the archive at once.
+ *
+ * Every request is resolved through the index, then the ranges to read are sorted by offset in the archive and the
+ * ranges close to each other are merged into a single preadv(), scattering the bytes into the destination buffers.
+ * Reading many small files thus costs a few large sequential reads.
+ *
+ * @param ar An archive handle.
+ * @param reqs The reads to do. The len and ret fields of each request are set as read_file() sets len and returns.
+ * @param n The number of reads.
+ *
+ * @return zero if every request was answered, -1 on a read error.
+ */
+int tar_read_files_batch(tar_archive_t *ar, tar_read_req_t *reqs, size_t n);
+
+/**
+ * Called when an asynchronous read completes.
+ *
+ * @param ctx The context given to tar_read_async().
+ * @param ret The value read_file() would have returned.
+ * @param len The number of bytes written to the destination buffer.
+ */
+typedef void (*tar_read_cb)(void *ctx, ssize_t ret, size_t len);
+
+/* Values used in the flags of tar_async_setup().  */
+#define TAR_ASYNC_THREADS 0x1   /* use the thread pool even if io_uring is available */
+
+/**
+ * Sets the asynchronous read engine of an archive handle up.
+ *
+ * The reads go to an io_uring ring when the kernel supports it, or to a pool of threads doing pread() otherwise.
+ * Calling it is optional: the first tar_read_async() sets a default engine up.
+ *
+ * @param ar An archive handle.
+ * @param queue_depth The number of reads in flight in the ring, zero for the default.
+ * @param nthreads The number of threads of the pool, zero or less for the default.
+ * @param flags A combination of the TAR_ASYNC_* values.
+ *
+ * @return zero on success, -1 if the engine could not be set up or already was.
+ */
+int tar_async_setup(tar_archive_t *ar, unsigned queue_depth, int nthreads, int flags);
+
+/**
+ * Queues the read of a file of the archive, like tar_read_file(), and returns without waiting for it.
+ * The path is resolved before returning; the read itself completes later and its callback is called from
+ * tar_async_poll(). Any number of reads may be queued.
+ *
+ * @param ar An archive handle.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it is resolved to its
+ *             linked-to entry.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer, which must stay valid until the callback is called.
+ * @param len The size of dest.
+ * @param callback Called with ctx once the read completes.
+ * @param ctx Passed to the callback.
+ *
+ * @return zero if the read was queued, -1 otherwise.
+ */
+int tar_read_async(tar_archive_t *ar, char *path, size_t offset, uint8_t *dest, size_t len, tar_read_cb callback,
+                   void *ctx);
+
+/**
+ * Calls the callbacks of the completed asynchronous reads, in the calling thread.
+ *
+ * @param ar An archive handle.
+ * @param min_complete The number of completions to wait for, at most the number of reads queued and not completed.
+ *                     Zero never waits.
+ *
+ * @return the number of callbacks called.
+ */
+int tar_async_poll(tar_archive_t *ar, size_t min_complete);
+
+/**
+ * Gives a read-only view over the content of a file in the archive, without copying it.
+ *
+ * For a mapped archive the view points straight into the mapping. Otherwise the file is read once into a buffer
+ * owned by the handle. In both cases the view stays valid until tar_close().
+ *
+ * @param ar An archive handle.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param ptr Set to the start of the content of the file.
+ * @param len Set to the size of the file.
+ *
+ * @return zero on success,
+ *         -1 if no entry at the given path exists in the archive, the entry is not a file or it could not be read.
+ */
+int tar_view_file(tar_archive_t *ar, char *path, const uint8_t **ptr, size_t *len);
+
+/**
+ * A file of an archive opened for reading, see tar_entry_open(). An entry is not thread-safe, but several entries
+ * of the same handle can be read by different threads.
+ */
+typedef struct tar_entry tar_entry_t;
+
+/**
+ * Opens a file of the archive for chunked reads. The path is resolved once, following symlinks, and every read then
+ * goes straight to the content of the file.
+ *
+ * @param ar An archive handle, which must stay open until tar_entry_close().
+ * @param path A path to an entry in the archive. If the entry is a symlink, it is resolved to its linked-to entry.
+ *
+ * @return the entry, positioned at the start of the file, or NULL if no file exists at the given path.
+ */
+tar_entry_t *tar_entry_open(tar_archive_t *ar, const char *path);
+
+/**
+ * Sets the read-ahead of an entry. While the entry is read, the kernel is asked to fetch the window following every
+ * read in the background. For a gzip-compressed archive, whole windows are decompressed at once and the reads are
+ * served from the last one.
+ *
+ * @param e An entry.
+ * @param window The size of the read-ahead window, zero to disable it, which is the default.
+ *
+ * @return zero on success, -1 if the window could not be allocated.
+ */
+int tar_entry_readahead(tar_entry_t *e, size_t window);
+
+/**
+ * Reads from the current position of an entry and moves the position past the bytes read.
+ *
+ * @param e An entry.
+ * @param buf A destination buffer.
+ * @param len The size of buf.
+ *
+ * @return the number of bytes read, less than len only at the end of the file, zero at or past the end of the file,
+ *         or -1 on a read error.
+ */
+ssize_t tar_entry_read(tar_entry_t *e, void *buf, size_t len);
+
+/**
+ * Reads from a given offset of an entry, without moving its position.
+ *
+ * @return the same values as tar_entry_read().
+ */
+ssize_t tar_entry_pread(tar_entry_t *e, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Moves the position of an entry, as lseek() does. The position may go past the end of the file.
+ *
+ * @param e An entry.
+ * @param offset The offset, relative to whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @return the new position, or -1 if whence is invalid or the position would be negative.
+ */
+int64_t tar_entry_seek(tar_entry_t *e, int64_t offset, int whence);
+
+/**
+ * Gives the size of the file of an entry.
+ */
+uint64_t tar_entry_size(const tar_entry_t *e);
+
+/**
+ * Releases an entry.
+ *
+ * @param e An entry returned by tar_entry_open(), or NULL.
+ */
+void tar_entry_close(tar_entry_t *e);
+
+/**
+ * A merged view of stacked archives, as the layers of a container image: see tar_overlay_open().
+ */
+typedef struct tar_overlay tar_overlay_t;
+
+/**
+ * Merges stacked archives into a single index, so that a lookup is a single hash probe whatever the number of
+ * layers.
+ *
+ * An entry of an upper layer hides the entries of the lower layers at the same path, and a file or a link hides a
+ * directory of the lower layers with everything under it, and the reverse. As in OCI images, a ".wh.name" entry
+ * hides "name" and everything under it in the lower layers, and a ".wh..wh..opq" entry hides everything the lower
+ * layers have in its directory. The whiteouts themselves are not listed. The links are resolved over the merged
+ * paths, so a link may lead to an entry of another layer.
+ *
+ * @param layers The handles of the archives, the lowest layer first. They are borrowed and must stay open until
+ *               tar_overlay_close(). The array itself is copied.
+ * @param no_layers The number of layers.
+ *
+ * @return the merged view, or NULL if it could not be built.
+ */
+tar_overlay_t *tar_overlay_open(tar_archive_t **layers, size_t no_layers);
+
+/**
+ * Releases a merged view, but not its layers.
+ *
+ * @param ov A merged view returned by tar_overlay_open(), or NULL.
+ */
+void tar_overlay_close(tar_overlay_t *ov);
+
+/**
+ * Same as tar_exists(), answered from the merged view.
+ */
+int tar_overlay_exists(tar_overlay_t *ov, char *path);
+
+/**
+ * Same as tar_is_dir(), answered from the merged view.
+ */
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path);
+
+/**
+ * Same as tar_is_file(), answered from the merged view.
+ */
+int tar_overlay_is_file(tar_overlay_t *ov, char *path);
+
+/**
+ * Same as tar_is_symlink(), answered from the merged view.
+ */
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path);
+
+/**
+ * Same as tar_list(), answered from the merged view. The entries of the upper layers are listed first.
+ */
+int tar_overlay_list(tar_overlay_t *ov, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as tar_read_file(), the file being read from the layer it is visible from.
+ */
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Extracts the whole archive into a directory, using several threads.
+ *
+ * The directories are created first, then the regular files are written by a pool of threads, the kernel copying
+ * their content straight from the archive with copy_file_range() when it can. The symlinks and hard links are
+ * created last. Entries with an absolute path or a ".." component are skipped. Existing files are replaced.
+ *
+ * @param ar An archive handle.
+ * @param dest_dir The directory to extract to, created if it does not exist.
+ * @param nthreads The number of threads writing files, zero or less to use one per online CPU.
+ *
+ * @return zero on success, -1 if an entry could not be extracted.
+ */
+int tar_extract(tar_archive_t *ar, const char *dest_dir, int nthreads);
+
+/* Values used in the flags of tar_search().  */
+#define TAR_SEARCH_ICASE 0x1    /* match the ASCII letters of the pattern whatever their case */
+
+/**
+ * Called by tar_search() for every match, never by two threads at the same time.
+ *
+ * @param ctx The context given to tar_search().
+ * @param path The path of the file holding the match, valid until tar_close().
+ * @param offset The offset of the match in the file.
+ *
+ * @return zero to go on, any other value to stop the search.
+ */
+typedef int (*tar_search_cb)(void *ctx, const char *path, uint64_t offset);
+
+/**
+ * Searches the content of every regular file of the archive for a string, using several threads.
+ *
+ * The files are cut into chunks of a few megabytes which the threads scan in turn, in place if the archive is mapped
+ * and read at once otherwise, so that the search scales with the cores on large archives. The matches are reported
+ * as they are found, in no particular order, overlapping matches included. A hard link is not searched apart from
+ * the file it names.
+ *
+ * @param ar An archive handle.
+ * @param pattern The string to find, not empty.
+ * @param flags Zero or TAR_SEARCH_ICASE.
+ * @param nthreads The number of threads scanning files, zero or less to use one per online CPU.
+ * @param callback Called for every match.
+ * @param ctx Passed to the callback.
+ *
+ * @return the number of matches reported, or -1 if the pattern is empty or a file could not be read.
+ */
+int tar_search(tar_archive_t *ar, const char *pattern, int flags, int nthreads, tar_search_cb callback, void *ctx);
+
+/**
+ * The operations counted by the statistics of an archive handle.
+ */
+enum tar_op {
+    TAR_OP_OPEN,                /* tar_open() and the other functions returning a handle */
+    TAR_OP_REFRESH,
+    TAR_OP_EXISTS,
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_STAT,
+    TAR_OP_LIST,                /* tar_list(), tar_list_begin() and tar_list_recursive() */
+    TAR_OP_READ_FILE,
+    TAR_OP_READ_BATCH,
+    TAR_OP_READ_ASYNC,          /* tar_read_async(), the reads themselves being counted as they complete */
+    TAR_OP_VIEW_FILE,
+    TAR_OP_ENTRY_OPEN,
+    TAR_OP_ENTRY_READ,          /* tar_entry_read() and tar_entry_pread() */
+    TAR_OP_EXTRACT,
+    TAR_OP_SEARCH,
+    TAR_NO_OPS
+};
+
+/**
+ * The counters of one operation.
+ */
+typedef struct tar_op_stats {
+    uint64_t calls;
+    uint64_t syscalls;          /* pread(), preadv() and copy_file_range() calls, and reads completed by io_uring */
+    uint64_t bytes_read;        /* bytes read from the archive file, compressed for a gzip-compressed archive */
+    uint64_t seeks;             /* reads not starting where the previous read of the same thread ended */
+    uint64_t headers;           /* archive headers visited */
+    uint64_t cache_hits;        /* reads served from memory: the mapping, a view or a sidecar index */
+    uint64_t nanoseconds;       /* time spent in the calls, summed over all the threads */
+} tar_op_stats_t;
+
+/**
+ * The statistics of an archive handle, indexed by enum tar_op.
+ */
+typedef struct tar_stats {
+    tar_op_stats_t ops[TAR_NO_OPS];
+} tar_stats_t;
+
+/**
+ * Gives the name of an operation, e.g. "read_file".
+ */
+const char *tar_op_name(int op);
+
+/**
+ * Reads the statistics of an archive handle since it was opened or last reset.
+ *
+ * The counters are always on. Every thread counts in its own slot of the handle and the slots are only summed here,
+ * so a query costs two clock reads and a few uncontended atomic additions. Calls still in progress are not counted.
+ *
+ * @param ar An archive handle.
+ * @param stats Set to the statistics.
+ */
+void tar_stats_get(const tar_archive_t *ar, tar_stats_t *stats);
+
+/**
+ * Sets every counter of an archive handle back to zero.
+ */
+void tar_stats_reset(tar_archive_t *ar);
+
+/**
+ * Called when an operation starts, see tar_stats_trace().
+ *
+ * @param ctx The context given to tar_stats_trace().
+ * @param op The operation, an enum tar_op value.
+ * @param path The path given to the call, or NULL.
+ */
+typedef void (*tar_trace_begin_cb)(void *ctx, int op, const char *path);
+
+/**
+ * Called when an operation ends, see tar_stats_trace().
+ *
+ * @param call The counters of this call alone.
+ */
+typedef void (*tar_trace_end_cb)(void *ctx, int op, const char *path, const tar_op_stats_t *call);
+
+/**
+ * Sets hooks called at the beginning and at the end of every operation on an archive handle, in the calling thread.
+ * The hooks must be set before the handle is shared with other threads.
+ *
+ * @param ar An archive handle.
+ * @param begin Called when an operation starts, or NULL.
+ * @param end Called when an operation ends, or NULL.
+ * @param ctx Passed to the hooks.
+ */
+void tar_stats_trace(tar_archive_t *ar, tar_trace_begin_cb begin, tar_trace_end_cb end, void *ctx);
+
+/**
+ * An archive being written. A writer is not thread-safe.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * Starts writing an archive.
+ *
+ * Headers, padding and small files are gathered in a buffer written at once, larger files are copied by the kernel
+ * straight from their file to the archive. Every header is a ustar header accepted by check_archive().
+ *
+ * @param out_fd A file descriptor open for writing, where the archive is written from its current offset. It may be
+ *               a pipe or a socket. It is borrowed: tar_writer_close() does not close it.
+ *
+ * @return the writer, or NULL if memory ran out.
+ */
+tar_writer_t *tar_writer_open(int out_fd);
+
+/**
+ * Adds a file of the file system to the archive, with its mode, owner and modification time. A directory is added
+ * as a directory entry only, without its content, and a symlink as a symlink entry.
+ *
+ * @param w A writer.
+ * @param name The path of the entry in the archive. Paths longer than 100 bytes are split between the prefix and
+ *             the name fields of the header, up to 255 bytes.
+ * @param path The path of the file to add.
+ *
+ * @return zero on success, -1 if the file could not be read, the name does not fit in a header or the archive
+ *         could not be written. After a write error, every call fails.
+ */
+int tar_writer_add_file(tar_writer_t *w, const char *name, const char *path);
+
+/**
+ * Adds a regular file with the given content to the archive, owned by the current user and modified now.
+ *
+ * @return the same values as tar_writer_add_file().
+ */
+int tar_writer_add_data(tar_writer_t *w, const char *name, const void *data, size_t len, mode_t mode);
+
+/**
+ * Adds a directory entry to the archive. A trailing slash is added to the name if it has none.
+ *
+ * @return the same values as tar_writer_add_file().
+ */
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode);
+
+/**
+ * Adds a symlink entry pointing to target to the archive.
+ *
+ * @return the same values as tar_writer_add_file().
+ */
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target);
+
+/**
+ * Ends the archive with two null blocks, writes what is still buffered and releases the writer.
+ *
+ * @param w A writer, or NULL.
+ *
+ * @return zero if the whole archive was written, -1 otherwise.
+ */
+int tar_writer_close(tar_writer_t *w);
+
 #endif
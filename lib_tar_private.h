@@ -0,0 +1,227 @@
+#ifndef LIB_TAR_PRIVATE_H
+#define LIB_TAR_PRIVATE_H
+
+/*
+ * Internals of lib_tar shared by its translation units. Not part of the API.
+ */
+
+#include "lib_tar.h"
+#include <string.h>
+
+#define TAR_BLOCK sizeof(tar_header_t)
+#define NO_ENTRY UINT32_MAX
+
+#define ENTRY_IMPLIED 0x1       // a parent directory without a header of its own in the archive
+#define ENTRY_CYCLE 0x2         // a link whose chain of links loops
+#define ENTRY_UNSTABLE 0x4      // a link which an entry added later may resolve differently: dangling, in a cycle,
+                                // or found from the root or as a directory after a failed exact lookup
+
+struct tar_archive {
+    int fd;
+
+    const uint8_t *map;         // read-only mapping of the whole archive, NULL when reading with read()
+    size_t map_size;
+    uint8_t **views;            // per entry copies handed out by tar_view_file() when the archive is not mapped,
+                                // as many as max_entries once the index is in memory
+    struct tar_retired *retired; // mappings, views and string pools replaced by tar_refresh(), whose callers may still
+                                 // hold pointers into them, released by tar_close()
+
+    // entry table, one array per field so that a scan only touches the fields it needs; with the buckets, the
+    // sorted permutation, the directory tree and the link targets, an entry takes at most 64 bytes besides its path
+    uint64_t *offsets;          // offset of the entry data in the archive
+    uint64_t *sizes;            // size of the entry data
+    uint32_t *paths;            // offset of the entry path in the string pool
+    uint32_t *links;            // offset of the entry linkname in the string pool
+    uint32_t *hashes;           // hash of the entry path
+    char *types;                // typeflag of the entry
+    uint8_t *flags;             // ENTRY_* values
+    uint16_t *modes;            // permission bits of the entry
+    uint32_t no_entries;
+    uint32_t max_entries;
+
+    char *strings;              // string pool, a bump arena where every path and linkname is stored null-terminated
+    size_t strings_len;
+    size_t strings_max;
+
+    uint32_t *buckets;          // open addressing table of entry index + 1, zero for an empty bucket
+    uint32_t no_buckets;        // always a power of two
+
+    uint32_t *sorted;           // entry indexes sorted by path
+
+    uint32_t *first_child;      // directory tree: first child of every directory, NO_ENTRY if it has none
+    uint32_t *next_sibling;     // next entry in the same directory, NO_ENTRY for the last one
+
+    uint32_t *targets;          // entry reached once the symlinks and hard links are followed, the entry itself if it
+                                // is not a link, NO_ENTRY for a dangling link or a cycle
+    uint32_t no_unstable;       // links flagged ENTRY_UNSTABLE
+    int relink;                 // a link was indexed, or replaced, since the links were resolved
+
+    uint64_t tail;              // offset of the header following the last one indexed, where tar_refresh() resumes
+    int refreshing;             // tar_refresh() is running: the arrays handed out to callers are retired, not freed
+
+    const uint8_t *index_map;   // mapped index file the index lives in, NULL when it was built in memory
+    size_t index_size;
+
+    struct tar_async *async;    // asynchronous read engine, NULL until the first asynchronous read
+    struct tar_gz *gz;          // checkpoints of a gzip-compressed archive, offsets are then in the decompressed tar
+
+    char *long_path;            // path given to the next header by a PAX or GNU extended header, NULL if none
+    char *long_link;            // same for its link name
+
+    struct tar_stats_slot *stats; // counters of every thread slot, allocated by the first call counted
+    tar_trace_begin_cb trace_begin;
+    tar_trace_end_cb trace_end;
+    void *trace_ctx;
+};
+
+static inline const char *entry_path(const tar_archive_t *ar, uint32_t id) {
+    return ar->strings + ar->paths[id];
+}
+
+static inline const char *entry_link(const tar_archive_t *ar, uint32_t id) {
+    return ar->strings + ar->links[id];
+}
+
+/**
+ * Copies a listed path to a caller buffer of TAR_ENTRY_MAX bytes, truncating it if needed.
+ */
+static inline void entry_copy(char *dest, const char *name) {
+    size_t len = strnlen(name, TAR_ENTRY_MAX - 1);
+    memcpy(dest, name, len);
+    dest[len] = '\0';
+}
+
+static inline int entry_is_file(const tar_archive_t *ar, uint32_t id) {
+    char type = ar->types[id];
+    return type == REGTYPE || type == AREGTYPE;
+}
+
+/**
+ * Reads len bytes at a given offset of a file, without moving its file offset, so that a descriptor can be shared
+ * by several threads.
+ *
+ * @return the number of bytes read, less than len at the end of the file, or -1 on a read error.
+ */
+ssize_t tar_pread_full(int fd, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Writes len bytes to a file, resuming after short writes and interrupted ones.
+ *
+ * @return zero on success, -1 on a write error.
+ */
+int tar_write_full(int fd, const void *buf, size_t len);
+
+/**
+ * Reads len bytes of the archive at a given offset, from the mapping when there is one.
+ *
+ * @return the number of bytes read, less than len at the end of the archive, or -1 on a read error.
+ */
+ssize_t tar_archive_read(const tar_archive_t *ar, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Finds the regular file at a given path, following symlinks.
+ *
+ * @return the index of the entry, or NO_ENTRY if there is no file at that path.
+ */
+uint32_t tar_find_file(const tar_archive_t *ar, const char *path);
+
+/**
+ * Stops the asynchronous read engine of an archive handle and releases it, see tar_async.c.
+ */
+void tar_async_free(tar_archive_t *ar);
+
+/**
+ * Decompresses a gzip-compressed archive once, handing every decompressed chunk to consume() and taking a checkpoint
+ * every span bytes of output, see tar_gz.c. The decompression stops early when consume() returns nonzero.
+ *
+ * @return the checkpoints, or NULL if the file is not a valid gzip stream or memory ran out.
+ */
+struct tar_gz *tar_gz_build(int fd, uint64_t span,
+                            int (*consume)(void *ctx, const uint8_t *buf, size_t len, uint64_t offset), void *ctx);
+
+/**
+ * Reads len bytes of the decompressed archive at a given offset, decompressing from the checkpoint before it.
+ * Safe to call from several threads at once.
+ *
+ * @return the number of bytes read, less than len at the end of the archive, or -1 on a read or data error.
+ */
+ssize_t tar_gz_read(const struct tar_gz *gz, int fd, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Decompresses the range [offset, end) of the archive from the checkpoint before it, handing it to consume() by
+ * chunks. The decompression stops early when consume() returns nonzero.
+ *
+ * @return zero when the range was handed over, the stream ended or consume() returned a positive value, -1 on a read
+ *         or data error or if consume() returned a negative value.
+ */
+int tar_gz_stream(const struct tar_gz *gz, int fd, uint64_t offset, uint64_t end,
+                  int (*consume)(void *ctx, const uint8_t *buf, size_t len, uint64_t offset), void *ctx);
+
+/**
+ * Appends the checkpoints to a file descriptor.
+ */
+int tar_gz_save(const struct tar_gz *gz, int fd);
+
+/**
+ * Loads checkpoints saved by tar_gz_save(), setting *used to the number of bytes they took.
+ *
+ * @return the checkpoints, or NULL if they are malformed.
+ */
+struct tar_gz *tar_gz_load(const uint8_t *data, size_t size, size_t *used);
+
+void tar_gz_free(struct tar_gz *gz);
+
+/*
+ * Statistics, see tar_stats.c. A call opens a scope on its own stack; the reads below it count in the innermost
+ * scope of the thread, without any atomic operation, and the scope is added to the counters of the handle when it
+ * ends.
+ */
+
+struct tar_stats_scope {
+    tar_archive_t *ar;          // NULL for a call made by another call on the same handle, which counts for both
+    int op;
+    int traced;                 // the trace hooks are called for this scope
+    const char *path;
+    uint64_t start;             // monotonic time at the beginning of the call, in nanoseconds
+    tar_op_stats_t counters;
+    struct tar_stats_scope *outer;
+};
+
+extern __thread struct tar_stats_scope *tar_stats_current;
+extern __thread uint64_t tar_stats_next_offset; // end of the last read of the thread, a read anywhere else is a seek
+
+/**
+ * Starts counting a call made by the library user.
+ */
+void tar_stats_begin(struct tar_stats_scope *scope, tar_archive_t *ar, int op, const char *path);
+
+/**
+ * Starts counting the work done for a call in another thread, a worker of tar_extract() for instance, without
+ * counting a call nor calling the trace hooks.
+ */
+void tar_stats_join(struct tar_stats_scope *scope, tar_archive_t *ar, int op);
+
+void tar_stats_end(struct tar_stats_scope *scope);
+
+/**
+ * Counts a read of len bytes at a given offset of the archive, done by syscalls system calls or from memory.
+ */
+static inline void tar_stats_read(uint64_t offset, size_t len, int syscalls) {
+    struct tar_stats_scope *scope = tar_stats_current;
+    if (scope == NULL) return;
+    if (syscalls) scope->counters.syscalls += syscalls;
+    else scope->counters.cache_hits++;
+    if (offset != tar_stats_next_offset) scope->counters.seeks++;
+    scope->counters.bytes_read += len;
+    tar_stats_next_offset = offset + len;
+}
+
+static inline void tar_stats_header(void) {
+    if (tar_stats_current != NULL) tar_stats_current->counters.headers++;
+}
+
+static inline void tar_stats_hit(void) {
+    if (tar_stats_current != NULL) tar_stats_current->counters.cache_hits++;
+}
+
+#endif
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/*
+ * Asynchronous reads.
+ *
+ * The files are resolved through the index when a read is queued, then the read itself goes to an io_uring ring
+ * when the kernel provides one able to read, or to a small pool of threads doing pread() otherwise. The callbacks
+ * always run in the thread calling tar_async_poll().
+ */
+
+#define ASYNC_DEPTH 256         // default number of reads in flight in the ring
+#define ASYNC_THREADS 4         // default number of threads of the pool
+#define ASYNC_SQE_MAX (1 << 30) // largest read of a single submission, whose length only has 32 bits
+
+struct async_req {
+    tar_read_cb callback;
+    void *ctx;
+    uint8_t *dest;
+    size_t len;                 // bytes to read
+    size_t done;                // bytes read so far
+    uint64_t offset;            // offset in the archive of the next byte to read
+    ssize_t ret;                // value given to the callback, as read_file() would return it
+    struct async_req *next;
+};
+
+struct ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+};
+
+struct tar_async {
+    tar_archive_t *ar;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;   // signaled when a read completes
+    pthread_cond_t work_cond;   // signaled when a read is queued for the pool
+
+    struct async_req *queued;   // reads not handed to the ring or the pool yet, oldest first
+    struct async_req *queued_last;
+    struct async_req *done;     // completed reads whose callback did not run yet
+    size_t no_done;
+    size_t outstanding;         // reads queued and not completed yet
+    int stop;
+
+    int use_ring;
+    struct ring ring;
+    unsigned in_ring;           // reads submitted to the ring and not completed yet
+
+    pthread_t *threads;
+    int no_threads;
+};
+
+/* ------------------------------------------------------------------------- */
+/*                                io_uring                                   */
+/* ------------------------------------------------------------------------- */
+
+#define PROBE_OPS 256           // operations asked for when probing the ring, more than any kernel has
+
+/**
+ * Whether the ring supports IORING_OP_READ. The kernels before 5.6 set up a ring but fail every such read with
+ * -EINVAL, and they have no probe either.
+ */
+static int ring_reads(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) return 0;
+
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0 &&
+             probe->ops_len > IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static int ring_setup(struct ring *ring, unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring->fd < 0) return -1;
+    if (!ring_reads(ring->fd)) goto fail; // the pool does the reads instead
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) goto fail;
+
+    ring->cq_ptr = ring->sq_ptr;
+    if (ring->cq_size > 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) { munmap(ring->sq_ptr, ring->sq_size); goto fail; }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+        if (ring->cq_size > 0) munmap(ring->cq_ptr, ring->cq_size);
+        goto fail;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+static void ring_free(struct ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->cq_size > 0) munmap(ring->cq_ptr, ring->cq_size);
+    close(ring->fd);
+}
+
+static int ring_enter(struct ring *ring, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/**
+ * Takes back the entries of the submission queue the kernel did not consume, completing their reads with an error.
+ * Called with the lock held.
+ */
+static void ring_fail_pending(struct tar_async *as) {
+    struct ring *ring = &as->ring;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    for (unsigned i = head; i != *ring->sq_tail; i++) {
+        struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[i & *ring->sq_mask]];
+        struct async_req *req = (struct async_req *)(uintptr_t)sqe->user_data;
+        as->in_ring--;
+        req->ret = -1;
+        req->next = as->done;
+        as->done = req;
+        as->no_done++;
+    }
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves the queued reads to the submission queue of the ring, as long as it has room, and submits every entry the
+ * kernel did not consume yet. If the submission fails, these reads complete with an error instead of waiting forever.
+ * Called with the lock held.
+ *
+ * @return zero on success, -1 if the submission failed.
+ */
+static int ring_submit(struct tar_async *as) {
+    struct ring *ring = &as->ring;
+    unsigned tail = *ring->sq_tail;
+
+    while (as->queued != NULL && as->in_ring < ring->entries) {
+        struct async_req *req = as->queued;
+        as->queued = req->next;
+        if (as->queued == NULL) as->queued_last = NULL;
+
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = as->ar->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(req->dest + req->done);
+        size_t left = req->len - req->done;
+        sqe->len = left < ASYNC_SQE_MAX ? left : ASYNC_SQE_MAX; // the rest is read as after a short read
+        sqe->off = req->offset;
+        sqe->user_data = (uint64_t)(uintptr_t)req;
+        ring->sq_array[index] = index;
+
+        tail++;
+        as->in_ring++;
+    }
+    // a partial submission leaves the rest of the entries to the next one
+    unsigned pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0) return 0;
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    if (ring_enter(ring, pending, 0, 0) >= 0) return 0;
+    ring_fail_pending(as);
+    return -1;
+}
+
+/**
+ * Moves the completions of the ring to the list of completed reads, resubmitting the short reads.
+ * Called with the lock held.
+ */
+static void ring_reap(struct tar_async *as) {
+    struct ring *ring = &as->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct async_req *req = (struct async_req *)(uintptr_t)cqe->user_data;
+        as->in_ring--;
+        tar_stats_read(req->offset, cqe->res > 0 ? cqe->res : 0, 1);
+
+        if (cqe->res > 0 && req->done + cqe->res < req->len) {
+            // short read: queue the rest again
+            req->done += cqe->res;
+            req->offset += cqe->res;
+            req->next = NULL;
+            if (as->queued_last != NULL) as->queued_last->next = req;
+            else as->queued = req;
+            as->queued_last = req;
+            continue;
+        }
+
+        if (cqe->res < 0) req->ret = -1;
+        else req->done += cqe->res;
+        req->next = as->done;
+        as->done = req;
+        as->no_done++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------------- */
+/*                               Thread pool                                 */
+/* ------------------------------------------------------------------------- */
+
+static void *pool_worker(void *arg) {
+    struct tar_async *as = arg;
+
+    pthread_mutex_lock(&as->lock);
+    while (1) {
+        while (as->queued == NULL && !as->stop) pthread_cond_wait(&as->work_cond, &as->lock);
+        if (as->queued == NULL) break;
+
+        struct async_req *req = as->queued;
+        as->queued = req->next;
+        if (as->queued == NULL) as->queued_last = NULL;
+        pthread_mutex_unlock(&as->lock);
+
+        struct tar_stats_scope scope;
+        tar_stats_join(&scope, as->ar, TAR_OP_READ_ASYNC);
+        ssize_t r = tar_archive_read(as->ar, req->dest, req->len, req->offset);
+        tar_stats_end(&scope);
+        if (r < 0) req->ret = -1;
+        else req->done = r;
+
+        pthread_mutex_lock(&as->lock);
+        req->next = as->done;
+        as->done = req;
+        as->no_done++;
+        pthread_cond_signal(&as->done_cond);
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/*                                 Engine                                    */
+/* ------------------------------------------------------------------------- */
+
+int tar_async_setup(tar_archive_t *ar, unsigned queue_depth, int nthreads, int flags) {
+    if (ar->async != NULL) return -1;
+
+    struct tar_async *as = calloc(1, sizeof(struct tar_async));
+    if (as == NULL) return -1;
+
+    as->ar = ar;
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->done_cond, NULL);
+    pthread_cond_init(&as->work_cond, NULL);
+
+    // the ring reads the file itself, a compressed archive has to be decompressed by the threads
+    if (!(flags & TAR_ASYNC_THREADS) && ar->gz == NULL) {
+        as->use_ring = ring_setup(&as->ring, queue_depth ? queue_depth : ASYNC_DEPTH) == 0;
+    }
+
+    if (!as->use_ring) {
+        as->no_threads = nthreads > 0 ? nthreads : ASYNC_THREADS;
+        as->threads = malloc(as->no_threads * sizeof(pthread_t));
+        if (as->threads == NULL) { ar->async = as; tar_async_free(ar); return -1; }
+
+        for (int i = 0; i < as->no_threads; i++) {
+            if (pthread_create(&as->threads[i], NULL, pool_worker, as) != 0) {
+                as->no_threads = i;
+                break;
+            }
+        }
+        if (as->no_threads == 0) { ar->async = as; tar_async_free(ar); return -1; }
+    }
+
+    ar->async = as;
+    return 0;
+}
+
+void tar_async_free(tar_archive_t *ar) {
+    struct tar_async *as = ar->async;
+    if (as == NULL) return;
+
+    // let the reads in flight land before their buffers may go away
+    while (tar_async_poll(ar, 1) > 0);
+
+    pthread_mutex_lock(&as->lock);
+    as->stop = 1;
+    pthread_cond_broadcast(&as->work_cond);
+    pthread_mutex_unlock(&as->lock);
+    for (int i = 0; i < as->no_threads; i++) pthread_join(as->threads[i], NULL);
+
+    if (as->use_ring) ring_free(&as->ring);
+    pthread_mutex_destroy(&as->lock);
+    pthread_cond_destroy(&as->done_cond);
+    pthread_cond_destroy(&as->work_cond);
+    free(as->threads);
+    free(as);
+    ar->async = NULL;
+}
+
+int tar_read_async(tar_archive_t *ar, char *path, size_t offset, uint8_t *dest, size_t len, tar_read_cb callback,
+                   void *ctx) {
+    if (ar->async == NULL && tar_async_setup(ar, 0, 0, 0) < 0) return -1;
+    struct tar_async *as = ar->async;
+
+    struct async_req *req = calloc(1, sizeof(struct async_req));
+    if (req == NULL) return -1;
+
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_READ_ASYNC, path);
+    req->callback = callback;
+    req->ctx = ctx;
+    req->dest = dest;
+
+    // resolved right away, the index being in memory
+    uint32_t id = tar_find_file(ar, path);
+    if (id == NO_ENTRY) {
+        req->ret = -1;
+    } else if (offset > ar->sizes[id]) {
+        req->ret = -2;
+    } else {
+        size_t size = ar->sizes[id];
+        req->len = size - offset < len ? size - offset : len;
+        req->ret = (size - offset) - req->len;
+        req->offset = ar->offsets[id] + offset;
+    }
+
+    pthread_mutex_lock(&as->lock);
+    as->outstanding++;
+    if (req->ret < 0 || req->len == 0) {
+        req->next = as->done;
+        as->done = req;
+        as->no_done++;
+    } else {
+        if (as->queued_last != NULL) as->queued_last->next = req;
+        else as->queued = req;
+        as->queued_last = req;
+
+        // a failed submission has already completed the read with an error, for the next tar_async_poll()
+        if (as->use_ring) ring_submit(as);
+        else pthread_cond_signal(&as->work_cond);
+    }
+    pthread_mutex_unlock(&as->lock);
+    tar_stats_end(&scope);
+    return 0;
+}
+
+int tar_async_poll(tar_archive_t *ar, size_t min_complete) {
+    struct tar_async *as = ar->async;
+    if (as == NULL) return 0;
+
+    // the reads completed by the ring count for the asynchronous reads, the callbacks for themselves
+    struct tar_stats_scope scope;
+    tar_stats_join(&scope, ar, TAR_OP_READ_ASYNC);
+    pthread_mutex_lock(&as->lock);
+    if (min_complete > as->outstanding) min_complete = as->outstanding;
+
+    if (as->use_ring) {
+        while (1) {
+            if (ring_submit(as) < 0) break;
+            ring_reap(as);
+            if (as->queued != NULL) continue; // room was made in the ring
+            if (as->no_done >= min_complete || as->in_ring == 0) break;
+
+            pthread_mutex_unlock(&as->lock);
+            int r = ring_enter(&as->ring, 0, 1, IORING_ENTER_GETEVENTS);
+            pthread_mutex_lock(&as->lock);
+            if (r < 0) break;
+        }
+    } else {
+        while (as->no_done < min_complete) pthread_cond_wait(&as->done_cond, &as->lock);
+    }
+
+    struct async_req *done = as->done;
+    as->outstanding -= as->no_done;
+    as->done = NULL;
+    as->no_done = 0;
+    pthread_mutex_unlock(&as->lock);
+    tar_stats_end(&scope);
+
+    // the callbacks run without the lock, they may queue new reads
+    int ret = 0;
+    while (done != NULL) {
+        struct async_req *req = done;
+        done = req->next;
+
+        if (req->ret < 0) req->callback(req->ctx, req->ret, 0);
+        else req->callback(req->ctx, req->ret + (req->len - req->done), req->done); // short only if truncated
+        free(req);
+        ret++;
+    }
+    return ret;
+}
@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "lib_tar.h"
+
+/**
+ * Measures the latency and the throughput of the queries of lib_tar on an archive.
+ *
+ * Every query is run on paths sampled from the archive, first with the archive evicted from the page cache before
+ * every call (cold), then after a warm-up (warm). The functions taking a descriptor rebuild their index on every call,
+ * so they get fewer iterations than the ones of an opened handle.
+ */
+
+#define SAMPLES 1024                // paths kept of every kind
+#define READ_MAX (1 << 20)          // bytes read at most by a read_file() call
+
+enum bench_op {
+    OP_CHECK_ARCHIVE, OP_EXISTS, OP_IS_DIR, OP_IS_FILE, OP_IS_SYMLINK, OP_LIST, OP_READ_FILE,
+    OP_TAR_OPEN, OP_TAR_EXISTS, OP_TAR_IS_DIR, OP_TAR_IS_FILE, OP_TAR_IS_SYMLINK, OP_TAR_LIST, OP_TAR_READ_FILE,
+    NO_OPS
+};
+
+static const char *op_names[NO_OPS] = {
+    "check_archive", "exists", "is_dir", "is_file", "is_symlink", "list", "read_file",
+    "tar_open", "tar_exists", "tar_is_dir", "tar_is_file", "tar_is_symlink", "tar_list", "tar_read_file",
+};
+
+/* Paths sampled from the archive, reservoir-sampled so that they spread over the whole archive. */
+struct samples {
+    char *paths[SAMPLES];
+    uint32_t len;
+    uint64_t seen;
+};
+
+struct bench {
+    int fd;
+    tar_archive_t *ar;
+    int open_flags;
+    struct samples files, dirs, links, any;     // any also holds paths missing from the archive
+    uint8_t *buffer;
+    char **entries;
+    uint64_t no_entries;
+    uint64_t archive_size;
+};
+
+struct result {
+    const char *op;
+    const char *cache;
+    uint32_t iterations;
+    uint64_t bytes;             // content read by all the iterations
+    double mean, p50, p90, p99, p999, max; // latencies, in microseconds
+    double total;               // seconds
+};
+
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void sample_add(struct samples *s, const char *path) {
+    s->seen++;
+    if (s->len < SAMPLES) {
+        s->paths[s->len++] = strdup(path);
+        return;
+    }
+    uint64_t slot = rng_next() % s->seen;
+    if (slot < SAMPLES) {
+        free(s->paths[slot]);
+        s->paths[slot] = strdup(path);
+    }
+}
+
+static void sample_free(struct samples *s) {
+    for (uint32_t i = 0; i < s->len; i++) free(s->paths[i]);
+}
+
+/**
+ * Walks the archive once to sample the paths the queries will use.
+ *
+ * @return the number of entries of the archive, or -1 if it could not be read.
+ */
+static int64_t collect_samples(struct bench *b) {
+    tar_iter_t *it = tar_iter_open(b->fd, 0);
+    if (it == NULL) return -1;
+
+    const tar_header_t *header;
+    int64_t no_entries = 0;
+    char path[sizeof(header->prefix) + 1 + sizeof(header->name) + 1];
+    int ret;
+    while ((ret = tar_iter_next(it, &header)) == 1) {
+        if (header->prefix[0] != '\0') {
+            snprintf(path, sizeof(path), "%.*s/%.*s", (int)sizeof(header->prefix), header->prefix,
+                     (int)sizeof(header->name), header->name);
+        } else {
+            snprintf(path, sizeof(path), "%.*s", (int)sizeof(header->name), header->name);
+        }
+        no_entries++;
+
+        if (header->typeflag == DIRTYPE) sample_add(&b->dirs, path);
+        else if (header->typeflag == SYMTYPE) sample_add(&b->links, path);
+        else if (header->typeflag == REGTYPE || header->typeflag == AREGTYPE) sample_add(&b->files, path);
+
+        // one query out of four looks for a path which is not there
+        sample_add(&b->any, path);
+        if (rng_next() % 3 == 0) {
+            strcat(path, ".missing");
+            sample_add(&b->any, path);
+        }
+    }
+    tar_iter_close(it);
+    lseek(b->fd, 0, SEEK_SET);
+    return ret < 0 ? -1 : no_entries;
+}
+
+/**
+ * Evicts the archive from the page cache. Pages mapped by the handle stay in memory.
+ */
+static void drop_cache(struct bench *b) {
+    fdatasync(b->fd);
+    posix_fadvise(b->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static const struct samples *op_samples(const struct bench *b, enum bench_op op) {
+    switch (op) {
+        case OP_IS_DIR: case OP_TAR_IS_DIR: case OP_LIST: case OP_TAR_LIST: return &b->dirs;
+        case OP_IS_FILE: case OP_TAR_IS_FILE: case OP_READ_FILE: case OP_TAR_READ_FILE: return &b->files;
+        case OP_IS_SYMLINK: case OP_TAR_IS_SYMLINK: return &b->links;
+        case OP_EXISTS: case OP_TAR_EXISTS: return &b->any;
+        default: return NULL;
+    }
+}
+
+/**
+ * Runs one query.
+ *
+ * @return the number of bytes of content it read.
+ */
+static uint64_t run_op(struct bench *b, enum bench_op op, char *path) {
+    size_t len = READ_MAX, no_entries = b->no_entries;
+    ssize_t r;
+
+    switch (op) {
+        case OP_CHECK_ARCHIVE: check_archive(b->fd); return 0;
+        case OP_EXISTS: exists(b->fd, path); return 0;
+        case OP_IS_DIR: is_dir(b->fd, path); return 0;
+        case OP_IS_FILE: is_file(b->fd, path); return 0;
+        case OP_IS_SYMLINK: is_symlink(b->fd, path); return 0;
+        case OP_LIST: list(b->fd, path, b->entries, &no_entries); return 0;
+        case OP_READ_FILE:
+            r = read_file(b->fd, path, 0, b->buffer, &len);
+            return r < 0 ? 0 : len;
+        case OP_TAR_OPEN: tar_close(tar_open_flags(b->fd, b->open_flags)); return 0;
+        case OP_TAR_EXISTS: tar_exists(b->ar, path); return 0;
+        case OP_TAR_IS_DIR: tar_is_dir(b->ar, path); return 0;
+        case OP_TAR_IS_FILE: tar_is_file(b->ar, path); return 0;
+        case OP_TAR_IS_SYMLINK: tar_is_symlink(b->ar, path); return 0;
+        case OP_TAR_LIST: tar_list(b->ar, path, b->entries, &no_entries); return 0;
+        case OP_TAR_READ_FILE:
+            r = tar_read_file(b->ar, path, 0, b->buffer, &len);
+            return r < 0 ? 0 : len;
+        default: return 0;
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, uint32_t len, double p) {
+    uint32_t i = p * len;
+    return sorted[i < len ? i : len - 1];
+}
+
+/**
+ * Times a query over a number of iterations, cold or warm.
+ *
+ * @return zero on success, -1 if there is no path to query.
+ */
+static int bench_op(struct bench *b, enum bench_op op, int cold, uint32_t iterations, struct result *res) {
+    const struct samples *s = op_samples(b, op);
+    if (s != NULL && s->len == 0) return -1;
+
+    double *latencies = malloc(iterations * sizeof(double));
+    if (latencies == NULL) return -1;
+
+    memset(res, 0, sizeof(*res));
+    res->op = op_names[op];
+    res->cache = cold ? "cold" : "warm";
+    res->iterations = iterations;
+
+    // warm-up, which also faults in the code and the buffers
+    if (!cold) {
+        for (uint32_t i = 0; i < iterations / 10 + 1; i++) run_op(b, op, s ? s->paths[i % s->len] : NULL);
+    }
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        char *path = s ? s->paths[i % s->len] : NULL;
+        if (cold) drop_cache(b);
+        double start = now();
+        res->bytes += run_op(b, op, path);
+        latencies[i] = (now() - start) * 1e6;
+        res->total += latencies[i] * 1e-6;
+    }
+
+    qsort(latencies, iterations, sizeof(double), compare_doubles);
+    res->mean = res->total * 1e6 / iterations;
+    res->p50 = percentile(latencies, iterations, 0.5);
+    res->p90 = percentile(latencies, iterations, 0.9);
+    res->p99 = percentile(latencies, iterations, 0.99);
+    res->p999 = percentile(latencies, iterations, 0.999);
+    res->max = latencies[iterations - 1];
+    free(latencies);
+    return 0;
+}
+
+static void print_result(FILE *out, const char *format, const struct result *res, int first) {
+    double ops = res->total > 0 ? res->iterations / res->total : 0;
+    double mbps = res->total > 0 ? res->bytes / res->total / 1e6 : 0;
+
+    if (strcmp(format, "json") == 0) {
+        fprintf(out, "%s    {\"op\": \"%s\", \"cache\": \"%s\", \"iterations\": %u, \"mean_us\": %.3f, "
+                     "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, "
+                     "\"ops_per_s\": %.1f, \"mb_per_s\": %.3f}", first ? "" : ",\n", res->op, res->cache,
+                res->iterations, res->mean, res->p50, res->p90, res->p99, res->p999, res->max, ops, mbps);
+    } else if (strcmp(format, "csv") == 0) {
+        fprintf(out, "%s,%s,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.3f\n", res->op, res->cache, res->iterations,
+                res->mean, res->p50, res->p90, res->p99, res->p999, res->max, ops, mbps);
+    } else {
+        fprintf(out, "%-16s %-5s %8u %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %12.1f %9.1f\n", res->op, res->cache,
+                res->iterations, res->mean, res->p50, res->p90, res->p99, res->p999, res->max, ops, mbps);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-i iterations] [-I fd_iterations] [-o op[,op...]] [-c cold|warm|both] [-m] "
+                    "[-f text|json|csv] archive.tar\n", name);
+}
+
+int main(int argc, char **argv) {
+    uint32_t iterations = 10000, fd_iterations = 20;
+    const char *format = "text", *only = NULL, *caches = "both";
+    struct bench b = {0};
+    int c;
+
+    while ((c = getopt(argc, argv, "i:I:o:c:mf:")) != -1) {
+        switch (c) {
+            case 'i': iterations = strtoul(optarg, NULL, 10); break;
+            case 'I': fd_iterations = strtoul(optarg, NULL, 10); break;
+            case 'o': only = optarg; break;
+            case 'c': caches = optarg; break;
+            case 'm': b.open_flags |= TAR_OPEN_MMAP; break;
+            case 'f': format = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || iterations == 0 || fd_iterations == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *archive = argv[optind];
+    b.fd = open(archive, O_RDONLY);
+    struct stat st;
+    if (b.fd < 0 || fstat(b.fd, &st) < 0) {
+        perror(archive);
+        return 1;
+    }
+    b.archive_size = st.st_size;
+
+    int64_t no_entries = collect_samples(&b);
+    b.ar = no_entries < 0 ? NULL : tar_open_flags(b.fd, b.open_flags);
+    if (b.ar == NULL) {
+        fprintf(stderr, "%s: not a valid archive\n", archive);
+        return 1;
+    }
+    b.no_entries = no_entries;
+    b.buffer = malloc(READ_MAX);
+    b.entries = malloc(no_entries * sizeof(char *) + 1);
+    for (int64_t i = 0; i < no_entries; i++) b.entries[i] = malloc(sizeof(((tar_header_t *)0)->name) * 2 + 2);
+
+    if (strcmp(format, "json") == 0) {
+        printf("{\n  \"archive\": \"%s\", \"size\": %llu, \"entries\": %lld, \"mmap\": %s,\n  \"results\": [\n",
+               archive, (unsigned long long)b.archive_size, (long long)no_entries,
+               b.open_flags & TAR_OPEN_MMAP ? "true" : "false");
+    } else if (strcmp(format, "csv") == 0) {
+        printf("op,cache,iterations,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,ops_per_s,mb_per_s\n");
+    } else {
+        printf("%s: %lld entries, %llu bytes\n", archive, (long long)no_entries, (unsigned long long)b.archive_size);
+        printf("%-16s %-5s %8s %10s %10s %10s %10s %10s %10s %12s %9s\n", "op", "cache", "iters", "mean_us",
+               "p50_us", "p90_us", "p99_us", "p999_us", "max_us", "ops/s", "MB/s");
+    }
+
+    int first = 1;
+    for (int cold = 1; cold >= 0; cold--) {
+        if (strcmp(caches, cold ? "warm" : "cold") == 0) continue;
+
+        for (enum bench_op op = 0; op < NO_OPS; op++) {
+            if (only != NULL) {
+                // the names of the selected ops, separated by commas
+                size_t len = strlen(op_names[op]);
+                const char *found = only;
+                while ((found = strstr(found, op_names[op])) != NULL) {
+                    if ((found == only || found[-1] == ',') && (found[len] == ',' || found[len] == '\0')) break;
+                    found += len;
+                }
+                if (found == NULL) continue;
+            }
+
+            struct result res;
+            uint32_t n = op < OP_TAR_OPEN ? fd_iterations : iterations;
+            if (op == OP_TAR_OPEN) n = fd_iterations;
+            if (bench_op(&b, op, cold, n, &res) < 0) continue;
+            print_result(stdout, format, &res, first);
+            first = 0;
+        }
+    }
+    if (strcmp(format, "json") == 0) printf("\n  ]\n}\n");
+
+    for (int64_t i = 0; i < no_entries; i++) free(b.entries[i]);
+    free(b.entries);
+    free(b.buffer);
+    sample_free(&b.files);
+    sample_free(&b.dirs);
+    sample_free(&b.links);
+    sample_free(&b.any);
+    tar_close(b.ar);
+    close(b.fd);
+    return 0;
+}
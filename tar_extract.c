@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+/*
+ * Parallel extraction.
+ *
+ * The directories are created first, from the index sorted by path so that parents come before their children.
+ * A pool of threads then writes the regular files in archive order, the kernel copying their content straight
+ * from the archive with copy_file_range(). The files of a compressed archive are written by batches, every batch
+ * decompressed in one go. The links come last, and the directories get their own modes back at the very end.
+ *
+ * Every entry is created from the directory holding it, opened without following any symlink, so that nothing is
+ * ever created, written or linked outside of the destination, through a symlink of the archive or one already there.
+ * An existing file is unlinked before it is replaced, never written through, as it may be a hard link.
+ */
+
+#define EXTRACT_BATCH 64            // files handed to a worker at once
+#define EXTRACT_CHUNK (1 << 20)     // bytes read at once when the kernel cannot copy
+#define EXTRACT_PREALLOC (64 << 10) // smaller files are not worth a fallocate() call
+
+struct extract_job {
+    const tar_archive_t *ar;
+    int dir_fd;
+    uint32_t *files;            // regular files to write, sorted by offset
+    uint32_t no_files;
+    uint32_t next;              // next file to hand out, shared by the workers
+    int error;                  // set by the first failure, stops the workers
+};
+
+/**
+ * Whether a path stays inside the destination directory: relative and without any ".." component.
+ */
+static int path_safe(const char *path) {
+    if (path[0] == '/') return 0;
+    for (const char *p = path; *p != '\0';) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        if (*p == '/') p++;
+    }
+    return 1;
+}
+
+/**
+ * Whether parent_open() failed because the path leaves the destination.
+ */
+static int path_escapes(int error) {
+    return error == ELOOP || error == EXDEV || error == ENOTDIR;
+}
+
+/**
+ * Opens the directory holding a path under the destination, following no symlink on the way.
+ *
+ * @param name Set to the last component of the path.
+ *
+ * @return a descriptor of the directory, or -1 with errno set, see path_escapes().
+ */
+static int parent_open(int dir_fd, const char *path, const char **name) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') len--; // a directory
+    while (len > 0 && path[len - 1] != '/') len--;
+    *name = path + len;
+
+    char *dir = strndup(path, len);
+    if (dir == NULL) return -1;
+    int fd = -1;
+#ifdef SYS_openat2
+    // a single system call where the kernel has it
+    struct open_how how = {.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+                           .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS};
+    fd = syscall(SYS_openat2, dir_fd, len ? dir : ".", &how, sizeof(how));
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) {
+        free(dir);
+        return fd;
+    }
+#endif
+
+    // one component at a time
+    fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (char *component = dir, *next; fd >= 0 && *component != '\0'; component = next) {
+        size_t n = strcspn(component, "/");
+        next = component + n + (component[n] == '/');
+        component[n] = '\0';
+        if (n == 0 || strcmp(component, ".") == 0) continue;
+
+        int child = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int error = errno;
+        close(fd);
+        fd = child;
+        errno = error;
+    }
+    free(dir);
+    return fd;
+}
+
+/**
+ * Copies the content of an entry to a file, by the kernel unless the archive is compressed.
+ */
+static int extract_content(const tar_archive_t *ar, int fd, uint32_t id, uint8_t **buffer) {
+    uint64_t offset = ar->offsets[id];
+    uint64_t end = offset + ar->sizes[id];
+
+    if (ar->gz == NULL) {
+        loff_t in = offset;
+        while (in < end) {
+            loff_t start = in;
+            ssize_t r = copy_file_range(ar->fd, &in, fd, NULL, end - in, 0);
+            if (r <= 0) break; // not supported here, or a truncated archive caught below
+            tar_stats_read(start, r, 1);
+        }
+        offset = in;
+    }
+
+    if (offset < end && ar->map != NULL) {
+        if (end > ar->map_size) return -1;
+        tar_stats_read(offset, end - offset, 0);
+        return tar_write_full(fd, ar->map + offset, end - offset);
+    }
+
+    while (offset < end) {
+        if (*buffer == NULL && (*buffer = malloc(EXTRACT_CHUNK)) == NULL) return -1;
+        size_t chunk = end - offset < EXTRACT_CHUNK ? end - offset : EXTRACT_CHUNK;
+        if (tar_archive_read(ar, *buffer, chunk, offset) != chunk) return -1;
+        if (tar_write_full(fd, *buffer, chunk) < 0) return -1;
+        offset += chunk;
+    }
+    return 0;
+}
+
+/**
+ * Creates a regular file of the archive, replacing what is there.
+ *
+ * @return the file descriptor, or -1 if it could not be created.
+ */
+static int extract_open(const tar_archive_t *ar, int dir_fd, uint32_t id) {
+    const char *name;
+    int parent = parent_open(dir_fd, entry_path(ar, id), &name);
+    if (parent < 0) return -1;
+
+    // never write through a symlink or a hard link already there, replace it
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(parent, name, flags, ar->modes[id]);
+    if (fd < 0 && errno == EEXIST && unlinkat(parent, name, 0) == 0) fd = openat(parent, name, flags, ar->modes[id]);
+    close(parent);
+    if (fd < 0) return -1;
+
+    uint64_t size = ar->sizes[id];
+    if (size >= EXTRACT_PREALLOC) fallocate(fd, 0, 0, size); // only a hint, the file system may not support it
+    return fd;
+}
+
+static int extract_file(const tar_archive_t *ar, int dir_fd, uint32_t id, uint8_t **buffer) {
+    int fd = extract_open(ar, dir_fd, id);
+    if (fd < 0) return -1;
+
+    int ret = extract_content(ar, fd, id, buffer);
+    if (close(fd) < 0) ret = -1;
+    return ret;
+}
+
+/* A batch of files of a compressed archive, written while their whole range is decompressed once. */
+struct gz_batch {
+    const tar_archive_t *ar;
+    int dir_fd;
+    const uint32_t *files;
+    uint32_t next;              // file being written, or the next one to write
+    uint32_t end;
+    int fd;                     // descriptor of the file being written, -1 between two files
+};
+
+static int gz_batch_visit(void *ctx, const uint8_t *buf, size_t len, uint64_t offset) {
+    struct gz_batch *batch = ctx;
+
+    while (batch->next < batch->end) {
+        uint32_t id = batch->files[batch->next];
+        uint64_t start = batch->ar->offsets[id];
+        uint64_t end = start + batch->ar->sizes[id];
+
+        // skip the headers and the padding up to the next file
+        if (offset + len <= start && start < end) return 0;
+        if (offset < start) {
+            buf += start - offset;
+            len -= start - offset;
+            offset = start;
+        }
+
+        if (batch->fd < 0 && (batch->fd = extract_open(batch->ar, batch->dir_fd, id)) < 0) return -1;
+        size_t take = end - offset < len ? end - offset : len;
+        if (tar_write_full(batch->fd, buf, take) < 0) return -1;
+        buf += take;
+        len -= take;
+        offset += take;
+        if (offset < end) return 0;
+
+        int closed = close(batch->fd);
+        batch->fd = -1;
+        if (closed < 0) return -1;
+        batch->next++;
+    }
+    return 1;
+}
+
+/**
+ * Writes a batch of files of a compressed archive, sorted by offset, decompressing their range once instead of
+ * once per file.
+ */
+static int extract_gz_batch(const tar_archive_t *ar, int dir_fd, const uint32_t *files, uint32_t start, uint32_t end) {
+    struct gz_batch batch = {ar, dir_fd, files, start, end, -1};
+    uint64_t first = ar->offsets[files[start]];
+    uint64_t last = ar->offsets[files[end - 1]] + ar->sizes[files[end - 1]];
+
+    int ret = tar_gz_stream(ar->gz, ar->fd, first, last, gz_batch_visit, &batch);
+    if (batch.fd >= 0) {
+        close(batch.fd);
+        ret = -1; // truncated archive
+    }
+
+    // empty files at the end of the range
+    for (uint8_t *none = NULL; ret == 0 && batch.next < end; batch.next++) {
+        if (ar->sizes[files[batch.next]] != 0) ret = -1;
+        else ret = extract_file(ar, dir_fd, files[batch.next], &none);
+    }
+    return ret;
+}
+
+static void *extract_worker(void *arg) {
+    struct extract_job *job = arg;
+    uint8_t *buffer = NULL;
+    struct tar_stats_scope scope;
+    tar_stats_join(&scope, (tar_archive_t *)job->ar, TAR_OP_EXTRACT);
+
+    while (!__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+        uint32_t start = __atomic_fetch_add(&job->next, EXTRACT_BATCH, __ATOMIC_RELAXED);
+        if (start >= job->no_files) break;
+
+        uint32_t end = start + EXTRACT_BATCH < job->no_files ? start + EXTRACT_BATCH : job->no_files;
+        if (job->ar->gz != NULL) {
+            if (extract_gz_batch(job->ar, job->dir_fd, job->files, start, end) < 0) {
+                __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+
+        for (uint32_t i = start; i < end; i++) {
+            if (extract_file(job->ar, job->dir_fd, job->files[i], &buffer) < 0) {
+                __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    free(buffer);
+    tar_stats_end(&scope);
+    return NULL;
+}
+
+/**
+ * Creates every directory of the archive, writable by its owner until the files are written.
+ */
+static int extract_dirs(const tar_archive_t *ar, int dir_fd) {
+    for (uint32_t i = 0; i < ar->no_entries; i++) {
+        uint32_t id = ar->sorted[i];
+        const char *path = entry_path(ar, id);
+        if (ar->types[id] != DIRTYPE || path[0] == '\0' || !path_safe(path)) continue;
+
+        const char *name;
+        int parent = parent_open(dir_fd, path, &name);
+        if (parent < 0) return -1;
+        int made = mkdirat(parent, name, ar->modes[id] | 0700);
+        int error = errno;
+        close(parent);
+        if (made < 0 && error != EEXIST) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Creates a symlink or a hard link.
+ *
+ * @return zero on success or for a hard link whose target leaves the destination, which is skipped, -1 otherwise.
+ */
+static int extract_link(const tar_archive_t *ar, int dir_fd, uint32_t id) {
+    const char *link = entry_link(ar, id);
+    const char *target_name;
+    int target = -1;
+    if (ar->types[id] == LNKTYPE) {
+        // a hard link names another entry of the archive, which must stay inside too, even through the symlinks
+        // the archive created
+        if (!path_safe(link)) return 0;
+        target = parent_open(dir_fd, link, &target_name);
+        if (target < 0) return path_escapes(errno) ? 0 : -1;
+    }
+
+    const char *name;
+    int parent = parent_open(dir_fd, entry_path(ar, id), &name);
+    int ret = -1;
+    if (parent >= 0) {
+        unlinkat(parent, name, 0); // replaced, as tar does
+        if (target < 0) ret = symlinkat(link, parent, name);
+        else ret = linkat(target, target_name, parent, name, 0);
+        close(parent);
+    }
+    if (target >= 0) close(target);
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Creates the symlinks and the hard links of the archive.
+ */
+static int extract_links(const tar_archive_t *ar, int dir_fd) {
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        const char *path = entry_path(ar, id);
+        char type = ar->types[id];
+        if ((type != SYMTYPE && type != LNKTYPE) || !path_safe(path)) continue;
+        if (extract_link(ar, dir_fd, id) < 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Gives the directories whose mode was widened to create their content their own mode back.
+ */
+static int extract_modes(const tar_archive_t *ar, int dir_fd) {
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        const char *path = entry_path(ar, id);
+        uint16_t mode = ar->modes[id];
+        if (ar->types[id] != DIRTYPE || path[0] == '\0' || !path_safe(path)) continue;
+        if ((mode & 0700) == 0700) continue;
+
+        // fchmodat() would follow a symlink put in place of the directory
+        const char *name;
+        int parent = parent_open(dir_fd, path, &name);
+        if (parent < 0) return -1;
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(parent);
+        if (fd < 0) return -1;
+        int changed = fchmod(fd, mode);
+        close(fd);
+        if (changed < 0) return -1;
+    }
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b, void *arg) {
+    const tar_archive_t *ar = arg;
+    uint64_t x = ar->offsets[*(const uint32_t *)a], y = ar->offsets[*(const uint32_t *)b];
+    return x < y ? -1 : x > y;
+}
+
+static int extract(tar_archive_t *ar, const char *dest_dir, int nthreads) {
+    if (mkdir(dest_dir, 0755) < 0 && errno != EEXIST) return -1;
+    int dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+
+    struct extract_job job = {.ar = ar, .dir_fd = dir_fd};
+    job.files = malloc((ar->no_entries ? ar->no_entries : 1) * sizeof(uint32_t));
+    if (job.files == NULL) { close(dir_fd); return -1; }
+
+    // sorted by offset, which keeps the reads of every worker sequential
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        if (entry_is_file(ar, id) && path_safe(entry_path(ar, id))) job.files[job.no_files++] = id;
+    }
+    qsort_r(job.files, job.no_files, sizeof(uint32_t), compare_offsets, (void *)ar);
+
+    int ret = extract_dirs(ar, dir_fd);
+    if (ret == 0) {
+        if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        uint32_t no_batches = (job.no_files + EXTRACT_BATCH - 1) / EXTRACT_BATCH;
+        if (nthreads > no_batches) nthreads = no_batches;
+        if (nthreads < 1) nthreads = 1;
+
+        pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+        if (threads == NULL) {
+            ret = -1;
+        } else {
+            int started = 1;
+            for (; started < nthreads; started++) {
+                if (pthread_create(&threads[started], NULL, extract_worker, &job) != 0) break;
+            }
+            extract_worker(&job); // the calling thread works too
+            for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+            free(threads);
+            ret = job.error ? -1 : 0;
+        }
+    }
+    if (ret == 0) ret = extract_links(ar, dir_fd);
+    if (ret == 0) ret = extract_modes(ar, dir_fd);
+
+    free(job.files);
+    close(dir_fd);
+    return ret;
+}
+
+int tar_extract(tar_archive_t *ar, const char *dest_dir, int nthreads) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_EXTRACT, dest_dir);
+    int ret = extract(ar, dest_dir, nthreads);
+    tar_stats_end(&scope);
+    return ret;
+}
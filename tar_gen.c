@@ -0,0 +1,151 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lib_tar.h"
+
+/**
+ * Generates synthetic archives for the benchmarks.
+ *
+ * The files are spread over a tree of directories of a given depth, a given number of files per directory. Every
+ * directory is written before its files, as tar does.
+ */
+
+struct gen_options {
+    uint64_t no_entries;        // files and symlinks, the directories come on top
+    uint32_t per_dir;           // files and symlinks per directory
+    uint32_t depth;             // depth of the directory tree
+    double symlink_ratio;       // share of the entries which are symlinks
+    char dist[16];              // size distribution: fixed, uniform or lognormal
+    double size_a, size_b;      // its parameters
+    uint64_t seed;
+};
+
+static uint64_t rng_state;
+
+/* xorshift64*, good enough and the same on every machine for a given seed */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double rng_unit(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Draws the size of a file from the size distribution.
+ */
+static size_t gen_size(const struct gen_options *opt) {
+    double size = opt->size_a;
+    if (strcmp(opt->dist, "uniform") == 0) {
+        size = opt->size_a + rng_unit() * (opt->size_b - opt->size_a);
+    } else if (strcmp(opt->dist, "lognormal") == 0) {
+        // size_a is the median, size_b the standard deviation of the logarithm
+        double u = rng_unit(), v = rng_unit();
+        double normal = sqrt(-2.0 * log(u > 0 ? u : 1e-300)) * cos(2 * M_PI * v);
+        size = opt->size_a * exp(opt->size_b * normal);
+    }
+    return size < 0 ? 0 : size;
+}
+
+/**
+ * Writes the path of directory k in a tree where every directory has fanout subdirectories, numbered breadth
+ * first from the root 0.
+ */
+static void dir_path(uint64_t k, uint64_t fanout, char *path) {
+    if (k == 0) {
+        path[0] = '\0';
+        return;
+    }
+    dir_path((k - 1) / fanout, fanout, path);
+    sprintf(path + strlen(path), "d%llu/", (unsigned long long)((k - 1) % fanout));
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n entries] [-p per_dir] [-d depth] [-l symlink_ratio] [-s dist:a[:b]] [-S seed] "
+                    "out.tar\n", name);
+    fprintf(stderr, "  dist is fixed:size, uniform:min:max or lognormal:median:sigma (default lognormal:4096:1.5)\n");
+}
+
+int main(int argc, char **argv) {
+    struct gen_options opt = {100000, 100, 3, 0.05, "lognormal", 4096, 1.5, 42};
+    int c;
+    while ((c = getopt(argc, argv, "n:p:d:l:s:S:")) != -1) {
+        switch (c) {
+            case 'n': opt.no_entries = strtoull(optarg, NULL, 10); break;
+            case 'p': opt.per_dir = strtoul(optarg, NULL, 10); break;
+            case 'd': opt.depth = strtoul(optarg, NULL, 10); break;
+            case 'l': opt.symlink_ratio = strtod(optarg, NULL); break;
+            case 's':
+                if (sscanf(optarg, "%15[a-z]:%lf:%lf", opt.dist, &opt.size_a, &opt.size_b) < 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'S': opt.seed = strtoull(optarg, NULL, 10); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || opt.per_dir == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    rng_state = opt.seed ? opt.seed : 1;
+
+    // enough directories for the files, with the fanout giving the requested depth
+    uint64_t no_dirs = (opt.no_entries + opt.per_dir - 1) / opt.per_dir;
+    uint64_t fanout = opt.depth > 0 ? ceil(pow(no_dirs, 1.0 / opt.depth)) : 1;
+    if (fanout < 2) fanout = 2;
+
+    int out_fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    tar_writer_t *w = tar_writer_open(out_fd);
+
+    uint8_t *data = NULL;
+    size_t data_max = 0;
+    char dir[4096], path[4200];
+    uint64_t written = 0, bytes = 0;
+    int ret = 0;
+
+    for (uint64_t k = 0; ret == 0 && written < opt.no_entries; k++) {
+        dir_path(k, fanout, dir);
+        if (k > 0) ret |= tar_writer_add_dir(w, dir, 0755);
+
+        for (uint32_t j = 0; ret == 0 && j < opt.per_dir && written < opt.no_entries; j++, written++) {
+            sprintf(path, "%sf%u", dir, j);
+            if (j > 0 && rng_unit() < opt.symlink_ratio) {
+                char target[32];
+                sprintf(target, "f%u", j - 1); // relative to the directory, like most links
+                ret |= tar_writer_add_symlink(w, path, target);
+                continue;
+            }
+
+            size_t size = gen_size(&opt);
+            if (size > data_max) {
+                data = realloc(data, size);
+                for (size_t i = data_max; i < size; i++) data[i] = 'a' + i % 26;
+                data_max = size;
+            }
+            ret |= tar_writer_add_data(w, path, data, size, 0644);
+            bytes += size;
+        }
+    }
+
+    if (tar_writer_close(w) < 0 || ret != 0) {
+        fprintf(stderr, "%s: could not write the archive\n", argv[optind]);
+        return 1;
+    }
+    close(out_fd);
+    free(data);
+    fprintf(stderr, "%llu entries, %llu bytes of content\n", (unsigned long long)written, (unsigned long long)bytes);
+    return 0;
+}
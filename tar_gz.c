@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Random access into gzip-compressed archives.
+ *
+ * While the archive is decompressed once, a checkpoint is taken every span bytes of output at a deflate block
+ * boundary: the offsets in the compressed and the decompressed streams, the bits of the last byte already used and
+ * the 32 KiB of output preceding it, which is all inflate needs to restart there. A read then only decompresses
+ * from the checkpoint before it, at most span bytes away. The windows are kept deflated, which bounds the memory to
+ * a few KiB per checkpoint. This follows zran.c from the zlib examples.
+ */
+
+#define GZ_WINDOW 32768         // history needed by inflate
+#define GZ_CHUNK 65536          // compressed bytes read at once
+
+struct gz_point {
+    uint64_t in;                // offset in the compressed stream of the first complete byte
+    uint64_t out;               // offset in the decompressed stream
+    uint32_t bits;              // bits of the byte before in that belong to the point, zero to eight
+    uint32_t window_len;        // size of the deflated window
+    uint8_t *window;            // the GZ_WINDOW bytes before out, deflated
+};
+
+struct tar_gz {
+    struct gz_point *points;
+    uint32_t no_points;
+    uint32_t max_points;
+    uint64_t span;
+};
+
+void tar_gz_free(struct tar_gz *gz) {
+    if (gz == NULL) return;
+    for (uint32_t i = 0; i < gz->no_points; i++) free(gz->points[i].window);
+    free(gz->points);
+    free(gz);
+}
+
+/**
+ * Makes room for one more checkpoint.
+ */
+static int points_grow(struct tar_gz *gz) {
+    if (gz->no_points < gz->max_points) return 0;
+    uint32_t max_points = gz->max_points ? gz->max_points * 2 : 16;
+    struct gz_point *points = realloc(gz->points, max_points * sizeof(struct gz_point));
+    if (points == NULL) return -1;
+    gz->points = points;
+    gz->max_points = max_points;
+    return 0;
+}
+
+/**
+ * Adds a checkpoint, the circular output buffer holding the last GZ_WINDOW bytes from its position left onwards.
+ */
+static int add_point(struct tar_gz *gz, int bits, uint64_t in, uint64_t out, unsigned left, const uint8_t *window) {
+    if (points_grow(gz) < 0) return -1;
+
+    uint8_t history[GZ_WINDOW];
+    if (left) memcpy(history, window + GZ_WINDOW - left, left);
+    if (left < GZ_WINDOW) memcpy(history + left, window, GZ_WINDOW - left);
+
+    uint8_t deflated[GZ_WINDOW + GZ_WINDOW / 64 + 64]; // more than compressBound(GZ_WINDOW)
+    uLongf window_len = sizeof(deflated);
+    if (compress2(deflated, &window_len, history, GZ_WINDOW, 1) != Z_OK) return -1;
+
+    struct gz_point *point = &gz->points[gz->no_points];
+    point->window = malloc(window_len);
+    if (point->window == NULL) return -1;
+    memcpy(point->window, deflated, window_len);
+    point->in = in;
+    point->out = out;
+    point->bits = bits;
+    point->window_len = window_len;
+    gz->no_points++;
+    return 0;
+}
+
+struct tar_gz *tar_gz_build(int fd, uint64_t span,
+                            int (*consume)(void *ctx, const uint8_t *buf, size_t len, uint64_t offset), void *ctx) {
+    struct tar_gz *gz = calloc(1, sizeof(struct tar_gz));
+    uint8_t *input = malloc(GZ_CHUNK);
+    uint8_t *window = calloc(1, GZ_WINDOW);
+    z_stream strm = {0};
+    if (gz == NULL || input == NULL || window == NULL || inflateInit2(&strm, 47) != Z_OK) { // gzip or zlib header
+        free(input);
+        free(window);
+        tar_gz_free(gz);
+        return NULL;
+    }
+    gz->span = span;
+
+    uint64_t in_offset = 0;     // compressed bytes read from the file
+    uint64_t total_in = 0, total_out = 0, last = 0;
+    int ret = Z_OK, stop = 0;
+
+    while (ret != Z_STREAM_END && !stop) {
+        ssize_t r = pread(fd, input, GZ_CHUNK, in_offset);
+        if (r <= 0) { ret = Z_DATA_ERROR; break; } // read error or truncated stream
+        tar_stats_read(in_offset, r, 1);
+        in_offset += r;
+        strm.avail_in = r;
+        strm.next_in = input;
+
+        while (strm.avail_in != 0 && !stop) {
+            if (strm.avail_out == 0) {
+                strm.avail_out = GZ_WINDOW;
+                strm.next_out = window;
+            }
+
+            uint8_t *produced = strm.next_out;
+            total_in += strm.avail_in;
+            total_out += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK); // stops at the end of every deflate block
+            total_in -= strm.avail_in;
+            total_out -= strm.avail_out;
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) break;
+
+            size_t len = strm.next_out - produced;
+            if (len > 0 && consume(ctx, produced, len, total_out - len) != 0) stop = 1;
+            if (ret == Z_STREAM_END) break;
+
+            // at the end of a block which is not the last one
+            if ((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > span)) {
+                if (add_point(gz, strm.data_type & 7, total_in, total_out, strm.avail_out, window) < 0) {
+                    ret = Z_MEM_ERROR;
+                    break;
+                }
+                last = total_out;
+            }
+        }
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) break;
+    }
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    if (!stop && ret != Z_STREAM_END) { tar_gz_free(gz); return NULL; }
+    return gz;
+}
+
+int tar_gz_stream(const struct tar_gz *gz, int fd, uint64_t offset, uint64_t end,
+                  int (*consume)(void *ctx, const uint8_t *buf, size_t len, uint64_t offset), void *ctx) {
+    if (offset >= end || gz->no_points == 0) return 0;
+
+    // the last checkpoint at or before the offset
+    uint32_t lo = 0, hi = gz->no_points;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (gz->points[mid].out <= offset) lo = mid;
+        else hi = mid;
+    }
+    const struct gz_point *point = &gz->points[lo];
+    if (point->out > offset) return 0;
+
+    uint8_t *input = malloc(GZ_CHUNK);
+    uint8_t *output = malloc(GZ_CHUNK);
+    z_stream strm = {0};
+    if (input == NULL || output == NULL || inflateInit2(&strm, -15) != Z_OK) { // raw deflate
+        free(input);
+        free(output);
+        return -1;
+    }
+
+    int ret = -1;
+    uint64_t in_offset = point->in;
+    uint8_t history[GZ_WINDOW];
+    uLongf history_len = GZ_WINDOW;
+    if (uncompress(history, &history_len, point->window, point->window_len) != Z_OK) goto out;
+
+    if (point->bits) {
+        uint8_t byte;
+        if (pread(fd, &byte, 1, point->in - 1) != 1) goto out;
+        tar_stats_read(point->in - 1, 1, 1);
+        inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    inflateSetDictionary(&strm, history, GZ_WINDOW);
+
+    uint64_t pos = point->out; // offset of the next byte inflated
+    int z = Z_OK;
+    while (pos < end && z != Z_STREAM_END) {
+        if (strm.avail_in == 0) {
+            ssize_t r = pread(fd, input, GZ_CHUNK, in_offset);
+            if (r < 0) goto out;
+            tar_stats_read(in_offset, r, 1);
+            if (r == 0) break; // truncated stream
+            in_offset += r;
+            strm.avail_in = r;
+            strm.next_in = input;
+        }
+
+        strm.next_out = output;
+        strm.avail_out = GZ_CHUNK;
+        z = inflate(&strm, Z_NO_FLUSH);
+        if (z == Z_NEED_DICT || z == Z_DATA_ERROR || z == Z_MEM_ERROR) goto out;
+
+        // hand over the part of the output inside the range
+        uint64_t start = pos;
+        pos += GZ_CHUNK - strm.avail_out;
+        uint64_t first = start > offset ? start : offset;
+        uint64_t last = pos < end ? pos : end;
+        if (first < last) {
+            int c = consume(ctx, output + (first - start), last - first, first);
+            if (c < 0) goto out;
+            if (c > 0) break;
+        }
+    }
+    ret = 0;
+
+out:
+    inflateEnd(&strm);
+    free(input);
+    free(output);
+    return ret;
+}
+
+/* Context of tar_gz_read(), copying the stream to the caller buffer. */
+struct gz_copy {
+    uint8_t *buf;
+    uint64_t offset;
+    size_t done;
+};
+
+static int copy_visit(void *ctx, const uint8_t *buf, size_t len, uint64_t offset) {
+    struct gz_copy *copy = ctx;
+    memcpy(copy->buf + (offset - copy->offset), buf, len);
+    copy->done += len;
+    return 0;
+}
+
+ssize_t tar_gz_read(const struct tar_gz *gz, int fd, void *buf, size_t len, uint64_t offset) {
+    struct gz_copy copy = {buf, offset, 0};
+    if (tar_gz_stream(gz, fd, offset, offset + len, copy_visit, &copy) < 0) return -1;
+    return copy.done;
+}
+
+/*
+ * Saved checkpoints: the number of checkpoints and the span, then for every checkpoint its in, out, bits and
+ * window_len fields followed by the deflated window.
+ */
+
+int tar_gz_save(const struct tar_gz *gz, int fd) {
+    uint64_t head[2] = {gz->no_points, gz->span};
+    if (tar_write_full(fd, head, sizeof(head)) < 0) return -1;
+
+    for (uint32_t i = 0; i < gz->no_points; i++) {
+        const struct gz_point *point = &gz->points[i];
+        uint64_t fields[3] = {point->in, point->out, ((uint64_t)point->bits << 32) | point->window_len};
+        if (tar_write_full(fd, fields, sizeof(fields)) < 0) return -1;
+        if (tar_write_full(fd, point->window, point->window_len) < 0) return -1;
+    }
+    return 0;
+}
+
+struct tar_gz *tar_gz_load(const uint8_t *data, size_t size, size_t *used) {
+    uint64_t head[2];
+    if (size < sizeof(head)) return NULL;
+    memcpy(head, data, sizeof(head));
+
+    struct tar_gz *gz = calloc(1, sizeof(struct tar_gz));
+    if (gz == NULL) return NULL;
+    gz->span = head[1];
+
+    size_t pos = sizeof(head);
+    for (uint64_t i = 0; i < head[0]; i++) {
+        uint64_t fields[3];
+        if (size - pos < sizeof(fields)) goto fail;
+        memcpy(fields, data + pos, sizeof(fields));
+        pos += sizeof(fields);
+
+        uint32_t window_len = (uint32_t)fields[2];
+        if (size - pos < window_len || (fields[2] >> 32) > 8) goto fail;
+
+        if (points_grow(gz) < 0) goto fail;
+        struct gz_point *point = &gz->points[gz->no_points];
+        point->window = malloc(window_len ? window_len : 1);
+        if (point->window == NULL) goto fail;
+        memcpy(point->window, data + pos, window_len);
+        pos += window_len;
+
+        point->in = fields[0];
+        point->out = fields[1];
+        point->bits = fields[2] >> 32;
+        point->window_len = window_len;
+        gz->no_points++;
+    }
+
+    *used = pos;
+    return gz;
+
+fail:
+    tar_gz_free(gz);
+    return NULL;
+}
@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib_tar.h"
+#include "tar_remote.h"
+
+/**
+ * Load generator of tar_server.
+ *
+ * Every connection is a thread sending its next query as soon as the last one was answered, on paths sampled from
+ * the archive, for a given duration. The requests per second and the latency percentiles of every query are
+ * reported at the end.
+ *
+ * The paths are sampled from a handle opened here on the same archive, walking its directory tree from the root.
+ */
+
+#define SAMPLES 4096                // paths kept of every kind
+#define READ_MAX (1 << 20)          // bytes read at most by a read query
+#define MAX_LIST 256                // entries listed at most by a list query
+#define ENTRY_MAX 4097              // size of the buffer of every entry listed
+
+enum load_op { OP_EXISTS, OP_IS_FILE, OP_STAT, OP_LIST, OP_READ, NO_OPS };
+
+static const char *op_names[NO_OPS] = {"exists", "is_file", "stat", "list", "read"};
+
+struct samples {
+    char *paths[SAMPLES];
+    uint32_t len;
+    uint64_t seen;
+};
+
+static struct samples files, dirs;
+
+/* Latencies of one query measured by one connection, in microseconds. */
+struct latencies {
+    double *values;
+    uint64_t len, max;
+    uint64_t bytes;
+    uint64_t errors;
+};
+
+struct worker {
+    pthread_t thread;
+    const char *socket_path;
+    const char *archive;
+    int flags;
+    const int *ops;             // the queries sent, in turn
+    int no_ops;
+    double end;                 // time the worker stops at
+    uint64_t seed;
+    struct latencies lat[NO_OPS];
+    int failed;
+};
+
+static uint64_t rng_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void sample_add(struct samples *s, const char *path, uint64_t *rng) {
+    s->seen++;
+    if (s->len < SAMPLES) {
+        s->paths[s->len++] = strdup(path);
+        return;
+    }
+    uint64_t slot = rng_next(rng) % s->seen;
+    if (slot < SAMPLES) {
+        free(s->paths[slot]);
+        s->paths[slot] = strdup(path);
+    }
+}
+
+/**
+ * Samples the files and directories below a directory of the archive.
+ */
+static void collect_samples(tar_archive_t *ar, char *dir, uint64_t *rng) {
+    tar_cursor_t cursor;
+    if (!tar_list_begin(ar, dir, &cursor)) return;
+    sample_add(&dirs, dir, rng);
+
+    const char *entry;
+    while ((entry = tar_list_next(&cursor)) != NULL) {
+        char *path = strdup(entry);
+        if (tar_is_dir(ar, path)) collect_samples(ar, path, rng);
+        else if (tar_is_file(ar, path)) sample_add(&files, path, rng);
+        free(path);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void latency_add(struct latencies *l, double us) {
+    if (l->len == l->max) {
+        l->max = l->max ? l->max * 2 : 4096;
+        l->values = realloc(l->values, l->max * sizeof(double));
+    }
+    l->values[l->len++] = us;
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    tar_remote_t *r = tar_remote_open(w->socket_path, w->archive, w->flags);
+    if (r == NULL) {
+        w->failed = 1;
+        return NULL;
+    }
+
+    uint8_t *buffer = malloc(READ_MAX);
+    char **entries = malloc(MAX_LIST * sizeof(char *));
+    for (int i = 0; i < MAX_LIST; i++) entries[i] = malloc(ENTRY_MAX);
+
+    for (uint64_t i = 0; now() < w->end && tar_remote_error(r) == 0; i++) {
+        int op = w->ops[i % w->no_ops];
+        const struct samples *s = (op == OP_LIST) ? &dirs : &files;
+        char *path = s->paths[rng_next(&w->seed) % s->len];
+        size_t len = READ_MAX, no_entries = MAX_LIST;
+        tar_lookup_t st;
+        int ok = 1;
+
+        double start = now();
+        switch (op) {
+            case OP_EXISTS: ok = tar_remote_exists(r, path); break;
+            case OP_IS_FILE: ok = tar_remote_is_file(r, path); break;
+            case OP_STAT: ok = tar_remote_stat(r, path, &st); break;
+            case OP_LIST: ok = tar_remote_list(r, path, entries, &no_entries); break;
+            case OP_READ: ok = tar_remote_read_file(r, path, 0, buffer, &len) >= 0; break;
+        }
+        latency_add(&w->lat[op], (now() - start) * 1e6);
+        if (!ok) w->lat[op].errors++;
+        else if (op == OP_READ) w->lat[op].bytes += len;
+    }
+    if (tar_remote_error(r) != 0) w->failed = 1;
+
+    for (int i = 0; i < MAX_LIST; i++) free(entries[i]);
+    free(entries);
+    free(buffer);
+    tar_remote_close(r);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, uint64_t len, double p) {
+    uint64_t i = p * len;
+    return sorted[i < len ? i : len - 1];
+}
+
+/**
+ * Merges the latencies of a query measured by every connection, sorted.
+ */
+static struct latencies merge(struct worker *workers, int nworkers, int op) {
+    struct latencies all = {0};
+    for (int i = 0; i < nworkers; i++) {
+        const struct latencies *l = &workers[i].lat[op];
+        for (uint64_t j = 0; j < l->len; j++) latency_add(&all, l->values[j]);
+        all.bytes += l->bytes;
+        all.errors += l->errors;
+    }
+    if (all.len > 0) qsort(all.values, all.len, sizeof(double), compare_doubles);
+    return all;
+}
+
+static void print_result(const char *format, const char *op, const struct latencies *l, double seconds, int first) {
+    double mean = 0;
+    for (uint64_t i = 0; i < l->len; i++) mean += l->values[i];
+    mean /= l->len;
+    double rps = l->len / seconds, mbps = l->bytes / seconds / 1e6;
+    double p50 = percentile(l->values, l->len, 0.5), p90 = percentile(l->values, l->len, 0.9);
+    double p99 = percentile(l->values, l->len, 0.99), p999 = percentile(l->values, l->len, 0.999);
+    double max = l->values[l->len - 1];
+
+    if (strcmp(format, "json") == 0) {
+        printf("%s    {\"op\": \"%s\", \"requests\": %llu, \"errors\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+               "\"p90_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, \"requests_per_s\": %.1f, "
+               "\"mb_per_s\": %.3f}", first ? "" : ",\n", op, (unsigned long long)l->len,
+               (unsigned long long)l->errors, mean, p50, p90, p99, p999, max, rps, mbps);
+    } else if (strcmp(format, "csv") == 0) {
+        printf("%s,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%.3f\n", op, (unsigned long long)l->len,
+               (unsigned long long)l->errors, mean, p50, p90, p99, p999, max, rps, mbps);
+    } else {
+        printf("%-8s %10llu %7llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %12.1f %9.1f\n", op,
+               (unsigned long long)l->len, (unsigned long long)l->errors, mean, p50, p90, p99, p999, max, rps, mbps);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-o op[,op...]] [-C] [-f text|json|csv] socket "
+                    "archive.tar[.gz]\n", name);
+    fprintf(stderr, "  op is exists, is_file, stat, list or read (default exists,stat,read)\n");
+}
+
+int main(int argc, char **argv) {
+    int nworkers = 4, flags = 0;
+    double duration = 5;
+    const char *format = "text", *only = "exists,stat,read";
+    int c;
+
+    while ((c = getopt(argc, argv, "c:d:o:Cf:")) != -1) {
+        switch (c) {
+            case 'c': nworkers = strtol(optarg, NULL, 10); break;
+            case 'd': duration = strtod(optarg, NULL); break;
+            case 'o': only = optarg; break;
+            case 'C': flags |= TAR_REMOTE_COPY; break;
+            case 'f': format = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 2 || nworkers < 1 || duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *socket_path = argv[optind], *archive = argv[optind + 1];
+
+    int ops[NO_OPS], no_ops = 0;
+    char *list = strdup(only);
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int op = 0;
+        while (op < NO_OPS && strcmp(op_names[op], name) != 0) op++;
+        if (op == NO_OPS) {
+            usage(argv[0]);
+            return 1;
+        }
+        ops[no_ops++] = op;
+    }
+    free(list);
+
+    int fd = open(archive, O_RDONLY);
+    size_t len = strlen(archive);
+    int gz = len > 3 && strcmp(archive + len - 3, ".gz") == 0;
+    tar_archive_t *ar = fd < 0 ? NULL : gz ? tar_open_gz(fd, 0) : tar_open(fd);
+    if (ar == NULL) {
+        fprintf(stderr, "%s: not a valid archive\n", archive);
+        return 1;
+    }
+    uint64_t rng = 88172645463325252ull;
+    collect_samples(ar, "", &rng);
+    tar_close(ar);
+    close(fd);
+    if (files.len == 0) {
+        fprintf(stderr, "%s: no file to query\n", archive);
+        return 1;
+    }
+
+    struct worker *workers = calloc(nworkers, sizeof(struct worker));
+    double start = now();
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = (struct worker){.socket_path = socket_path, .archive = archive, .flags = flags, .ops = ops,
+                                     .no_ops = no_ops, .end = start + duration, .seed = rng_next(&rng) | 1};
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        failed |= workers[i].failed;
+    }
+    double seconds = now() - start;
+    if (failed) fprintf(stderr, "%s: a connection to the daemon failed\n", socket_path);
+
+    if (strcmp(format, "json") == 0) {
+        printf("{\n  \"archive\": \"%s\", \"connections\": %d, \"seconds\": %.3f, \"copy\": %s,\n  \"results\": [\n",
+               archive, nworkers, seconds, flags & TAR_REMOTE_COPY ? "true" : "false");
+    } else if (strcmp(format, "csv") == 0) {
+        printf("op,requests,errors,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,requests_per_s,mb_per_s\n");
+    } else {
+        printf("%s: %d connections, %.1f s%s\n", archive, nworkers, seconds,
+               flags & TAR_REMOTE_COPY ? ", data copied through the socket" : "");
+        printf("%-8s %10s %7s %10s %10s %10s %10s %10s %10s %12s %9s\n", "op", "requests", "errors", "mean_us",
+               "p50_us", "p90_us", "p99_us", "p999_us", "max_us", "requests/s", "MB/s");
+    }
+
+    int first = 1;
+    struct latencies total = {0};
+    for (int op = 0; op < NO_OPS; op++) {
+        struct latencies l = merge(workers, nworkers, op);
+        if (l.len == 0) continue;
+        print_result(format, op_names[op], &l, seconds, first);
+        first = 0;
+        for (uint64_t i = 0; i < l.len; i++) latency_add(&total, l.values[i]);
+        total.bytes += l.bytes;
+        total.errors += l.errors;
+        free(l.values);
+    }
+    if (total.len > 0) {
+        qsort(total.values, total.len, sizeof(double), compare_doubles);
+        print_result(format, "all", &total, seconds, first);
+    }
+    if (strcmp(format, "json") == 0) printf("\n  ]\n}\n");
+
+    free(total.values);
+    for (int i = 0; i < nworkers; i++) {
+        for (int op = 0; op < NO_OPS; op++) free(workers[i].lat[op].values);
+    }
+    free(workers);
+    return failed;
+}
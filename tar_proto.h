@@ -0,0 +1,51 @@
+#ifndef TAR_PROTO_H
+#define TAR_PROTO_H
+
+/*
+ * Protocol between tar_server and the client library of tar_remote.h, over a Unix stream socket. Not part of the API.
+ *
+ * A client sends a request and waits for its reply; requests may also be pipelined, the replies coming back in the
+ * same order. Every request is a struct tar_proto_req followed by its path, not null-terminated. Every reply is a
+ * struct tar_proto_rep followed by rep.payload bytes: the data of a PROTO_READ or the null-terminated paths of a
+ * PROTO_LIST. Both ends share the machine, so the integers are in its byte order.
+ */
+
+#include <stdint.h>
+
+#define TAR_PROTO_MAX_PATH 4096         // longest path of a request
+#define TAR_PROTO_MAX_COPY (1 << 20)    // bytes of a PROTO_READ copied at most by a reply, when not sent by sendfile()
+
+enum tar_proto_op {
+    PROTO_OPEN,         // path: the archive, ret: its number or -1; the descriptor of the archive comes along with
+                        // the first byte of the reply when it can be read directly (flags & PROTO_FD)
+    PROTO_EXISTS,       // ret: tar_exists()
+    PROTO_IS_DIR,       // ret: tar_is_dir()
+    PROTO_IS_FILE,      // ret: tar_is_file()
+    PROTO_IS_SYMLINK,   // ret: tar_is_symlink()
+    PROTO_STAT,         // ret: tar_stat(), with typeflag, size and offset
+    PROTO_LIST,         // len: entries wanted, ret: tar_list_begin(), size: entries in the payload
+    PROTO_READ,         // offset and len as for tar_read_file(), ret: its return value, payload: the bytes read
+    PROTO_NO_OPS
+};
+
+#define PROTO_FD 0x1            // PROTO_OPEN: the descriptor of the archive was passed
+
+struct tar_proto_req {
+    uint32_t size;              // size of the request, path included
+    uint16_t op;
+    uint16_t archive;           // number of the archive given by PROTO_OPEN
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct tar_proto_rep {
+    int64_t ret;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t payload;           // bytes following the reply
+    char typeflag;
+    uint8_t flags;              // PROTO_* values
+    uint16_t unused;
+};
+
+#endif
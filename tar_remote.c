@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include "tar_remote.h"
+#include "lib_tar_private.h"
+#include "tar_proto.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/*
+ * Client of tar_server.
+ *
+ * Every query is a request and its reply on the connection. A read with the descriptor of the archive is a
+ * PROTO_STAT and a pread() of the archive; without it, a PROTO_READ whose data the daemon sends with sendfile().
+ */
+
+struct tar_remote {
+    int sock;
+    uint16_t archive;           // number of the archive in the daemon
+    int fd;                     // descriptor of the archive passed by the daemon, -1 if the data comes over the socket
+    int error;                  // errno of the failure which broke the connection, every later query fails
+};
+
+static void fail(tar_remote_t *r, int error) {
+    if (r->error == 0) r->error = error ? error : EPROTO;
+}
+
+/**
+ * Receives len bytes, taking the descriptor coming along with them if fd is not NULL.
+ */
+static int recv_full(tar_remote_t *r, void *buf, size_t len, int *fd) {
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    while (len > 0) {
+        struct iovec iov = {buf, len};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        if (fd != NULL) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+        }
+
+        ssize_t n = recvmsg(r->sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fail(r, n < 0 ? errno : ECONNRESET);
+            return -1;
+        }
+
+        if (fd != NULL) {
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+            fd = NULL; // only comes with the first byte
+        }
+        buf = (uint8_t *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sends a request and receives the header of its reply, the payload being left on the socket.
+ *
+ * @return zero on success, -1 if the connection broke.
+ */
+static int call(tar_remote_t *r, int op, const char *path, uint64_t offset, uint64_t len, struct tar_proto_rep *rep,
+                int *fd) {
+    if (r->error) return -1;
+
+    size_t path_len = strlen(path);
+    if (path_len > TAR_PROTO_MAX_PATH) {
+        // no entry can have such a path, the daemon is not asked
+        memset(rep, 0, sizeof(*rep));
+        rep->ret = (op == PROTO_OPEN || op == PROTO_READ) ? -1 : 0;
+        return 0;
+    }
+
+    struct tar_proto_req req = {sizeof(req) + path_len, op, r->archive, offset, len};
+    struct iovec iov[2] = {{&req, sizeof(req)}, {(void *)path, path_len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    size_t left = req.size;
+    while (left > 0) {
+        ssize_t n = sendmsg(r->sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fail(r, errno);
+            return -1;
+        }
+
+        // a short send: skip what went
+        left -= n;
+        while (n > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (n > 0) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return recv_full(r, rep, sizeof(*rep), fd);
+}
+
+/**
+ * Discards the payload of a reply which was not wanted.
+ */
+static int skip(tar_remote_t *r, size_t len) {
+    uint8_t buf[4096];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (recv_full(r, buf, n, NULL) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+tar_remote_t *tar_remote_open(const char *socket_path, const char *archive_path, int flags) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return NULL;
+    strcpy(addr.sun_path, socket_path);
+
+    tar_remote_t *r = calloc(1, sizeof(tar_remote_t));
+    if (r == NULL) return NULL;
+    r->fd = -1;
+    r->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->sock < 0 || connect(r->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        tar_remote_close(r);
+        return NULL;
+    }
+
+    struct tar_proto_rep rep;
+    if (call(r, PROTO_OPEN, archive_path, 0, 0, &rep, &r->fd) < 0 || rep.ret < 0) {
+        tar_remote_close(r);
+        return NULL;
+    }
+    r->archive = rep.ret;
+
+    if (r->fd >= 0 && ((flags & TAR_REMOTE_COPY) || !(rep.flags & PROTO_FD))) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    return r;
+}
+
+void tar_remote_close(tar_remote_t *r) {
+    if (r == NULL) return;
+    if (r->sock >= 0) close(r->sock);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+int tar_remote_error(const tar_remote_t *r) {
+    return r->error;
+}
+
+/**
+ * Asks a query answered by the return value alone.
+ */
+static int query(tar_remote_t *r, int op, char *path) {
+    struct tar_proto_rep rep;
+    if (call(r, op, path, 0, 0, &rep, NULL) < 0) return 0;
+    return rep.ret;
+}
+
+int tar_remote_exists(tar_remote_t *r, char *path) {
+    return query(r, PROTO_EXISTS, path);
+}
+
+int tar_remote_is_dir(tar_remote_t *r, char *path) {
+    return query(r, PROTO_IS_DIR, path);
+}
+
+int tar_remote_is_file(tar_remote_t *r, char *path) {
+    return query(r, PROTO_IS_FILE, path);
+}
+
+int tar_remote_is_symlink(tar_remote_t *r, char *path) {
+    return query(r, PROTO_IS_SYMLINK, path);
+}
+
+int tar_remote_stat(tar_remote_t *r, char *path, tar_lookup_t *st) {
+    struct tar_proto_rep rep;
+    memset(st, 0, sizeof(*st));
+    if (call(r, PROTO_STAT, path, 0, 0, &rep, NULL) < 0 || rep.ret == 0) return 0;
+
+    st->found = 1;
+    st->typeflag = rep.typeflag;
+    st->size = rep.size;
+    st->offset = rep.offset;
+    return 1;
+}
+
+int tar_remote_list(tar_remote_t *r, char *path, char **entries, size_t *no_entries) {
+    struct tar_proto_rep rep;
+    if (call(r, PROTO_LIST, path, 0, *no_entries, &rep, NULL) < 0) {
+        *no_entries = 0;
+        return 0;
+    }
+
+    char *names = malloc(rep.payload ? rep.payload : 1);
+    if (names == NULL) {
+        skip(r, rep.payload);
+        *no_entries = 0;
+        return rep.ret;
+    }
+    if (recv_full(r, names, rep.payload, NULL) < 0) {
+        free(names);
+        *no_entries = 0;
+        return 0;
+    }
+
+    size_t n = 0;
+    for (const char *name = names; name < names + rep.payload && n < *no_entries; name += strlen(name) + 1) {
+        entry_copy(entries[n++], name);
+    }
+    *no_entries = n;
+    free(names);
+    return rep.ret;
+}
+
+/**
+ * Reads a file directly from the descriptor of the archive, at the offset the daemon answers.
+ */
+static ssize_t read_direct(tar_remote_t *r, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    tar_lookup_t st;
+    if (!tar_remote_stat(r, path, &st) || (st.typeflag != REGTYPE && st.typeflag != AREGTYPE)) return -1;
+    if (offset > st.size) return -2;
+
+    if (st.size - offset < *len) *len = st.size - offset;
+    ssize_t n = tar_pread_full(r->fd, dest, *len, st.offset + offset);
+    if (n < 0) return -1;
+    *len = n;
+    return (st.size - offset) - *len;
+}
+
+ssize_t tar_remote_read_file(tar_remote_t *r, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    if (r->fd >= 0) return read_direct(r, path, offset, dest, len);
+
+    // a reply carries a bounded number of bytes, a larger read takes several
+    size_t done = 0;
+    ssize_t ret;
+    do {
+        struct tar_proto_rep rep;
+        if (call(r, PROTO_READ, path, offset + done, *len - done, &rep, NULL) < 0) return -1;
+        ret = rep.ret;
+        if (ret < 0) break;
+        if (recv_full(r, dest + done, rep.payload, NULL) < 0) return -1;
+        done += rep.payload;
+        if (rep.payload == 0) break;
+    } while (ret > 0 && done < *len);
+
+    if (ret < 0 && done == 0) return ret;
+    *len = done;
+    return ret < 0 ? -1 : ret;
+}
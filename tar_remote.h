@@ -0,0 +1,80 @@
+#ifndef TAR_REMOTE_H
+#define TAR_REMOTE_H
+
+#include "lib_tar.h"
+
+/**
+ * An archive served by tar_server, queried over its Unix domain socket.
+ *
+ * The queries take the same arguments and give the same answers as the tar_* queries of lib_tar.h on a handle, but
+ * the archive is indexed once by the daemon for all the processes of the machine. When the daemon passes the
+ * descriptor of the archive, the files are read directly from it at the offsets it answers, without being copied
+ * through the socket. A handle is a single connection: it must not be used by several threads at the same time.
+ *
+ * If the connection breaks, every query answers as if the entry were missing and tar_remote_error() tells why.
+ */
+typedef struct tar_remote tar_remote_t;
+
+#define TAR_REMOTE_COPY 0x1     /* have the daemon send the file data over the socket instead of reading it here */
+
+/**
+ * Connects to a daemon and opens one of the archives it serves.
+ *
+ * @param socket_path The path of the socket of the daemon.
+ * @param archive_path The path of the archive, as given to the daemon or any other path to the same file.
+ * @param flags Zero or TAR_REMOTE_COPY.
+ *
+ * @return a handle, or NULL if the daemon could not be reached or does not serve the archive.
+ */
+tar_remote_t *tar_remote_open(const char *socket_path, const char *archive_path, int flags);
+
+/**
+ * Closes the connection and releases the handle.
+ *
+ * @param r A handle returned by tar_remote_open(), or NULL.
+ */
+void tar_remote_close(tar_remote_t *r);
+
+/**
+ * Gives the error which broke the connection.
+ *
+ * @return zero while the connection works, an errno value once it broke.
+ */
+int tar_remote_error(const tar_remote_t *r);
+
+/**
+ * Same as tar_exists().
+ */
+int tar_remote_exists(tar_remote_t *r, char *path);
+
+/**
+ * Same as tar_is_dir().
+ */
+int tar_remote_is_dir(tar_remote_t *r, char *path);
+
+/**
+ * Same as tar_is_file().
+ */
+int tar_remote_is_file(tar_remote_t *r, char *path);
+
+/**
+ * Same as tar_is_symlink().
+ */
+int tar_remote_is_symlink(tar_remote_t *r, char *path);
+
+/**
+ * Same as tar_stat().
+ */
+int tar_remote_stat(tar_remote_t *r, char *path, tar_lookup_t *st);
+
+/**
+ * Same as tar_list().
+ */
+int tar_remote_list(tar_remote_t *r, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as tar_read_file().
+ */
+ssize_t tar_remote_read_file(tar_remote_t *r, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+#endif
@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Parallel content search.
+ *
+ * The regular files are cut into units of at most SEARCH_CHUNK bytes in archive order: runs of small files close
+ * to each other, or chunks of a large one, every chunk also reading the first bytes of the next so that no match
+ * across the cut is missed. A pool of threads takes the units in turn and scans them in place in the mapping of the
+ * archive, or in a buffer filled by a single read per unit. The scan keeps the candidates whose first and last bytes
+ * match the pattern, 32 positions at once with AVX2 or through memchr() otherwise, and only compares these to the
+ * pattern.
+ */
+
+#define SEARCH_CHUNK (4 << 20)      // bytes scanned by a worker at once
+#define SEARCH_GAP (64 * 1024)      // largest hole between two files of a run, such as a shadowed member
+
+/* A unit of work: files[first..first + no_files) whole, or the bytes [start, end) of the single file files[first]. */
+struct search_unit {
+    uint32_t first;
+    uint32_t no_files;
+    uint64_t start;
+    uint64_t end;
+};
+
+struct matcher {
+    const uint8_t *pattern;     // lowercase when the search ignores the case
+    size_t len;
+    int icase;
+    uint8_t first[2];           // the two spellings of the first byte of the pattern, the same byte twice if exact
+    uint8_t last[2];            // and of its last byte
+};
+
+struct search_job {
+    const tar_archive_t *ar;
+    struct matcher matcher;
+    const uint32_t *files;      // regular files, sorted by offset
+    struct search_unit *units;
+    uint32_t no_units;
+    uint32_t next;              // next unit to hand out, shared by the workers
+
+    tar_search_cb callback;
+    void *ctx;
+    pthread_mutex_t lock;       // held while the callback runs
+    int matches;
+    int stop;                   // set by the callback or by the first read error
+    int error;
+};
+
+static uint8_t fold(uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static int match_at(const struct matcher *m, const uint8_t *p) {
+    if (!m->icase) return memcmp(p, m->pattern, m->len) == 0;
+    for (size_t i = 0; i < m->len; i++) {
+        if (fold(p[i]) != m->pattern[i]) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Finds the first match starting in [p, end - len].
+ *
+ * @return its position, or NULL if there is none.
+ */
+static const uint8_t *find_scalar(const struct matcher *m, const uint8_t *p, const uint8_t *end) {
+    if ((size_t)(end - p) < m->len) return NULL;
+    const uint8_t *last = end - m->len;
+
+    if (!m->icase) {
+        while (p <= last && (p = memchr(p, m->pattern[0], last - p + 1)) != NULL) {
+            if (match_at(m, p)) return p;
+            p++;
+        }
+        return NULL;
+    }
+    for (; p <= last; p++) {
+        if ((*p == m->first[0] || *p == m->first[1]) && match_at(m, p)) return p;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const struct matcher *m, const uint8_t *p, const uint8_t *end) {
+    __m256i first_a = _mm256_set1_epi8(m->first[0]), first_b = _mm256_set1_epi8(m->first[1]);
+    __m256i last_a = _mm256_set1_epi8(m->last[0]), last_b = _mm256_set1_epi8(m->last[1]);
+
+    // the candidates of 32 positions at once: their first byte and the byte len - 1 further both match
+    while ((size_t)(end - p) >= m->len - 1 + 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)p);
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(p + m->len - 1));
+        __m256i heads = _mm256_or_si256(_mm256_cmpeq_epi8(head, first_a), _mm256_cmpeq_epi8(head, first_b));
+        __m256i tails = _mm256_or_si256(_mm256_cmpeq_epi8(tail, last_a), _mm256_cmpeq_epi8(tail, last_b));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(heads, tails));
+        while (mask != 0) {
+            const uint8_t *candidate = p + __builtin_ctz(mask);
+            if (match_at(m, candidate)) return candidate;
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    return find_scalar(m, p, end);
+}
+#endif
+
+static const uint8_t *(*find_kernel)(const struct matcher *, const uint8_t *, const uint8_t *);
+static pthread_once_t find_once = PTHREAD_ONCE_INIT;
+
+/* Picks the fastest matcher supported by the CPU. */
+static void find_init(void) {
+    find_kernel = find_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) find_kernel = find_avx2;
+#endif
+}
+
+/**
+ * Reports every match in the bytes [base, base + len) of a file, which start at from in the file.
+ */
+static void search_bytes(struct search_job *job, uint32_t id, const uint8_t *base, size_t len, uint64_t from) {
+    const uint8_t *end = base + len;
+    for (const uint8_t *p = base; !__atomic_load_n(&job->stop, __ATOMIC_RELAXED); p++) {
+        p = find_kernel(&job->matcher, p, end);
+        if (p == NULL) break;
+
+        pthread_mutex_lock(&job->lock);
+        if (!job->stop) {
+            job->matches++;
+            if (job->callback(job->ctx, entry_path(job->ar, id), from + (p - base)) != 0) {
+                __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/**
+ * Scans a unit, reading the whole range it covers at once unless the archive is mapped.
+ */
+static int search_unit(struct search_job *job, const struct search_unit *unit, uint8_t **buffer, size_t *buffer_max) {
+    const tar_archive_t *ar = job->ar;
+    uint32_t first = job->files[unit->first], last = job->files[unit->first + unit->no_files - 1];
+
+    // a chunk reads up to len - 1 bytes past its end, for the matches starting in it
+    uint64_t start = ar->offsets[first] + unit->start;
+    uint64_t end = ar->offsets[last] + unit->end;
+    if (unit->no_files == 1) {
+        uint64_t over = end + job->matcher.len - 1;
+        end = over < ar->offsets[first] + ar->sizes[first] ? over : ar->offsets[first] + ar->sizes[first];
+    }
+
+    const uint8_t *data;
+    if (ar->map != NULL) {
+        if (end > ar->map_size) return -1; // truncated archive
+        tar_stats_read(start, end - start, 0);
+        data = ar->map + start;
+    } else {
+        if (end - start > *buffer_max) {
+            uint8_t *grown = realloc(*buffer, end - start);
+            if (grown == NULL) return -1;
+            *buffer = grown;
+            *buffer_max = end - start;
+        }
+        if (tar_archive_read(ar, *buffer, end - start, start) != end - start) return -1;
+        data = *buffer;
+    }
+
+    if (unit->no_files == 1) {
+        search_bytes(job, first, data, end - start, unit->start);
+        return 0;
+    }
+    for (uint32_t i = unit->first; i < unit->first + unit->no_files; i++) {
+        uint32_t id = job->files[i];
+        search_bytes(job, id, data + (ar->offsets[id] - start), ar->sizes[id], 0);
+    }
+    return 0;
+}
+
+static void *search_worker(void *arg) {
+    struct search_job *job = arg;
+    uint8_t *buffer = NULL;
+    size_t buffer_max = 0;
+    struct tar_stats_scope scope;
+    tar_stats_join(&scope, (tar_archive_t *)job->ar, TAR_OP_SEARCH);
+
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        uint32_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->no_units) break;
+
+        if (search_unit(job, &job->units[i], &buffer, &buffer_max) < 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buffer);
+    tar_stats_end(&scope);
+    return NULL;
+}
+
+static int compare_offsets(const void *a, const void *b, void *arg) {
+    const tar_archive_t *ar = arg;
+    uint64_t x = ar->offsets[*(const uint32_t *)a], y = ar->offsets[*(const uint32_t *)b];
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Cuts the files into units: the runs of files spanning at most SEARCH_CHUNK bytes of the archive with no hole of
+ * more than SEARCH_GAP bytes between two of them, and the chunks of larger files. A unit is read in one go, holes
+ * included, so both bounds keep its reads close to the bytes it scans.
+ *
+ * @return the number of units, or -1 if they could not be allocated.
+ */
+static int64_t search_units(struct search_job *job, uint32_t no_files) {
+    const tar_archive_t *ar = job->ar;
+    uint64_t max = 1;
+    for (uint32_t i = 0; i < no_files; i++) max += ar->sizes[job->files[i]] / SEARCH_CHUNK + 1;
+    job->units = malloc(max * sizeof(struct search_unit));
+    if (job->units == NULL) return -1;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < no_files;) {
+        uint64_t size = ar->sizes[job->files[i]];
+        if (size > SEARCH_CHUNK) {
+            for (uint64_t start = 0; start < size; start += SEARCH_CHUNK) {
+                uint64_t end = size - start > SEARCH_CHUNK ? start + SEARCH_CHUNK : size;
+                job->units[n++] = (struct search_unit){i, 1, start, end};
+            }
+            i++;
+            continue;
+        }
+
+        uint32_t first = i;
+        uint64_t run_start = ar->offsets[job->files[i]];
+        uint64_t run_end = run_start + size;
+        for (i++; i < no_files; i++) {
+            uint64_t offset = ar->offsets[job->files[i]], end = offset + ar->sizes[job->files[i]];
+            if (offset > run_end + SEARCH_GAP || end - run_start > SEARCH_CHUNK) break;
+            run_end = end;
+        }
+        job->units[n++] = (struct search_unit){first, i - first, 0, ar->sizes[job->files[i - 1]]};
+    }
+    return n;
+}
+
+static int search(tar_archive_t *ar, const char *pattern, int flags, int nthreads, tar_search_cb callback,
+                  void *ctx) {
+    size_t len = strlen(pattern);
+    if (len == 0) return -1;
+
+    pthread_once(&find_once, find_init);
+    struct search_job job = {.ar = ar, .callback = callback, .ctx = ctx};
+    uint8_t *folded = malloc(len);
+    uint32_t *files = malloc((ar->no_entries ? ar->no_entries : 1) * sizeof(uint32_t));
+    if (folded == NULL || files == NULL) {
+        free(folded);
+        free(files);
+        return -1;
+    }
+
+    struct matcher *m = &job.matcher;
+    m->icase = (flags & TAR_SEARCH_ICASE) != 0;
+    for (size_t i = 0; i < len; i++) folded[i] = m->icase ? fold(pattern[i]) : pattern[i];
+    m->pattern = folded;
+    m->len = len;
+    m->first[0] = m->first[1] = folded[0];
+    m->last[0] = m->last[1] = folded[len - 1];
+    if (m->icase && folded[0] >= 'a' && folded[0] <= 'z') m->first[1] = folded[0] & ~0x20;
+    if (m->icase && folded[len - 1] >= 'a' && folded[len - 1] <= 'z') m->last[1] = folded[len - 1] & ~0x20;
+
+    // sorted by offset, which keeps the reads of every worker sequential; a hard link is searched as its target
+    uint32_t no_files = 0;
+    for (uint32_t id = 0; id < ar->no_entries; id++) {
+        if (entry_is_file(ar, id) && ar->sizes[id] >= len) files[no_files++] = id;
+    }
+    qsort_r(files, no_files, sizeof(uint32_t), compare_offsets, ar);
+    job.files = files;
+
+    int64_t no_units = search_units(&job, no_files);
+    int ret = -1;
+    if (no_units >= 0) {
+        job.no_units = no_units;
+        if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads > job.no_units) nthreads = job.no_units;
+        if (nthreads < 1) nthreads = 1;
+
+        pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+        if (threads != NULL) {
+            pthread_mutex_init(&job.lock, NULL);
+            int started = 1;
+            for (; started < nthreads; started++) {
+                if (pthread_create(&threads[started], NULL, search_worker, &job) != 0) break;
+            }
+            search_worker(&job); // the calling thread works too
+            for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+            pthread_mutex_destroy(&job.lock);
+            free(threads);
+            ret = job.error ? -1 : job.matches;
+        }
+    }
+
+    free(job.units);
+    free(files);
+    free(folded);
+    return ret;
+}
+
+int tar_search(tar_archive_t *ar, const char *pattern, int flags, int nthreads, tar_search_cb callback, void *ctx) {
+    struct tar_stats_scope scope;
+    tar_stats_begin(&scope, ar, TAR_OP_SEARCH, pattern);
+    int ret = search(ar, pattern, flags, nthreads, callback, ctx);
+    tar_stats_end(&scope);
+    return ret;
+}
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "lib_tar.h"
+#include "tar_proto.h"
+
+/**
+ * Serves archives to the processes of the machine over a Unix domain socket, see tar_remote.h for the clients.
+ *
+ * Every archive given on the command line is opened and indexed once, at startup, and all the clients query that one
+ * index. File data never goes through a buffer of the daemon for a plain archive: its descriptor is passed to the
+ * client when it opens the archive, so that it reads the files itself at the offsets answered to PROTO_STAT, and a
+ * PROTO_READ is answered with sendfile(). Every thread runs its own epoll loop, the kernel handing each connection to
+ * one of them.
+ */
+
+#define MAX_EVENTS 64
+#define MAX_SENDFILE (1 << 30)  // bytes of a PROTO_READ sent at most by a reply
+
+struct archive {
+    char *path;                 // canonical path the clients open it by
+    int fd;
+    int gz;                     // gzip-compressed, its offsets are then not offsets in the file
+    tar_archive_t *ar;
+};
+
+struct conn {
+    int fd;
+    int writing;                // waiting for the socket to be writable rather than readable
+    uint8_t in[sizeof(struct tar_proto_req) + TAR_PROTO_MAX_PATH]; // requests received and not answered yet
+    size_t in_len;
+    uint8_t *out;               // reply being sent
+    size_t out_len;
+    size_t out_pos;
+    size_t out_max;
+    int pass_fd;                // descriptor sent along with the first byte of the reply, -1 if none
+    int file_fd;                // then file_left bytes of file_fd sent from file_offset with sendfile()
+    uint64_t file_offset;
+    uint64_t file_left;
+    struct conn *prev, *next;   // connections of the thread
+};
+
+static struct archive *archives;
+static int no_archives;
+static int listen_fd;
+static int stop_fd;             // eventfd made readable to stop every loop
+
+static struct tar_proto_rep *rep_of(struct conn *c) {
+    return (struct tar_proto_rep *)c->out;
+}
+
+/**
+ * Makes room for len more bytes of reply.
+ */
+static int out_reserve(struct conn *c, size_t len) {
+    if (c->out_len + len <= c->out_max) return 0;
+    size_t max = c->out_max ? c->out_max : 256;
+    while (max < c->out_len + len) max *= 2;
+    uint8_t *out = realloc(c->out, max);
+    if (out == NULL) return -1;
+    c->out = out;
+    c->out_max = max;
+    return 0;
+}
+
+static int out_append(struct conn *c, const void *data, size_t len) {
+    if (out_reserve(c, len) < 0) return -1;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    rep_of(c)->payload += len;
+    return 0;
+}
+
+static void open_reply(struct conn *c, const char *path) {
+    struct tar_proto_rep *rep = rep_of(c);
+    rep->ret = -1;
+
+    char real[PATH_MAX];
+    if (realpath(path, real) == NULL) return;
+    for (int i = 0; i < no_archives; i++) {
+        if (strcmp(archives[i].path, real) != 0) continue;
+        rep->ret = i;
+        if (!archives[i].gz) {
+            rep->flags |= PROTO_FD;
+            c->pass_fd = archives[i].fd;
+        }
+        return;
+    }
+}
+
+static int list_reply(struct conn *c, struct archive *a, char *path, uint64_t max) {
+    tar_cursor_t cursor;
+    rep_of(c)->ret = tar_list_begin(a->ar, path, &cursor);
+    if (rep_of(c)->ret == 0) return 0;
+
+    const char *entry;
+    uint64_t n = 0;
+    while (n < max && (entry = tar_list_next(&cursor)) != NULL) {
+        if (out_append(c, entry, strlen(entry) + 1) < 0) return -1;
+        n++;
+    }
+    rep_of(c)->size = n;
+    return 0;
+}
+
+static int read_reply(struct conn *c, struct archive *a, char *path, uint64_t offset, uint64_t len) {
+    struct tar_proto_rep *rep = rep_of(c);
+
+    if (a->gz) {
+        // the data has to be decompressed first, so it is copied
+        size_t n = len < TAR_PROTO_MAX_COPY ? len : TAR_PROTO_MAX_COPY;
+        if (out_reserve(c, n) < 0) return -1;
+        rep = rep_of(c);
+        rep->ret = tar_read_file(a->ar, path, offset, c->out + c->out_len, &n);
+        if (rep->ret < 0) return 0;
+        c->out_len += n;
+        rep->payload = n;
+        return 0;
+    }
+
+    tar_lookup_t st;
+    if (!tar_stat(a->ar, path, &st) || (st.typeflag != REGTYPE && st.typeflag != AREGTYPE)) {
+        rep->ret = -1;
+        return 0;
+    }
+    if (offset > st.size) {
+        rep->ret = -2;
+        return 0;
+    }
+
+    uint64_t n = st.size - offset;
+    if (n > len) n = len;
+    if (n > MAX_SENDFILE) n = MAX_SENDFILE;
+    rep->ret = st.size - offset - n;
+    rep->payload = n;
+    c->file_fd = a->fd;
+    c->file_offset = st.offset + offset;
+    c->file_left = n;
+    return 0;
+}
+
+/**
+ * Answers a request, leaving the reply in the connection.
+ *
+ * @return zero on success, -1 if memory ran out.
+ */
+static int handle(struct conn *c, const struct tar_proto_req *req, char *path) {
+    c->out_len = sizeof(struct tar_proto_rep);
+    c->out_pos = 0;
+    if (out_reserve(c, 0) < 0) return -1;
+    struct tar_proto_rep *rep = rep_of(c);
+    memset(rep, 0, sizeof(*rep));
+
+    if (req->op == PROTO_OPEN) {
+        open_reply(c, path);
+        return 0;
+    }
+    if (req->archive >= no_archives) {
+        rep->ret = -1;
+        return 0;
+    }
+
+    struct archive *a = &archives[req->archive];
+    tar_lookup_t st;
+    switch (req->op) {
+        case PROTO_EXISTS: rep->ret = tar_exists(a->ar, path); break;
+        case PROTO_IS_DIR: rep->ret = tar_is_dir(a->ar, path); break;
+        case PROTO_IS_FILE: rep->ret = tar_is_file(a->ar, path); break;
+        case PROTO_IS_SYMLINK: rep->ret = tar_is_symlink(a->ar, path); break;
+        case PROTO_STAT:
+            rep->ret = tar_stat(a->ar, path, &st);
+            rep->typeflag = st.typeflag;
+            rep->size = st.size;
+            rep->offset = st.offset;
+            break;
+        case PROTO_LIST: return list_reply(c, a, path, req->len);
+        case PROTO_READ: return read_reply(c, a, path, req->offset, req->len);
+        default: rep->ret = -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends as much of the reply as the socket takes.
+ *
+ * @return 1 once the reply was sent, zero if the socket is full, -1 if the connection broke.
+ */
+static int flush(struct conn *c) {
+    while (c->out_pos < c->out_len) {
+        struct iovec iov = {c->out + c->out_pos, c->out_len - c->out_pos};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        if (c->pass_fd >= 0) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &c->pass_fd, sizeof(int));
+        }
+
+        ssize_t w = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return errno == EAGAIN ? 0 : -1;
+        c->out_pos += w;
+        c->pass_fd = -1;
+    }
+
+    while (c->file_left > 0) {
+        off_t offset = c->file_offset;
+        ssize_t w = sendfile(c->fd, c->file_fd, &offset, c->file_left);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return errno == EAGAIN ? 0 : -1;
+        if (w == 0) return -1; // the archive is shorter than its index says, the client would wait forever
+        c->file_offset = offset;
+        c->file_left -= w;
+    }
+    return 1;
+}
+
+static void conn_close(struct conn **conns, struct conn *c) {
+    if (c->prev != NULL) c->prev->next = c->next;
+    else *conns = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static int conn_watch(int ep, struct conn *c, int writing) {
+    if (c->writing == writing) return 0;
+    c->writing = writing;
+    struct epoll_event ev = {.events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c};
+    return epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/**
+ * Handles an event of a connection: receives requests, answers the ones complete in order and sends the replies.
+ * A connection does not read further requests while a reply is waiting for the socket to drain.
+ *
+ * @return zero on success, -1 if the connection has to be closed.
+ */
+static int conn_event(int ep, struct conn *c) {
+    if (c->writing) {
+        int r = flush(c);
+        if (r <= 0) return r;
+    } else {
+        ssize_t r = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        if (r == 0) return -1;
+        c->in_len += r;
+    }
+
+    struct tar_proto_req req;
+    char path[TAR_PROTO_MAX_PATH + 1];
+    while (c->in_len >= sizeof(req)) {
+        memcpy(&req, c->in, sizeof(req));
+        if (req.size < sizeof(req) || req.size > sizeof(c->in)) return -1; // not a client
+        if (c->in_len < req.size) break;
+
+        size_t path_len = req.size - sizeof(req);
+        memcpy(path, c->in + sizeof(req), path_len);
+        path[path_len] = '\0';
+        c->in_len -= req.size;
+        memmove(c->in, c->in + req.size, c->in_len);
+
+        if (handle(c, &req, path) < 0) return -1;
+        int r = flush(c);
+        if (r < 0) return -1;
+        if (r == 0) return conn_watch(ep, c, 1);
+    }
+    return conn_watch(ep, c, 0);
+}
+
+static void *serve(void *arg) {
+    struct conn *conns = NULL;
+    struct epoll_event events[MAX_EVENTS];
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) return NULL;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &listen_fd};
+    epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &stop_fd};
+    epoll_ctl(ep, EPOLL_CTL_ADD, stop_fd, &ev);
+
+    for (int stopping = 0; !stopping;) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &stop_fd) {
+                stopping = 1;
+            } else if (events[i].data.ptr == &listen_fd) {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) continue; // taken by another thread
+                struct conn *c = calloc(1, sizeof(struct conn));
+                if (c == NULL) {
+                    close(fd);
+                    continue;
+                }
+                c->fd = fd;
+                c->pass_fd = -1;
+                ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = c};
+                if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                    close(fd);
+                    free(c);
+                    continue;
+                }
+                c->next = conns;
+                if (conns != NULL) conns->prev = c;
+                conns = c;
+            } else {
+                struct conn *c = events[i].data.ptr;
+                if (conn_event(ep, c) < 0) conn_close(&conns, c);
+            }
+        }
+    }
+
+    while (conns != NULL) conn_close(&conns, conns);
+    close(ep);
+    return NULL;
+}
+
+/**
+ * Prints the statistics of every archive served, so that the load of the daemon can be told from the one of the
+ * socket.
+ */
+static void print_stats(void) {
+    for (int i = 0; i < no_archives; i++) {
+        tar_stats_t stats;
+        tar_stats_get(archives[i].ar, &stats);
+        fprintf(stderr, "%s:\n", archives[i].path);
+        for (int op = 0; op < TAR_NO_OPS; op++) {
+            const tar_op_stats_t *s = &stats.ops[op];
+            if (s->calls == 0) continue;
+            fprintf(stderr, "  %-12s %10llu calls %10.2f us/call %12llu bytes read\n", tar_op_name(op),
+                    (unsigned long long)s->calls, s->nanoseconds / 1e3 / s->calls, (unsigned long long)s->bytes_read);
+        }
+    }
+}
+
+static int open_archive(struct archive *a, const char *path, int flags) {
+    a->path = realpath(path, NULL);
+    a->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (a->path == NULL || a->fd < 0) return -1;
+
+    size_t len = strlen(path);
+    a->gz = len > 3 && strcmp(path + len - 3, ".gz") == 0;
+    a->ar = a->gz ? tar_open_gz(a->fd, 0) : tar_open_flags(a->fd, flags);
+    return a->ar == NULL ? -1 : 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t threads] [-m] socket archive.tar[.gz]...\n", name);
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 1, flags = 0;
+    int c;
+    while ((c = getopt(argc, argv, "t:m")) != -1) {
+        switch (c) {
+            case 't': nthreads = strtol(optarg, NULL, 10); break;
+            case 'm': flags |= TAR_OPEN_MMAP; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind < 2 || nthreads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *socket_path = argv[optind];
+    no_archives = argc - optind - 1;
+    archives = calloc(no_archives, sizeof(struct archive));
+    for (int i = 0; i < no_archives; i++) {
+        if (open_archive(&archives[i], argv[optind + 1 + i], flags) < 0) {
+            fprintf(stderr, "%s: not a valid archive\n", argv[optind + 1 + i]);
+            return 1;
+        }
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long for a socket\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        perror(socket_path);
+        return 1;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    // the signals are taken by sigwait() below, the loops never see them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN); // sendfile() to a client gone raises it
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, serve, NULL);
+    fprintf(stderr, "serving %d archives on %s with %d threads\n", no_archives, socket_path, nthreads);
+
+    int sig;
+    sigwait(&signals, &sig);
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0) return 1;
+    for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+    print_stats();
+    unlink(socket_path);
+    for (int i = 0; i < no_archives; i++) {
+        tar_close(archives[i].ar);
+        close(archives[i].fd);
+        free(archives[i].path);
+    }
+    free(archives);
+    free(threads);
+    return 0;
+}
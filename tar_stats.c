@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <string.h>
+#include <time.h>
+
+/*
+ * Operation statistics.
+ *
+ * The counters of a handle are split in slots, each on its own cache lines, and every thread adds to the slot given
+ * by its thread number, so that threads querying the same handle never write to the same line. A call gathers its
+ * counters in a scope on its own stack and adds them to the slot once, when it ends. The slots are only summed when
+ * the statistics are read.
+ */
+
+#define STATS_SLOTS 16          // a power of two
+#define STATS_COUNTERS (sizeof(tar_stats_t) / sizeof(uint64_t)) // counters of a slot
+
+struct tar_stats_slot {
+    tar_op_stats_t ops[TAR_NO_OPS];
+} __attribute__((aligned(64)));
+
+__thread struct tar_stats_scope *tar_stats_current;
+__thread uint64_t tar_stats_next_offset;
+
+static __thread unsigned thread_slot; // slot of the thread + 1, zero until its first call
+static unsigned next_slot;
+
+static const char *op_names[TAR_NO_OPS] = {
+    "open", "refresh", "exists", "is_dir", "is_file", "is_symlink", "stat", "list", "read_file", "read_batch",
+    "read_async", "view_file", "entry_open", "entry_read", "extract", "search",
+};
+
+const char *tar_op_name(int op) {
+    return op >= 0 && op < TAR_NO_OPS ? op_names[op] : "unknown";
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Gives the slots of a handle, allocating them on the first call.
+ *
+ * @return the slots, or NULL if memory ran out, the call then not being counted.
+ */
+static struct tar_stats_slot *stats_slots(tar_archive_t *ar) {
+    struct tar_stats_slot *slots = __atomic_load_n(&ar->stats, __ATOMIC_ACQUIRE);
+    if (slots != NULL) return slots;
+
+    struct tar_stats_slot *fresh = aligned_alloc(64, STATS_SLOTS * sizeof(struct tar_stats_slot));
+    if (fresh == NULL) return NULL;
+    memset(fresh, 0, STATS_SLOTS * sizeof(struct tar_stats_slot));
+    if (__atomic_compare_exchange_n(&ar->stats, &slots, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+    free(fresh);
+    return slots;
+}
+
+static void scope_push(struct tar_stats_scope *scope, tar_archive_t *ar, int op, const char *path) {
+    memset(scope, 0, sizeof(*scope));
+    scope->outer = tar_stats_current;
+
+    // the calls made by another call on the same handle count in the outer one, which stays the current scope
+    for (struct tar_stats_scope *outer = scope->outer; outer != NULL; outer = outer->outer) {
+        if (outer->ar == ar) return;
+    }
+
+    scope->ar = ar;
+    scope->op = op;
+    scope->path = path;
+    scope->start = now_ns();
+    tar_stats_current = scope;
+}
+
+void tar_stats_begin(struct tar_stats_scope *scope, tar_archive_t *ar, int op, const char *path) {
+    scope_push(scope, ar, op, path);
+    if (scope->ar == NULL) return;
+
+    scope->counters.calls = 1;
+    if (ar->trace_begin != NULL || ar->trace_end != NULL) {
+        scope->traced = 1;
+        if (ar->trace_begin != NULL) ar->trace_begin(ar->trace_ctx, op, path);
+    }
+}
+
+void tar_stats_join(struct tar_stats_scope *scope, tar_archive_t *ar, int op) {
+    scope_push(scope, ar, op, NULL);
+}
+
+void tar_stats_end(struct tar_stats_scope *scope) {
+    tar_stats_current = scope->outer;
+    if (scope->ar == NULL) return;
+
+    tar_archive_t *ar = scope->ar;
+    scope->counters.nanoseconds = now_ns() - scope->start;
+    if (scope->traced && ar->trace_end != NULL) ar->trace_end(ar->trace_ctx, scope->op, scope->path, &scope->counters);
+
+    struct tar_stats_slot *slots = stats_slots(ar);
+    if (slots == NULL) return;
+    if (thread_slot == 0) thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % STATS_SLOTS + 1;
+
+    // another thread only shares the slot past STATS_SLOTS threads, the additions stay atomic for it
+    uint64_t *dest = (uint64_t *)&slots[thread_slot - 1].ops[scope->op];
+    const uint64_t *src = (const uint64_t *)&scope->counters;
+    for (size_t i = 0; i < sizeof(tar_op_stats_t) / sizeof(uint64_t); i++) {
+        if (src[i] != 0) __atomic_fetch_add(&dest[i], src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void tar_stats_get(const tar_archive_t *ar, tar_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    const struct tar_stats_slot *slots = __atomic_load_n(&ar->stats, __ATOMIC_ACQUIRE);
+    if (slots == NULL) return;
+
+    uint64_t *dest = (uint64_t *)stats->ops;
+    for (int s = 0; s < STATS_SLOTS; s++) {
+        const uint64_t *src = (const uint64_t *)slots[s].ops;
+        for (size_t i = 0; i < STATS_COUNTERS; i++) {
+            dest[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void tar_stats_reset(tar_archive_t *ar) {
+    struct tar_stats_slot *slots = __atomic_load_n(&ar->stats, __ATOMIC_ACQUIRE);
+    if (slots == NULL) return;
+
+    for (int s = 0; s < STATS_SLOTS; s++) {
+        uint64_t *counters = (uint64_t *)slots[s].ops;
+        for (size_t i = 0; i < STATS_COUNTERS; i++) {
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void tar_stats_trace(tar_archive_t *ar, tar_trace_begin_cb begin, tar_trace_end_cb end, void *ctx) {
+    ar->trace_begin = begin;
+    ar->trace_end = end;
+    ar->trace_ctx = ctx;
+}
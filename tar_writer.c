@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "lib_tar.h"
+#include "lib_tar_private.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Archive writer.
+ *
+ * Headers, padding and the content of small files are gathered in a staging buffer written with a single writev()
+ * once full. The content of larger files is flushed after it and copied by the kernel from the source descriptor
+ * with copy_file_range(), or sendfile() when the output does not support it (a pipe, another file system on old
+ * kernels, ...), and only then with read() and write().
+ */
+
+#define WRITER_BUFFER (1 << 20)     // size of the staging buffer
+#define WRITER_SMALL (64 << 10)     // files up to this size are copied through the staging buffer
+
+struct tar_writer {
+    int fd;
+    uint8_t *buffer;
+    size_t len;                 // bytes staged in the buffer
+    int error;                  // set by the first failed write, every later call fails
+    int no_copy_range;          // copy_file_range() failed to write to the output, not tried again
+    int no_sendfile;            // same for sendfile()
+};
+
+/**
+ * Writes a whole vector of buffers, resuming after short writes.
+ */
+static int writev_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t w = writev(fd, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the staging buffer, followed by an optional caller buffer in the same system call.
+ */
+static int writer_flush(tar_writer_t *w, const void *data, size_t len) {
+    struct iovec iov[2] = {{w->buffer, w->len}, {(void *)data, len}};
+    if (w->len + len == 0) return 0;
+    if (writev_full(w->fd, w->len ? iov : iov + 1, (w->len ? 1 : 0) + (len ? 1 : 0)) < 0) {
+        w->error = 1;
+        return -1;
+    }
+    w->len = 0;
+    return 0;
+}
+
+/**
+ * Makes room for len bytes in the staging buffer.
+ */
+static uint8_t *writer_stage(tar_writer_t *w, size_t len) {
+    if (w->len + len > WRITER_BUFFER && writer_flush(w, NULL, 0) < 0) return NULL;
+    uint8_t *dest = w->buffer + w->len;
+    w->len += len;
+    return dest;
+}
+
+/**
+ * Stages the zeros completing the last block of a content of a given size.
+ */
+static int writer_pad(tar_writer_t *w, uint64_t size) {
+    size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    uint8_t *dest = writer_stage(w, pad);
+    if (dest == NULL) return -1;
+    memset(dest, 0, pad);
+    return 0;
+}
+
+/**
+ * Writes an octal number in a header field, null-terminated.
+ *
+ * @return zero on success, -1 if the number does not fit.
+ */
+static int field_octal(char *field, size_t field_len, uint64_t value) {
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%0*llo", (int)field_len - 1, (unsigned long long)value);
+    if (len >= field_len) return -1;
+    memcpy(field, digits, len + 1);
+    return 0;
+}
+
+/**
+ * Fills a ustar header, splitting paths longer than the name field between the prefix and the name fields.
+ *
+ * @return zero on success, -1 if the path, the link name or a number does not fit in the header.
+ */
+static int header_fill(tar_header_t *header, const char *path, char typeflag, uint64_t size, const struct stat *st,
+                       const char *linkname) {
+    memset(header, 0, sizeof(*header));
+
+    size_t len = strlen(path);
+    if (len > sizeof(header->name)) {
+        // split at a slash, the prefix taking as much as it can, never at the trailing slash of a directory
+        size_t split = len - 2 < sizeof(header->prefix) ? len - 2 : sizeof(header->prefix);
+        while (split > 0 && path[split] != '/') split--;
+        if (split == 0 || len - split - 1 > sizeof(header->name)) return -1;
+        memcpy(header->prefix, path, split);
+        memcpy(header->name, path + split + 1, len - split - 1);
+    } else {
+        memcpy(header->name, path, len);
+    }
+
+    if (linkname != NULL) {
+        size_t link_len = strlen(linkname);
+        if (link_len > sizeof(header->linkname)) return -1;
+        memcpy(header->linkname, linkname, link_len);
+    }
+
+    if (field_octal(header->mode, sizeof(header->mode), st->st_mode & 07777) < 0) return -1;
+    if (field_octal(header->uid, sizeof(header->uid), st->st_uid) < 0) return -1;
+    if (field_octal(header->gid, sizeof(header->gid), st->st_gid) < 0) return -1;
+    if (field_octal(header->size, sizeof(header->size), size) < 0) return -1;
+    if (field_octal(header->mtime, sizeof(header->mtime), st->st_mtime < 0 ? 0 : st->st_mtime) < 0) return -1;
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    // the checksum is computed with its own field filled with spaces, as check_archive() expects
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    const uint8_t *bytes = (const uint8_t *)header;
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(*header); i++) sum += bytes[i];
+    snprintf(header->chksum, sizeof(header->chksum) - 1, "%06o", sum);
+    header->chksum[7] = ' ';
+    return 0;
+}
+
+/**
+ * Stages the header of an entry.
+ */
+static int writer_header(tar_writer_t *w, const char *path, char typeflag, uint64_t size, const struct stat *st,
+                         const char *linkname) {
+    tar_header_t header;
+    if (w->error) return -1;
+    if (header_fill(&header, path, typeflag, size, st, linkname) < 0) return -1;
+
+    uint8_t *dest = writer_stage(w, TAR_BLOCK);
+    if (dest == NULL) return -1;
+    memcpy(dest, &header, TAR_BLOCK);
+    return 0;
+}
+
+/**
+ * Copies size bytes of a file to the archive, by the kernel when possible.
+ *
+ * @return zero on success, -1 on a read or write error or if the file is shorter than size.
+ */
+static int writer_copy(tar_writer_t *w, int src_fd, uint64_t size) {
+    if (size <= WRITER_SMALL) {
+        uint8_t *dest = writer_stage(w, size);
+        if (dest == NULL) return -1;
+        if (tar_pread_full(src_fd, dest, size, 0) != size) { w->error = 1; return -1; }
+        return 0;
+    }
+
+    if (writer_flush(w, NULL, 0) < 0) return -1;
+
+    loff_t offset = 0;
+    while (!w->no_copy_range && offset < size) {
+        ssize_t r = copy_file_range(src_fd, &offset, w->fd, NULL, size - offset, 0);
+        if (r > 0) continue;
+        if (r == 0) { w->error = 1; return -1; } // the file shrank
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) { w->error = 1; return -1; }
+        w->no_copy_range = 1;
+    }
+
+    off_t sent = offset;
+    while (!w->no_sendfile && sent < size) {
+        ssize_t r = sendfile(w->fd, src_fd, &sent, size - sent);
+        if (r > 0) continue;
+        if (r == 0) { w->error = 1; return -1; }
+        if (errno == EINTR) continue;
+        if (errno != EINVAL && errno != ENOSYS) { w->error = 1; return -1; }
+        w->no_sendfile = 1;
+    }
+
+    // last resort, through the staging buffer
+    for (uint64_t copied = sent; copied < size;) {
+        size_t chunk = size - copied < WRITER_BUFFER ? size - copied : WRITER_BUFFER;
+        if (tar_pread_full(src_fd, w->buffer, chunk, copied) != chunk) { w->error = 1; return -1; }
+        w->len = chunk;
+        if (writer_flush(w, NULL, 0) < 0) return -1;
+        copied += chunk;
+    }
+    return 0;
+}
+
+tar_writer_t *tar_writer_open(int out_fd) {
+    tar_writer_t *w = calloc(1, sizeof(tar_writer_t));
+    if (w == NULL) return NULL;
+    w->buffer = malloc(WRITER_BUFFER);
+    if (w->buffer == NULL) { free(w); return NULL; }
+    w->fd = out_fd;
+    return w;
+}
+
+/**
+ * Fills the metadata of an entry made up by the caller: owned by the current user and modified now.
+ */
+static void writer_own(struct stat *st, mode_t mode) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = mode;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = time(NULL);
+}
+
+/**
+ * Stages a directory entry with the mode, owner and modification time of st.
+ */
+static int writer_dir(tar_writer_t *w, const char *name, const struct stat *st) {
+    // directories are stored with a trailing slash
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') return writer_header(w, name, DIRTYPE, 0, st, NULL);
+
+    char *path = malloc(len + 2);
+    if (path == NULL) return -1;
+    memcpy(path, name, len);
+    strcpy(path + len, "/");
+    int ret = writer_header(w, path, DIRTYPE, 0, st, NULL);
+    free(path);
+    return ret;
+}
+
+int tar_writer_add_dir(tar_writer_t *w, const char *name, mode_t mode) {
+    struct stat st;
+    writer_own(&st, mode);
+    return writer_dir(w, name, &st);
+}
+
+int tar_writer_add_symlink(tar_writer_t *w, const char *name, const char *target) {
+    struct stat st;
+    writer_own(&st, 0777);
+    return writer_header(w, name, SYMTYPE, 0, &st, target);
+}
+
+int tar_writer_add_file(tar_writer_t *w, const char *name, const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) return -1;
+
+    if (S_ISDIR(st.st_mode)) return writer_dir(w, name, &st);
+    if (S_ISLNK(st.st_mode)) {
+        char target[sizeof(((tar_header_t *)0)->linkname) + 1];
+        ssize_t len = readlink(path, target, sizeof(target));
+        if (len < 0) return -1;
+        if (len == sizeof(target)) { errno = ENAMETOOLONG; return -1; }
+        target[len] = '\0';
+        return writer_header(w, name, SYMTYPE, 0, &st, target);
+    }
+    if (!S_ISREG(st.st_mode)) { errno = EINVAL; return -1; }
+
+    int src_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) return -1;
+
+    int ret = writer_header(w, name, REGTYPE, st.st_size, &st, NULL);
+    if (ret == 0) ret = writer_copy(w, src_fd, st.st_size);
+    if (ret == 0) ret = writer_pad(w, st.st_size);
+    close(src_fd);
+    return ret;
+}
+
+int tar_writer_add_data(tar_writer_t *w, const char *name, const void *data, size_t len, mode_t mode) {
+    struct stat st;
+    writer_own(&st, mode);
+    if (writer_header(w, name, REGTYPE, len, &st, NULL) < 0) return -1;
+
+    if (len <= WRITER_SMALL) {
+        uint8_t *dest = writer_stage(w, len);
+        if (dest == NULL) return -1;
+        memcpy(dest, data, len);
+    } else if (writer_flush(w, data, len) < 0) { // staged headers and data in one writev()
+        return -1;
+    }
+    return writer_pad(w, len);
+}
+
+int tar_writer_close(tar_writer_t *w) {
+    if (w == NULL) return -1;
+
+    // end of archive: two null blocks
+    uint8_t *trailer = w->error ? NULL : writer_stage(w, 2 * TAR_BLOCK);
+    if (trailer != NULL) memset(trailer, 0, 2 * TAR_BLOCK);
+    int ret = trailer == NULL || writer_flush(w, NULL, 0) < 0 ? -1 : 0;
+
+    free(w->buffer);
+    free(w);
+    return ret;
+}
@@ -1,9 +1,21 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
+#include "tar_remote.h"
+
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 2000
 
 /**
  * You are free to use this file to write tests for your implementation
@@ -24,6 +36,153 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+/**
+ * Writes a gzip-compressed copy of a file.
+ */
+void gzip_copy(int fd, const char *path) {
+    gzFile out = gzopen(path, "wb");
+    char buffer[4096];
+    ssize_t r;
+    lseek(fd, 0, SEEK_SET);
+    while ((r = read(fd, buffer, sizeof(buffer))) > 0) gzwrite(out, buffer, r);
+    gzclose(out);
+}
+
+/**
+ * Completion of tar_read_async(), storing its results in an async_result.
+ */
+struct async_result {
+    ssize_t ret;
+    size_t len;
+    int calls;
+};
+
+void async_done(void *ctx, ssize_t ret, size_t len) {
+    struct async_result *result = ctx;
+    result->ret = ret;
+    result->len = len;
+    result->calls++;
+}
+
+/**
+ * Trace hooks of an archive handle, counting the calls and the bytes they read.
+ */
+struct trace_count {
+    int begins;
+    int ends;
+    uint64_t bytes_read;
+};
+
+void trace_begin(void *ctx, int op, const char *path) {
+    ((struct trace_count *)ctx)->begins++;
+}
+
+void trace_end(void *ctx, int op, const char *path, const tar_op_stats_t *call) {
+    struct trace_count *count = ctx;
+    count->ends++;
+    count->bytes_read += call->bytes_read;
+}
+
+/**
+ * Counts the entries of a recursive listing, stopping once it saw max of them.
+ */
+struct list_count {
+    int seen;
+    int max;
+    char last[256];
+};
+
+int list_counter(void *ctx, const char *path) {
+    struct list_count *count = ctx;
+    count->seen++;
+    snprintf(count->last, sizeof(count->last), "%s", path);
+    return count->seen == count->max;
+}
+
+/**
+ * Writes the header of an entry, for the entries tar_writer_t does not write. Its content, if any, is up to the caller.
+ */
+void write_header(int fd, const char *name, char typeflag, const char *linkname, size_t size) {
+    tar_header_t header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name));
+    strcpy(header.mode, "0000777");
+    snprintf(header.size, sizeof(header.size), "%011zo", size);
+    strcpy(header.mtime, "00000000000");
+    header.typeflag = typeflag;
+    strncpy(header.linkname, linkname, sizeof(header.linkname));
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    unsigned sum = 0;
+    for (int i = 0; i < sizeof(header); i++) sum += ((uint8_t *)&header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    write(fd, &header, sizeof(header));
+}
+
+/**
+ * Attaches a sealed copy of an index file, with some bytes of one of its sections overwritten.
+ *
+ * @return whether the copy was attached.
+ */
+int attach_corrupted(int tar_fd, const uint8_t *index, size_t len, int section, size_t at, const void *value,
+                     size_t value_len) {
+    uint8_t *copy = malloc(len);
+    memcpy(copy, index, len);
+    uint64_t section_offset;
+    memcpy(&section_offset, copy + 80 + section * sizeof(uint64_t), sizeof(section_offset)); // sections[] of the header
+    if (value_len > 0) memcpy(copy + section_offset + at, value, value_len);
+
+    int copy_fd = memfd_create("tests index", MFD_ALLOW_SEALING);
+    write(copy_fd, copy, len);
+    fcntl(copy_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+    tar_archive_t *ar = tar_index_attach(tar_fd, copy_fd, 0);
+    close(copy_fd);
+    free(copy);
+    tar_close(ar);
+    return ar != NULL;
+}
+
+/**
+ * Counts the matches of tar_search() in one file, remembering the first offset.
+ */
+struct search_count {
+    const char *path;
+    int matches;
+    uint64_t first;
+};
+
+int search_counter(void *ctx, const char *path, uint64_t offset) {
+    struct search_count *count = ctx;
+    if (strcmp(path, count->path) != 0) return 0;
+    if (count->matches++ == 0 || offset < count->first) count->first = offset;
+    return 0;
+}
+
+/**
+ * Hammers a shared archive handle with lookups and reads, counting the answers that differ from the expected ones.
+ */
+void *stress_worker(void *arg) {
+    tar_archive_t *ar = arg;
+    const char *expected = "This is the content of the target file.";
+    size_t expected_len = strlen(expected);
+    long mismatches = 0;
+
+    for (int i = 0; i < STRESS_ROUNDS; i++) {
+        uint8_t buffer[64];
+        size_t len = sizeof(buffer);
+        size_t offset = i % expected_len;
+
+        if (tar_read_file(ar, "symbolic_link.txt", offset, buffer, &len) != 0) mismatches++;
+        else if (len != expected_len - offset || memcmp(buffer, expected + offset, len) != 0) mismatches++;
+
+        const uint8_t *view;
+        if (tar_view_file(ar, "target_file.txt", &view, &len) != 0 || memcmp(view, expected, len) != 0) mismatches++;
+
+        if (!tar_exists(ar, "testDir/file1.txt") || tar_is_file(ar, "testDir/") || !tar_is_dir(ar, "testDir/")) mismatches++;
+    }
+    return (void *)mismatches;
+}
 
 int main(int argc, char **argv) {
     if (argc < 2) {
@@ -41,6 +200,11 @@ int main(int argc, char **argv) {
     printf("===========================\n|| check_archive() tests ||\n===========================\n\n");
     printf("check_archive should return 6 and returned: %d\n", ret);
 
+    uint32_t *digests;
+    int ret_parallel = check_archive_parallel(fd, 4, TAR_CHECK_DIGEST, &digests);
+    printf("check_archive_parallel should return %d and returned: %d\n", ret, ret_parallel);
+    free(digests);
+
     // Exists() tests
     int exists_make = exists(fd, "Makefile");
     int exists_tests = exists(fd, "tests.c");
@@ -94,7 +258,7 @@ int main(int argc, char **argv) {
     char **entries;
     entries = (char **)malloc(10 * sizeof(char *));
     for (int i=0; i < 10; i++){
-    	entries[i] = (char *) malloc(30*sizeof(char));
+    	entries[i] = (char *) malloc(TAR_ENTRY_MAX*sizeof(char));
     }
     size_t *no_entries;
     no_entries = (size_t *)malloc(sizeof(size_t));
@@ -111,7 +275,571 @@ int main(int argc, char **argv) {
         free(entries[i]);
     }
     free(no_entries);
-    
+
+    printf("\n\n======================\n|| tar_open() tests ||\n======================\n\n");
+    tar_archive_t *ar = tar_open(fd);
+    printf("tar_open should return a handle and returned:%s\n", ar != NULL ? "a handle" : "NULL");
+    int unreadable_fd = open("testDir", O_RDONLY); // pread() fails with EISDIR
+    tar_archive_t *unreadable = tar_open(unreadable_fd);
+    printf("tar_open (read error) should return NULL and returned:%s\n", unreadable != NULL ? "a handle" : "NULL");
+    tar_close(unreadable);
+    close(unreadable_fd);
+    printf("tar_exists testDir/file1.txt should return 1 and returned:%d\n", tar_exists(ar, "testDir/file1.txt"));
+    printf("tar_exists testDir/file should return 0 and returned:%d\n", tar_exists(ar, "testDir/file"));
+    printf("tar_is_dir testDir/ should return 1 and returned:%d\n", tar_is_dir(ar, "testDir/"));
+    printf("tar_is_file symbolic_link.txt should return 0 and returned:%d\n", tar_is_file(ar, "symbolic_link.txt"));
+    printf("tar_is_symlink symbolic_link.txt should return 1 and returned:%d\n", tar_is_symlink(ar, "symbolic_link.txt"));
+
+    uint8_t link_buffer[64] = {0};
+    len = sizeof(link_buffer) - 1;
+    result = tar_read_file(ar, "symbolic_link.txt", 12, link_buffer, &len);
+    printf("tar_read_file symbolic_link.txt at 12 should return 0 and returned:%ld, read %zu bytes: %s\n", result, len, (char *)link_buffer);
+    len = sizeof(link_buffer);
+    printf("tar_read_file at offset 100 should return -2 and returned:%ld\n", tar_read_file(ar, "file1.txt", 100, link_buffer, &len));
+
+    char *root_entries[16];
+    for (int i = 0; i < 16; i++) root_entries[i] = malloc(TAR_ENTRY_MAX);
+    size_t no_root_entries = 16;
+    int list_root = tar_list(ar, "testDir", root_entries, &no_root_entries);
+    printf("tar_list testDir should return 1 with 2 entries and returned:%d with %zu entries\n", list_root, no_root_entries);
+    for (int i = 0; i < 16; i++) free(root_entries[i]);
+
+    tar_cursor_t cursor;
+    int list_begin = tar_list_begin(ar, "testDir/", &cursor);
+    const char *first_entry = tar_list_next(&cursor);
+    const char *second_entry = tar_list_next(&cursor);
+    const char *no_entry = tar_list_next(&cursor);
+    printf("tar_list_begin testDir/ should return 1 and 2 entries and returned:%d, %s, %s, %s\n", list_begin, first_entry, second_entry, no_entry == NULL ? "end" : no_entry);
+    printf("tar_list_begin Makefile should return 0 and returned:%d\n", tar_list_begin(ar, "Makefile", &cursor));
+    struct list_count listed = {0, -1};
+    int recursive = tar_list_recursive(ar, "testDir/", NULL, list_counter, &listed);
+    printf("tar_list_recursive testDir/ should return 3 and returned:%d, last '%s'\n", recursive, listed.last);
+    listed = (struct list_count){0, -1};
+    recursive = tar_list_recursive(ar, "test", "*/*.c", list_counter, &listed);
+    printf("tar_list_recursive test*/*.c should return 1 and 'testDir/file2.c' and returned:%d '%s'\n", recursive, listed.last);
+    listed = (struct list_count){0, 1};
+    printf("tar_list_recursive stopped by its callback should return 1 and returned:%d\n", tar_list_recursive(ar, "", NULL, list_counter, &listed));
+    tar_close(ar);
+
+    printf("\n\n===========================\n|| tar_view_file() tests ||\n===========================\n\n");
+    const uint8_t *view;
+    size_t view_len;
+    ar = tar_open_flags(fd, TAR_OPEN_MMAP | TAR_ADVISE_RANDOM);
+    int view_ret = tar_view_file(ar, "file1.txt", &view, &view_len);
+    printf("tar_view_file file1.txt (mmap) should return 0 and 'file to read.' and returned:%d '%.*s'\n", view_ret, (int)view_len, (const char *)view);
+    printf("tar_view_file testDir/ should return -1 and returned:%d\n", tar_view_file(ar, "testDir/", &view, &view_len));
+    tar_close(ar);
+
+    ar = tar_open(fd);
+    view_ret = tar_view_file(ar, "symbolic_link.txt", &view, &view_len);
+    printf("tar_view_file symbolic_link.txt (read) should return 0 and 'This is the content of the target file.' and returned:%d '%.*s'\n", view_ret, (int)view_len, (const char *)view);
+    tar_close(ar);
+
+    printf("\n\n============================\n|| tar_entry_open() tests ||\n============================\n\n");
+    ar = tar_open(fd);
+    printf("tar_entry_open testDir/ should return NULL and returned:%p\n", (void *)tar_entry_open(ar, "testDir/"));
+    tar_entry_t *entry = tar_entry_open(ar, "symbolic_link.txt");
+    tar_entry_readahead(entry, 16);
+    char entry_buffer[64] = {0};
+    size_t entry_len = 0;
+    ssize_t chunk;
+    while ((chunk = tar_entry_read(entry, entry_buffer + entry_len, 8)) > 0) entry_len += chunk;
+    printf("tar_entry_read symbolic_link.txt by 8 bytes should read '%s' and read:'%s'\n", "This is the content of the target file.", entry_buffer);
+    printf("tar_entry_seek SEEK_END -5 should return 34 and returned:%ld\n", (long)tar_entry_seek(entry, -5, SEEK_END));
+    memset(entry_buffer, 0, sizeof(entry_buffer));
+    chunk = tar_entry_read(entry, entry_buffer, sizeof(entry_buffer));
+    printf("tar_entry_read should return 5 and 'file.' and returned:%ld '%s'\n", chunk, entry_buffer);
+    memset(entry_buffer, 0, sizeof(entry_buffer));
+    chunk = tar_entry_pread(entry, entry_buffer, 7, 12);
+    printf("tar_entry_pread at 12 should return 7 and 'content' and returned:%ld '%s'\n", chunk, entry_buffer);
+    printf("tar_entry_read at the end should return 0 and returned:%ld\n", tar_entry_read(entry, entry_buffer, 8));
+    tar_entry_close(entry);
+    tar_close(ar);
+
+    printf("\n\n=============================\n|| tar_index_open() tests ||\n=============================\n\n");
+    printf("tar_index_build should return 0 and returned:%d\n", tar_index_build(fd, "tests.idx"));
+    ar = tar_index_open(fd, "tests.idx", 0);
+    printf("tar_is_file Makefile (index) should return 1 and returned:%d\n", tar_is_file(ar, "Makefile"));
+    no_root_entries = 16;
+    for (int i = 0; i < 16; i++) root_entries[i] = malloc(TAR_ENTRY_MAX);
+    list_root = tar_list(ar, "testDir/", root_entries, &no_root_entries);
+    printf("tar_list testDir/ (index) should return 1 with 2 entries and returned:%d with %zu entries\n", list_root, no_root_entries);
+    for (int i = 0; i < 16; i++) free(root_entries[i]);
+    tar_close(ar);
+
+    ar = tar_open(fd);
+    int shared_fd = tar_index_publish(ar);
+    tar_close(ar);
+    printf("tar_index_publish should return a descriptor and returned:%s\n", shared_fd >= 0 ? "a descriptor" : "-1");
+    int other_fd = open("tests.c", O_RDONLY);
+    printf("tar_index_attach (another file) should return NULL and returned:%s\n", tar_index_attach(other_fd, shared_fd, 0) ? "a handle" : "NULL");
+    close(other_fd);
+    ar = tar_index_attach(fd, shared_fd, 0);
+    close(shared_fd);
+    printf("tar_is_symlink symbolic_link.txt (attached) should return 1 and returned:%d\n", tar_is_symlink(ar, "symbolic_link.txt"));
+    memset(link_buffer, 0, sizeof(link_buffer));
+    len = sizeof(link_buffer) - 1;
+    result = tar_read_file(ar, "symbolic_link.txt", 12, link_buffer, &len);
+    printf("tar_read_file symbolic_link.txt at 12 (attached) should return 0 and 'content of the target file.' and returned:%ld '%s'\n", result, (char *)link_buffer);
+    tar_close(ar);
+
+    // only a sealed and consistent index is attached
+    int unsealed_fd = open("tests.idx", O_RDONLY);
+    printf("tar_index_attach (unsealed) should return NULL and returned:%s\n", tar_index_attach(fd, unsealed_fd, 0) ? "a handle" : "NULL");
+    struct stat idx_st;
+    fstat(unsealed_fd, &idx_st);
+    uint8_t *idx_copy = malloc(idx_st.st_size);
+    pread(unsealed_fd, idx_copy, idx_st.st_size, 0);
+    close(unsealed_fd);
+    uint32_t idx_entries, idx_buckets, corrupt_value;
+    memcpy(&idx_entries, idx_copy + 12, sizeof(idx_entries));
+    memcpy(&idx_buckets, idx_copy + 16, sizeof(idx_buckets));
+    printf("tar_index_attach (sealed copy) should return a handle and returned:%s\n",
+           attach_corrupted(fd, idx_copy, idx_st.st_size, 0, 0, NULL, 0) ? "a handle" : "NULL");
+    corrupt_value = 0xffffffff;
+    // the path of the first entry, past the strings
+    printf("tar_index_attach (path out of the strings) should return NULL and returned:%s\n",
+           attach_corrupted(fd, idx_copy, idx_st.st_size, 2, 0, &corrupt_value, 4) ? "a handle" : "NULL");
+    // every bucket taken, a missing path would be probed forever
+    uint32_t *full_buckets = malloc(idx_buckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < idx_buckets; i++) full_buckets[i] = 1;
+    printf("tar_index_attach (no empty bucket) should return NULL and returned:%s\n",
+           attach_corrupted(fd, idx_copy, idx_st.st_size, 9, 0, full_buckets, idx_buckets * sizeof(uint32_t)) ? "a handle" : "NULL");
+    free(full_buckets);
+    // the root listed as its own first child
+    corrupt_value = idx_entries - 1;
+    printf("tar_index_attach (cycle in the tree) should return NULL and returned:%s\n",
+           attach_corrupted(fd, idx_copy, idx_st.st_size, 10, (idx_entries - 1) * 4, &corrupt_value, 4) ? "a handle" : "NULL");
+    free(idx_copy);
+
+    int stale_fd = open("tests.idx", O_WRONLY | O_TRUNC);
+    write(stale_fd, "stale", 5);
+    close(stale_fd);
+    ar = tar_index_open(fd, "tests.idx", 0);
+    printf("tar_exists testDir/file2.c (rebuilt index) should return 1 and returned:%d\n", tar_exists(ar, "testDir/file2.c"));
+    tar_close(ar);
+    unlink("tests.idx");
+
+    // the last header is rewritten in place, with the same size and mtime, in an archive of more headers than sampled
+    int tail_fd = open("tests_tail.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *tail_writer = tar_writer_open(tail_fd);
+    char tail_name[16];
+    for (int i = 0; i < 100; i++) {
+        snprintf(tail_name, sizeof(tail_name), "dir/f%03d", i);
+        tar_writer_add_data(tail_writer, tail_name, "tail", 4, 0644);
+    }
+    tar_writer_close(tail_writer);
+    tar_index_build(tail_fd, "tests_tail.idx");
+    lseek(tail_fd, 0, SEEK_SET);
+    tar_iter_t *tail_it = tar_iter_open(tail_fd, 0);
+    const tar_header_t *tail_header;
+    uint64_t tail_offset = 0;
+    while (tar_iter_next(tail_it, &tail_header) == 1) tail_offset = tar_iter_offset(tail_it) - 512;
+    tar_iter_close(tail_it);
+    struct stat tail_st;
+    fstat(tail_fd, &tail_st);
+    lseek(tail_fd, tail_offset, SEEK_SET);
+    write_header(tail_fd, "dir/g099", REGTYPE, "", 4);
+    struct timespec tail_times[2] = {tail_st.st_atim, tail_st.st_mtim};
+    futimens(tail_fd, tail_times);
+    ar = tar_index_open(tail_fd, "tests_tail.idx", 0);
+    printf("tar_exists dir/g099 (last header rewritten) should return 1 and returned:%d\n", tar_exists(ar, "dir/g099"));
+    tar_close(ar);
+    close(tail_fd);
+    unlink("tests_tail.tar");
+    unlink("tests_tail.idx");
+
+    printf("\n\n==========================\n|| tar_open_gz() tests ||\n==========================\n\n");
+    gzip_copy(fd, "tests.tar.gz");
+    int gz_fd = open("tests.tar.gz", O_RDONLY);
+    ar = tar_open_gz(gz_fd, 1024);
+    printf("tar_is_dir testDir/ (gzip) should return 1 and returned:%d\n", tar_is_dir(ar, "testDir/"));
+    uint8_t gz_buffer[64] = {0};
+    size_t gz_len = sizeof(gz_buffer) - 1;
+    ssize_t gz_ret = tar_read_file(ar, "symbolic_link.txt", 12, gz_buffer, &gz_len);
+    printf("tar_read_file symbolic_link.txt at 12 (gzip) should return 0 and 'content of the target file.' and returned:%ld '%s'\n", gz_ret, (char *)gz_buffer);
+    entry = tar_entry_open(ar, "target_file.txt");
+    tar_entry_readahead(entry, 16);
+    memset(gz_buffer, 0, sizeof(gz_buffer));
+    for (gz_len = 0; (chunk = tar_entry_read(entry, gz_buffer + gz_len, 5)) > 0;) gz_len += chunk;
+    printf("tar_entry_read target_file.txt by 5 bytes (gzip) should read '%s' and read:'%s'\n", "This is the content of the target file.", (char *)gz_buffer);
+    tar_entry_close(entry);
+    tar_close(ar);
+
+    printf("tar_gz_index_build should return 0 and returned:%d\n", tar_gz_index_build(gz_fd, "tests.tar.gz.idx", 1024));
+    ar = tar_gz_index_open(gz_fd, "tests.tar.gz.idx", 1024);
+    memset(gz_buffer, 0, sizeof(gz_buffer));
+    gz_len = 4;
+    gz_ret = tar_read_file(ar, "file1.txt", 0, gz_buffer, &gz_len);
+    printf("tar_read_file file1.txt (gzip index) should return 9 and 'file' and returned:%ld '%s'\n", gz_ret, (char *)gz_buffer);
+    tar_close(ar);
+    close(gz_fd);
+    unlink("tests.tar.gz.idx");
+    unlink("tests.tar.gz");
+
+    printf("\n\n=========================\n|| tar_writer_t tests ||\n=========================\n\n");
+    int out_fd = open("tests_writer.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = tar_writer_open(out_fd);
+    static uint8_t big_data[100000];
+    for (int i = 0; i < sizeof(big_data); i++) big_data[i] = i % 251;
+    int writer_ret = tar_writer_add_file(writer, "target_file.txt", "target_file.txt");
+    writer_ret |= tar_writer_add_dir(writer, "dir", 0755);
+    writer_ret |= tar_writer_add_symlink(writer, "link", "target_file.txt");
+    writer_ret |= tar_writer_add_symlink(writer, "dir/up", "../link");
+    writer_ret |= tar_writer_add_symlink(writer, "loop_a", "loop_b");
+    writer_ret |= tar_writer_add_symlink(writer, "loop_b", "./loop_a");
+    writer_ret |= tar_writer_add_data(writer, "dir/big.bin", big_data, sizeof(big_data), 0644);
+    writer_ret |= tar_writer_add_file(writer, "tests", "tests");
+    char long_path[160];
+    memset(long_path, 'd', 120);
+    strcpy(long_path + 120, "/long_name.txt");
+    writer_ret |= tar_writer_add_data(writer, long_path, "long", 4, 0644);
+    printf("tar_writer_add_* should return 0 and returned:%d\n", writer_ret);
+    printf("tar_writer_close should return 0 and returned:%d\n", tar_writer_close(writer));
+    lseek(out_fd, 0, SEEK_SET);
+    printf("check_archive (written) should return 9 and returned:%d\n", check_archive(out_fd));
+    ar = tar_open(out_fd);
+    uint8_t written[64] = {0};
+    size_t written_len = sizeof(written) - 1;
+    ssize_t written_ret = tar_read_file(ar, "link", 0, written, &written_len);
+    printf("tar_read_file link (written) should return 0 and 'This is the content of the target file.' and returned:%ld '%s'\n", written_ret, (char *)written);
+    const char *resolved = NULL;
+    int resolve_ret = tar_resolve(ar, "dir/up", &resolved);
+    printf("tar_resolve dir/up (written) should return 0 and 'target_file.txt' and returned:%d '%s'\n", resolve_ret, resolved);
+    printf("tar_resolve loop_a (written) should return -2 and returned:%d\n", tar_resolve(ar, "loop_a", &resolved));
+    const uint8_t *written_view;
+    size_t written_view_len;
+    tar_view_file(ar, "dir/big.bin", &written_view, &written_view_len);
+    printf("dir/big.bin (written) should hold the 100000 bytes given and holds %zu bytes, %s\n", written_view_len, written_view_len == sizeof(big_data) && memcmp(written_view, big_data, sizeof(big_data)) == 0 ? "the same" : "different");
+    struct stat tests_st;
+    stat("tests", &tests_st);
+    printf("tar_is_file tests (written) should return 1 with %ld bytes and returned:%d", (long)tests_st.st_size, tar_is_file(ar, "tests"));
+    tar_lookup_t tests_lookup;
+    lseek(out_fd, 0, SEEK_SET);
+    char *tests_path[] = {"tests"};
+    tar_lookup_many(out_fd, tests_path, 1, &tests_lookup);
+    printf(" with %zu bytes\n", tests_lookup.size);
+    printf("tar_is_file of a 134 bytes path (written) should return 1 and returned:%d\n", tar_is_file(ar, long_path));
+    printf("tar_refresh (nothing appended) should return 0 and returned:%d\n", tar_refresh(ar));
+    lseek(out_fd, -2 * 512, SEEK_END); // over the two null blocks
+    writer = tar_writer_open(out_fd);
+    writer_ret = tar_writer_add_data(writer, "dir/appended.txt", "appended", 8, 0644);
+    writer_ret |= tar_writer_add_data(writer, "target_file.txt", "replaced", 8, 0644);
+    writer_ret |= tar_writer_close(writer);
+    printf("tar_writer_* (appending) should return 0 and returned:%d\n", writer_ret);
+    printf("tar_refresh should return 2 and returned:%d\n", tar_refresh(ar));
+    memset(written, 0, sizeof(written));
+    written_len = sizeof(written) - 1;
+    written_ret = tar_read_file(ar, "dir/appended.txt", 0, written, &written_len);
+    printf("tar_read_file dir/appended.txt (refreshed) should return 0 and 'appended' and returned:%ld '%s'\n", written_ret, (char *)written);
+    memset(written, 0, sizeof(written));
+    written_len = sizeof(written) - 1;
+    written_ret = tar_read_file(ar, "dir/up", 0, written, &written_len);
+    printf("tar_read_file dir/up (refreshed) should return 0 and 'replaced' and returned:%ld '%s'\n", written_ret, (char *)written);
+    struct search_count big_count = {"dir/big.bin"};
+    int search_ret = tar_search(ar, "\x05\x06\x07", 0, 4, search_counter, &big_count);
+    printf("tar_search should return at least 399 and returned:%d", search_ret);
+    printf(" with 399 matches in dir/big.bin, the first at 5, and found:%d, the first at %lu\n", big_count.matches, (unsigned long)big_count.first);
+    struct search_count icase_count = {"target_file.txt"};
+    tar_search(ar, "RePlAcEd", TAR_SEARCH_ICASE, 0, search_counter, &icase_count);
+    printf("tar_search RePlAcEd (ignoring case) should find 1 match in target_file.txt and found:%d\n", icase_count.matches);
+    tar_close(ar);
+    close(out_fd);
+    unlink("tests_writer.tar");
+
+    // a directory added from the file system keeps its modification time, as a regular file does
+    mkdir("tests_dir", 0755);
+    struct timespec dir_times[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+    utimensat(AT_FDCWD, "tests_dir", dir_times, 0);
+    out_fd = open("tests_dir.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd);
+    tar_writer_add_file(writer, "tests_dir", "tests_dir");
+    tar_writer_close(writer);
+    tar_header_t dir_header;
+    pread(out_fd, &dir_header, sizeof(dir_header), 0);
+    printf("tar_writer_add_file of a directory should keep the mtime 1000000000 and kept:%ld\n", strtol(dir_header.mtime, NULL, 8));
+    close(out_fd);
+    unlink("tests_dir.tar");
+    rmdir("tests_dir");
+
+    // the search does not read the content of a member shadowed by a later one
+    out_fd = open("tests_shadow.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd);
+    static uint8_t shadowed[2 << 20];
+    tar_writer_add_data(writer, "a.txt", "needle", 6, 0644);
+    tar_writer_add_data(writer, "b.bin", shadowed, sizeof(shadowed), 0644);
+    tar_writer_add_data(writer, "c.txt", "needle", 6, 0644);
+    tar_writer_add_data(writer, "b.bin", "replaced", 8, 0644);
+    tar_writer_close(writer);
+    ar = tar_open(out_fd);
+    struct trace_count search_traced = {0};
+    tar_stats_trace(ar, trace_begin, trace_end, &search_traced);
+    search_ret = tar_search(ar, "needle", 0, 1, search_counter, &big_count);
+    printf("tar_search (shadowed member) should return 2 reading less than 64 KiB and returned:%d reading %llu bytes\n",
+           search_ret, (unsigned long long)search_traced.bytes_read);
+    tar_close(ar);
+    close(out_fd);
+    unlink("tests_shadow.tar");
+
+    printf("\n\n==========================\n|| tar_overlay_t tests ||\n==========================\n\n");
+    int lower_fd = open("tests_lower.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(lower_fd);
+    writer_ret = tar_writer_add_data(writer, "etc/conf", "lower", 5, 0644);
+    writer_ret |= tar_writer_add_data(writer, "etc/removed", "lower", 5, 0644);
+    writer_ret |= tar_writer_add_data(writer, "etc/kept", "lower", 5, 0644);
+    writer_ret |= tar_writer_add_data(writer, "var/cache/old", "lower", 5, 0644);
+    writer_ret |= tar_writer_add_symlink(writer, "conf", "etc/conf");
+    writer_ret |= tar_writer_add_data(writer, "opt", "lower", 5, 0644);
+    writer_ret |= tar_writer_close(writer);
+    int upper_fd = open("tests_upper.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(upper_fd);
+    writer_ret |= tar_writer_add_data(writer, "etc/conf", "upper", 5, 0644);
+    writer_ret |= tar_writer_add_data(writer, "etc/.wh.removed", "", 0, 0644);
+    writer_ret |= tar_writer_add_data(writer, "var/cache/.wh..wh..opq", "", 0, 0644);
+    writer_ret |= tar_writer_add_data(writer, "var/cache/new", "upper", 5, 0644);
+    writer_ret |= tar_writer_add_data(writer, "opt/tool", "upper", 5, 0644); // opt/ only implied
+    writer_ret |= tar_writer_close(writer);
+    printf("tar_writer_* (layers) should return 0 and returned:%d\n", writer_ret);
+    tar_archive_t *layers[] = {tar_open(lower_fd), tar_open(upper_fd)};
+    tar_overlay_t *ov = tar_overlay_open(layers, 2);
+    memset(written, 0, sizeof(written));
+    written_len = sizeof(written) - 1;
+    written_ret = tar_overlay_read_file(ov, "conf", 0, written, &written_len);
+    printf("tar_overlay_read_file conf should return 0 and 'upper' and returned:%ld '%s'\n", written_ret, (char *)written);
+    printf("tar_overlay_exists etc/removed should return 0 and returned:%d\n", tar_overlay_exists(ov, "etc/removed"));
+    printf("tar_overlay_is_file etc/kept should return 1 and returned:%d\n", tar_overlay_is_file(ov, "etc/kept"));
+    printf("tar_overlay_exists var/cache/old should return 0 and returned:%d\n", tar_overlay_exists(ov, "var/cache/old"));
+    printf("tar_overlay_is_symlink conf should return 1 and returned:%d\n", tar_overlay_is_symlink(ov, "conf"));
+    printf("tar_overlay_is_file opt/tool should return 1 and returned:%d\n", tar_overlay_is_file(ov, "opt/tool"));
+    printf("tar_overlay_is_file opt (implied over a file) should return 0 and returned:%d\n", tar_overlay_is_file(ov, "opt"));
+    char *overlay_entries[16];
+    for (int i = 0; i < 16; i++) overlay_entries[i] = malloc(TAR_ENTRY_MAX);
+    size_t overlay_no_entries = 16;
+    int overlay_list = tar_overlay_list(ov, "etc", overlay_entries, &overlay_no_entries);
+    printf("tar_overlay_list etc should return 1 with 2 entries and returned:%d with %zu entries\n", overlay_list, overlay_no_entries);
+    for (int i = 0; i < 16; i++) free(overlay_entries[i]);
+    tar_overlay_close(ov);
+    tar_close(layers[0]);
+    tar_close(layers[1]);
+    close(lower_fd);
+    close(upper_fd);
+    unlink("tests_lower.tar");
+    unlink("tests_upper.tar");
+
+    printf("\n\n==========================\n|| tar_extract() tests ||\n==========================\n\n");
+    ar = tar_open(fd);
+    printf("tar_extract should return 0 and returned:%d\n", tar_extract(ar, "tests_extract", 2));
+    tar_close(ar);
+    char extracted[64] = {0};
+    int extracted_fd = open("tests_extract/file1.txt", O_RDONLY);
+    read(extracted_fd, extracted, sizeof(extracted) - 1);
+    close(extracted_fd);
+    printf("tests_extract/file1.txt should hold 'file to read.' and holds:'%s'\n", extracted);
+    memset(extracted, 0, sizeof(extracted));
+    readlink("tests_extract/symbolic_link.txt", extracted, sizeof(extracted) - 1);
+    printf("tests_extract/symbolic_link.txt should point to 'target_file.txt' and points to:'%s'\n", extracted);
+    system("rm -rf tests_extract");
+
+    // a hard link through a symlink of the archive, then a file through both, must not leave the destination
+    mkdir("tests_victim", 0755);
+    int victim_fd = open("tests_victim/secret", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(victim_fd, "secret", 6);
+    close(victim_fd);
+    int escape_fd = open("tests_escape.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_header(escape_fd, "b", SYMTYPE, "../tests_victim", 0);
+    write_header(escape_fd, "h", LNKTYPE, "b/secret", 0);
+    static const uint8_t trailer[1024];
+    write(escape_fd, trailer, sizeof(trailer));
+    ar = tar_open(escape_fd);
+    printf("tar_extract (hard link through a symlink) should return 0 and returned:%d\n", tar_extract(ar, "tests_escape", 1));
+    tar_close(ar);
+    printf("tests_escape/h should not exist and exists:%d\n", access("tests_escape/h", F_OK) == 0);
+    ftruncate(escape_fd, 0);
+    lseek(escape_fd, 0, SEEK_SET);
+    writer = tar_writer_open(escape_fd);
+    tar_writer_add_data(writer, "h", "overwritten", 11, 0644);
+    tar_writer_add_data(writer, "b/evil", "evil", 4, 0644);
+    tar_writer_close(writer);
+    ar = tar_open(escape_fd);
+    printf("tar_extract (file through a symlink) should return -1 and returned:%d\n", tar_extract(ar, "tests_escape", 1));
+    tar_close(ar);
+    close(escape_fd);
+    memset(extracted, 0, sizeof(extracted));
+    victim_fd = open("tests_victim/secret", O_RDONLY);
+    read(victim_fd, extracted, sizeof(extracted) - 1);
+    close(victim_fd);
+    printf("tests_victim/secret should hold 'secret' and holds:'%s'", extracted);
+    printf(" and tests_victim/evil should not exist and exists:%d\n", access("tests_victim/evil", F_OK) == 0);
+    system("rm -rf tests_escape tests_victim tests_escape.tar");
+
+    // a GNU long name longer than the buffers of tar_list()
+    static char huge_path[TAR_ENTRY_MAX + 1024];
+    memset(huge_path, 'x', sizeof(huge_path) - 1);
+    memcpy(huge_path, "d/", 2);
+    int huge_fd = open("tests_huge.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    write_header(huge_fd, "././@LongLink", GNUTYPE_LONGNAME, "", sizeof(huge_path));
+    write(huge_fd, huge_path, sizeof(huge_path));
+    write(huge_fd, trailer, (512 - sizeof(huge_path) % 512) % 512);
+    write_header(huge_fd, "d/x", REGTYPE, "", 0);
+    write(huge_fd, trailer, sizeof(trailer));
+    ar = tar_open(huge_fd);
+    char *huge_entries[1] = {malloc(TAR_ENTRY_MAX)};
+    size_t no_huge_entries = 1;
+    tar_list(ar, "d/", huge_entries, &no_huge_entries);
+    printf("tar_list of a %zu bytes path should truncate it to %d bytes and gave:%zu entry of %zu bytes\n",
+           sizeof(huge_path) - 1, TAR_ENTRY_MAX - 1, no_huge_entries, strnlen(huge_entries[0], TAR_ENTRY_MAX));
+    free(huge_entries[0]);
+    tar_close(ar);
+    close(huge_fd);
+    unlink("tests_huge.tar");
+
+    printf("\n\n=======================\n|| tar_iter() tests ||\n=======================\n\n");
+    lseek(fd, 0, SEEK_SET);
+    tar_iter_t *it = tar_iter_open(fd, 0);
+    const tar_header_t *header;
+    int no_headers = 0;
+    char iter_content[32] = "";
+    while (tar_iter_next(it, &header) == 1) {
+        no_headers++;
+        if (strcmp(header->name, "file1.txt") == 0) tar_iter_read(it, iter_content, sizeof(iter_content) - 1);
+    }
+    tar_iter_close(it);
+    printf("tar_iter_next should see %d entries and saw:%d\n", ret, no_headers);
+    printf("tar_iter_read file1.txt should read 'file to read.' and read:'%s'\n", iter_content);
+
+    printf("\n\n=============================\n|| tar_lookup_many() tests ||\n=============================\n\n");
+    lseek(fd, 0, SEEK_SET);
+    char *lookup_paths[] = {"testDir/", "nope.txt", "file1.txt", "testDir/"};
+    tar_lookup_t lookups[4];
+    int no_found = tar_lookup_many(fd, lookup_paths, 4, lookups);
+    printf("tar_lookup_many should find 3 paths and found:%d\n", no_found);
+    printf("tar_lookup_many file1.txt should be a file of 13 bytes and is:%c, %zu bytes\n", lookups[2].typeflag, lookups[2].size);
+    printf("tar_lookup_many testDir/ should be found twice as a directory and is:%c, %c\n", lookups[0].typeflag, lookups[3].typeflag);
+    printf("tar_lookup_many of 2^31 paths should return -1 and returned:%d\n", tar_lookup_many(fd, lookup_paths, (size_t)1 << 31, lookups));
+
+    // an archive in the GNU format, whose long names come in their own headers
+    char gnu_long[160];
+    snprintf(gnu_long, sizeof(gnu_long), "tests_gnu/%0130d.txt", 0);
+    system("rm -rf tests_gnu && mkdir tests_gnu && echo gnu > tests_gnu/short.txt");
+    int gnu_fd = open(gnu_long, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(gnu_fd, "long name\n", 10);
+    close(gnu_fd);
+    system("tar --format=gnu -cf tests_gnu.tar tests_gnu");
+    gnu_fd = open("tests_gnu.tar", O_RDONLY);
+    char *gnu_paths[] = {"tests_gnu/short.txt", gnu_long};
+    tar_lookup_t gnu_lookups[2];
+    int gnu_found = tar_lookup_many(gnu_fd, gnu_paths, 2, gnu_lookups);
+    printf("tar_lookup_many (GNU format) should find 2 paths and found:%d\n", gnu_found);
+    printf("tar_lookup_many (GNU format) long name should be a file of 10 bytes and is:%c, %zu bytes\n",
+           gnu_lookups[1].typeflag, gnu_lookups[1].size);
+    close(gnu_fd);
+    system("rm -rf tests_gnu tests_gnu.tar");
+
+    printf("\n\n==============================\n|| read_files_batch() tests ||\n==============================\n\n");
+    uint8_t batch_buffers[3][64] = {{0}};
+    tar_read_req_t batch[3] = {
+        {"target_file.txt", 8, batch_buffers[0], 63},
+        {"nope.txt", 0, batch_buffers[1], 63},
+        {"file1.txt", 0, batch_buffers[2], 4},
+    };
+    int batch_ret = read_files_batch(fd, batch, 3);
+    printf("read_files_batch should return 0 and returned:%d\n", batch_ret);
+    printf("target_file.txt at 8 should return 0 and 'the content of the target file.' and returned:%ld '%s'\n", batch[0].ret, (char *)batch_buffers[0]);
+    printf("nope.txt should return -1 and returned:%ld\n", batch[1].ret);
+    printf("file1.txt should return 9 and 'file' and returned:%ld '%s'\n", batch[2].ret, (char *)batch_buffers[2]);
+
+    printf("\n\n============================\n|| tar_read_async() tests ||\n============================\n\n");
+    for (int engine = 0; engine < 2; engine++) {
+        uint8_t async_buffers[2][64] = {{0}};
+        struct async_result async_results[2] = {{0}};
+        ar = tar_open(fd);
+        tar_async_setup(ar, 0, 2, engine == 0 ? 0 : TAR_ASYNC_THREADS);
+        tar_read_async(ar, "symbolic_link.txt", 0, async_buffers[0], 63, async_done, &async_results[0]);
+        tar_read_async(ar, "testDir/", 0, async_buffers[1], 63, async_done, &async_results[1]);
+        int polled = tar_async_poll(ar, 2);
+        printf("tar_async_poll (%s) should run 2 callbacks and ran:%d\n", engine == 0 ? "default" : "threads", polled);
+        printf("symbolic_link.txt should return 0 and '%s' and returned:%ld '%s'\n", "This is the content of the target file.", async_results[0].ret, (char *)async_buffers[0]);
+        printf("testDir/ should return -1 and returned:%ld\n", async_results[1].ret);
+        tar_close(ar);
+    }
+
+    printf("\n\n=======================\n|| threading tests ||\n=======================\n\n");
+    pthread_t threads[STRESS_THREADS];
+    long mismatches = 0;
+    ar = tar_open(fd);
+    for (int i = 0; i < STRESS_THREADS; i++) pthread_create(&threads[i], NULL, stress_worker, ar);
+    for (int i = 0; i < STRESS_THREADS; i++) {
+        void *thread_mismatches;
+        pthread_join(threads[i], &thread_mismatches);
+        mismatches += (long)thread_mismatches;
+    }
+    tar_stats_t stats;
+    tar_stats_get(ar, &stats);
+    tar_close(ar);
+    printf("%d threads sharing a handle should get 0 wrong answers and got:%ld\n", STRESS_THREADS, mismatches);
+
+    printf("\n\n===========================\n|| tar_stats_get() tests ||\n===========================\n\n");
+    printf("tar_stats_get should count %d tar_exists calls and counted:%llu\n", STRESS_THREADS * STRESS_ROUNDS,
+           (unsigned long long)stats.ops[TAR_OP_EXISTS].calls);
+    ar = tar_open(fd);
+    tar_stats_get(ar, &stats);
+    printf("tar_open should visit %d headers and visited:%llu\n", ret, (unsigned long long)stats.ops[TAR_OP_OPEN].headers);
+    tar_stats_reset(ar);
+    struct trace_count traced = {0};
+    tar_stats_trace(ar, trace_begin, trace_end, &traced);
+    uint8_t stats_buffer[64];
+    size_t stats_len = sizeof(stats_buffer);
+    tar_read_file(ar, "file1.txt", 0, stats_buffer, &stats_len);
+    tar_stats_get(ar, &stats);
+    printf("tar_stats_reset should clear the tar_open calls and left:%llu\n", (unsigned long long)stats.ops[TAR_OP_OPEN].calls);
+    printf("tar_read_file should read 13 bytes in 1 call and read:%llu in %llu\n",
+           (unsigned long long)stats.ops[TAR_OP_READ_FILE].bytes_read, (unsigned long long)stats.ops[TAR_OP_READ_FILE].syscalls);
+    printf("the trace hooks should see 1 call of 13 bytes and saw:%d, %d of %llu bytes\n", traced.begins, traced.ends,
+           (unsigned long long)traced.bytes_read);
+    tar_close(ar);
+
+    printf("\n\n======================\n|| tar_remote tests ||\n======================\n\n");
+    pid_t server = fork();
+    if (server == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 2);
+        execl("./tar_server", "tar_server", "tests.sock", argv[1], NULL);
+        _exit(127);
+    }
+    tar_remote_t *remotes[2] = {NULL, NULL};
+    for (int i = 0; i < 200 && remotes[0] == NULL; i++) {
+        remotes[0] = tar_remote_open("tests.sock", argv[1], 0);
+        if (remotes[0] == NULL) usleep(10000);
+    }
+    remotes[1] = tar_remote_open("tests.sock", argv[1], TAR_REMOTE_COPY);
+    printf("tar_remote_open should return 2 handles and returned:%d\n", (remotes[0] != NULL) + (remotes[1] != NULL));
+    if (remotes[0] != NULL && remotes[1] != NULL) {
+        printf("tar_remote_is_dir testDir/ should return 1 and returned:%d\n", tar_remote_is_dir(remotes[0], "testDir/"));
+        printf("tar_remote_exists nope.txt should return 0 and returned:%d\n", tar_remote_exists(remotes[0], "nope.txt"));
+        tar_lookup_t remote_st;
+        tar_remote_stat(remotes[0], "symbolic_link.txt", &remote_st);
+        printf("tar_remote_stat symbolic_link.txt should find a file of 39 bytes and found:%d, %c, %zu bytes\n", remote_st.found,
+               remote_st.typeflag, remote_st.size);
+        char remote_entry_buffers[4][TAR_ENTRY_MAX];
+        char *remote_entries[4] = {remote_entry_buffers[0], remote_entry_buffers[1], remote_entry_buffers[2], remote_entry_buffers[3]};
+        size_t remote_no_entries = 4;
+        int remote_list = tar_remote_list(remotes[0], "testDir/", remote_entries, &remote_no_entries);
+        printf("tar_remote_list testDir/ should return 1 with 2 entries and returned:%d with %zu entries\n", remote_list, remote_no_entries);
+        for (int i = 0; i < 2; i++) {
+            uint8_t remote_buffer[64] = {0};
+            size_t remote_len = sizeof(remote_buffer) - 1;
+            ssize_t remote_ret = tar_remote_read_file(remotes[i], "symbolic_link.txt", 12, remote_buffer, &remote_len);
+            printf("tar_remote_read_file symbolic_link.txt at 12 (%s) should return 0 and 'content of the target file.' and returned:%ld '%s'\n",
+                   i == 0 ? "descriptor" : "copy", remote_ret, (char *)remote_buffer);
+        }
+        size_t remote_len = 8;
+        printf("tar_remote_read_file testDir/ should return -1 and returned:%ld\n", tar_remote_read_file(remotes[1], "testDir/", 0, NULL, &remote_len));
+    }
+    tar_remote_close(remotes[0]);
+    tar_remote_close(remotes[1]);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
     close(fd);
 
     return 0;